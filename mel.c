@@ -45,6 +45,18 @@
 #include <curl/curl.h>
 #include <json-c/json.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#endif
 
 /*** Define section ***/
 
@@ -66,10 +78,41 @@
 #define NO_STATUS false
 #define DEFAULT_COLUMN_MARKER 0
 #define STATUS_YES true
-// Max Undo/Redo Operations
-// Set to -1 for unlimited Undo
+// Search flags
+#define SEARCH_IGNORE_CASE (1 << 0)
+#define SEARCH_REGEX (1 << 1)
+// Bytes of undo history kept by default (-u | --undo-budget)
 // Set to 0 to disable Undo
-#define ACTIONS_LIST_MAX_SIZE 80
+#define UNDO_BUDGET_DEFAULT (8 << 20)
+#define UNDO_NOT_CLEAN SIZE_MAX
+// FNV-1a, hashing file contents and paths.
+#define FNV_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+// Bytes copied at a time when making backups
+#define BACKUP_CHUNK (1 << 20)
+// Bytes read at a time when loading files
+#define LOAD_CHUNK (1 << 20)
+// Rows from this size on are cut in chunks (see Long rows section)
+#define LONG_ROW_SIZE (1 << 16)
+#define LONG_ROW_CHUNK 4096
+// Render columns before an edit highlighted again, covering the longest
+// token the highlighter looks ahead for
+#define LEX_LOOKBACK 64
+// Render columns a long row may be highlighted up to when drawing it or
+// after an edit, further it is left to editorIdle()
+#define LEX_MAX_COLUMNS (1 << 20)
+// Render columns highlighted on each idle call, in slices between which
+// a key pressed stops it
+#define LEX_IDLE_COLUMNS (4 << 20)
+#define LEX_SLICE_COLUMNS (64 << 10)
+// Compression of files (see the File I/O section)
+#define COMPRESS_NONE 0
+#define COMPRESS_GZIP 1
+#define COMPRESS_ZSTD 2
+// Journal entry kinds
+#define JOURNAL_EDIT 'E'
+#define JOURNAL_UNDO 'U'
+#define JOURNAL_REDO 'R'
 
 
 struct a_buf {
@@ -84,6 +127,53 @@ void editorDrawMessageBar(struct a_buf* ab);
 
 /*** Data section ***/
 
+// A run of like clusters of a row that aren't one char, one render byte
+// and one screen column each: a tab, or UTF-8 sequences. A tab is one
+// char rendered as width spaces, a sequence is rendered as it is. Between
+// runs the three go one for one.
+struct wide_run {
+    int x;              // Index in chars of the first cluster
+    int render;         // Index in render of it
+    int col;            // Screen column of it
+    int count;          // Clusters in the run
+    unsigned char bytes; // Chars of each cluster, 1 for a tab
+    unsigned char width; // Screen columns of each cluster
+};
+
+// Positions along a row, see struct wide_run.
+enum row_coord {
+    ROW_CHARS,
+    ROW_RENDER,
+    ROW_COLUMNS
+};
+
+// State of the highlighter at the start of a chunk of a long row.
+struct lex_state {
+    int skip;           // Columns of the chunk a token started before covers
+    int in_comment;
+    int in_string;      // Quote of the open string, 0 if none
+    int prev_sep;
+    int prev_hl;        // Highlight of the column before
+    int line_comment;   // The rest of the row is a comment
+};
+
+struct row_chunk {
+    int start;          // First char of the chunk
+    int render_start;   // Render column of that char
+    struct lex_state lex;
+};
+
+struct row_chunks {
+    struct row_chunk* chunk;
+    int num;
+    int cap;
+    int lexed;          // Chunks highlighted, the others may be from before an edit
+    int dirty_to;       // Render column the row changed up to since it was highlighted whole,
+                        // INT_MAX if it never was
+    bool resume_valid;  // Highlighting stopped in the middle, resume from there
+    struct lex_state resume;
+};
+
 typedef struct editor_row {
     int idx; // Row own index within the file.
     int size; // Size of the content (excluding NULL term)
@@ -92,6 +182,12 @@ typedef struct editor_row {
     char* render; // Row content "rendered" for screen (for TABs).
     unsigned char* highlight; // This will tell you if a character is part of a string, comment, number...
     int hl_open_comment; // True if the line is part of a ML comment.
+    int match_count; // Matches of the active search query, -1 if not counted yet.
+    int frozen; // chars are being saved, copy them before changing them.
+    struct wide_run* wide; // Tabs and UTF-8 sequences, in order.
+    int num_wide;
+    struct row_chunks* chunks; // Chunks of a long row, NULL for the others.
+    int wrap_lines; // Screen lines of the row with soft wrap, 0 if not counted yet.
 } editor_row;
 
 struct editor_syntax {
@@ -126,32 +222,76 @@ enum ActionType {
     NewLine,
     InsertChar,
     DelChar,
+    Transaction,
 };
 typedef enum ActionType ActionType;
 
 typedef struct Action Action;
-typedef struct AListNode AListNode;
-typedef struct ActionList ActionList;
 
+// A run of rows changed by a transaction being recorded.
+struct undo_hunk {
+    int at;             // First row of the run, after the edit
+    int num_present;    // Rows of the run after the edit
+    int num_stored;     // Rows of the run before the edit
+    int max_stored;     // Room in lines and sizes
+    char** lines;       // Content of the rows before the edit
+    int* sizes;
+};
+
+// A transaction groups a bulk edit into one undo record, holding only
+// the runs of rows it changed, sorted by row.
+struct undo_diff {
+    struct undo_hunk* hunks;
+    int num_hunks;
+    int max_hunks;
+    int open_tail;      // Rows after the run being edited, -1 if none is
+    int before_x;       // Cursor before the edit
+    int before_y;
+    bool joined;        // Undone and redone along with the record before
+};
+
+// An undo record decoded from the undo log. string and diff point into
+// the log.
 struct Action {
     ActionType t;
     int cpos_x;
     int cpos_y;
     bool cursor_on_tilde;
     char* string;
+    const unsigned char* diff;  // Encoded rows changed by a Transaction
+    bool joined;                // Goes with the record before it
 };
 
-struct AListNode {
-    Action* action;
-    AListNode* next;
-    AListNode* prev;
+// Append-only log of undo records in a single arena.
+struct undo_log {
+    unsigned char* buf;
+    size_t len;         // Bytes of records
+    size_t cap;
+    size_t current;     // End of the last record applied, those after it can be redone
+    size_t last;        // Start of the last record
+    size_t budget;      // Bytes the log may take, 0 disables undo
+    size_t clean;       // Offset matching the file on disk, UNDO_NOT_CLEAN if none
+    size_t saving;      // Offset matching the file being saved, UNDO_NOT_CLEAN if none
+    bool trimmed;       // Old records were dropped to fit the budget
 };
 
-struct ActionList {
-    AListNode* head;
-    AListNode* tail;
-    AListNode* current;
-    int size;
+struct search_query;
+
+// Prefix sums of the screen lines of the rows with soft wrap, as a
+// Fenwick tree, for the rows' wrap_lines at the given text width.
+struct wrap_index {
+    int* tree;          // tree[1..num]
+    int num;            // Rows in the tree, -1 when they changed
+    int cap;
+    int width;          // Text width the rows were counted at
+};
+
+// Prefix sums of the rows' match_count, stale rows counting 0, as a
+// Fenwick tree like the wrap index.
+struct match_sums {
+    int* tree;          // tree[1..num]
+    int num;            // Rows in the tree, -1 when they changed
+    int cap;
 };
 
 struct editor_config {
@@ -164,18 +304,45 @@ struct editor_config {
 	int column_marker;      // Position of the column marker (0 = disabled)
     int screen_rows;     // Number of rows that we can show
     int screen_cols;     // Number of cols that we can show
+    int screen_top;      // Where the pane shown starts on the screen
+    int screen_left;
+    int window_rows;     // The terminal less the bars, split into panes
+    int window_cols;
     int num_rows;        // Number of rows
+    int row_cap;         // Rows allocated
     editor_row* row;
     int dirty;          // To know if a file has been modified since opening.
     unsigned show_line_numbers : 1;  // 1 = show, 0 = hide
+    unsigned soft_wrap : 1;          // Wrap rows at the screen edge (Ctrl-O)
+    int wrap_offset;     // Screen line of row_offset at the top, with soft wrap
+    int wrap_cursor;     // Screen line of the cursor, with soft wrap
+    struct wrap_index wrap;
 	unsigned create_backup : 1;      // New: 1 = create backup, 0 = don't create backup
+    int keep_backups;   // Backups kept, .bak then .bak.1 and up
+    int autosave;       // Seconds between autosaves to the swap file, 0 if none
+    int follow;         // Follow the file as it grows (--follow)
+    long dropped_rows;  // Oldest rows of the input dropped to stay under -m
+    int compression;    // COMPRESS_* format of the file
+    int compression_level;
     char* file_name;
     char status_msg[80];
     time_t status_msg_time;
     char* copied_char_buffer;
+    int search_flags;   // SEARCH_* flags used by Ctrl-F and Ctrl-J
+    int jobs;           // Threads used to search large files
+    struct search_query* search_query; // Query highlighted on screen, NULL if none
+    int search_total;   // Matches of search_query in counted rows
+    int search_stale;   // Rows whose matches have to be counted again
+    int search_current; // Position of the current match among all, 0 if unknown
+    struct match_sums search_sums;
+    int search_match_row; // Row of the current match, -1 if none
+    int search_match_col; // Render column of the current match
     struct editor_syntax* syntax;
+    bool lex_pending;   // Long rows are left partly highlighted after edits
     struct termios orig_termios;
-    ActionList* actions;
+    struct undo_log undo;
+    struct undo_diff* transaction; // Transaction being recorded, NULL if none
+    int transaction_depth;         // Nesting level of transactionBegin()
 } ec;
 
 
@@ -342,7 +509,7 @@ char* RUBY_HL_keywords[] = {
 char* GO_HL_keywords[] = {
 	"break", "case", "chan", "const", "continue", "default", "defer", "else", "fallthrough", "for",
 	"func", "go", "goto", "if", "import", "interface", "map", "package", "range", "return", "select",
-	"struct", "switch", "type", "var"
+	"struct", "switch", "type", "var", NULL
 };
 
 char* MSHELL_HL_keywords[] = {
@@ -477,6 +644,8 @@ void editorClearScreen();
 
 void editorRefreshScreen();
 
+void editorProcessKeypress();
+
 void editorSetStatusMessage(const char* msg, ...);
 
 void consoleBufferOpen();
@@ -495,6 +664,152 @@ void editorDisplayHelpPage();
 
 void editorReplace();
 
+void searchIndexUpdate();
+
+int searchIndexLocate(int row, int col);
+
+void searchIndexInvalidateRow(editor_row* row);
+
+void searchSumsReset();
+
+void searchSumsRowsMoved(int at);
+
+void searchSumsSwapRows(int i);
+
+void wrapIndexReset();
+
+void wrapIndexRowsMoved(int at);
+
+void wrapIndexInvalidateRow(editor_row* row);
+
+void wrapIndexSwapRows(int i);
+
+void wrapScroll();
+
+void wrapPage(int key);
+
+void transactionBegin();
+
+bool journalActive();
+
+void journalRecord(int kind, const unsigned char* record, size_t len);
+
+void journalAction(Action* action);
+
+void journalIdle();
+
+void editorIdle();
+
+void journalSetFile(const char* file_name);
+
+char* hiddenFilePath(const char* file_name, const char* suffix);
+
+void editorRowReleaseChars(editor_row* row);
+
+void rowChunksFree(editor_row* row);
+
+int rowWideFind(const editor_row* row, int v, enum row_coord coord);
+int rowMapX(const editor_row* row, enum row_coord from, enum row_coord to, int v);
+int rowCluster(const editor_row* row, int x, int* len);
+
+bool editorLexIdle();
+
+bool stdinHasInput();
+
+void editorRowThaw(editor_row* row);
+
+void saveKeepChars(char* chars);
+
+bool streamIdle();
+
+void followOpen(char* file_name);
+
+void bufferInit();
+
+int bufferAdd(const char* file_name);
+
+void bufferSwitch(int i);
+
+void bufferNext();
+
+void bufferRecover();
+
+int bufferFind(const char* file_name);
+
+const char* bufferStatus();
+
+void bufferOpen();
+
+int bufferModified();
+
+void bufferDiscard();
+
+bool bufferStreamIdle();
+
+bool ollamaIdle();
+
+bool ollamaCancel();
+
+void paneLayout();
+
+void paneDrawAll(struct a_buf* ab);
+
+void paneShowBuffer();
+
+void paneRowsMoved(int at, int delta);
+
+void paneSplit(bool side_by_side);
+
+void paneNext();
+
+void paneClose();
+
+bool serverAttach(char** files, int num_files);
+
+void serverRun(char** files, int num_files);
+
+int batchRun(char** files, int num_files);
+
+bool serverLeave();
+
+bool serverDetaching();
+
+void serverIdle();
+
+void undoForget();
+
+void searchIndexReset();
+
+int compressionFromName(const char* file_name, int* level);
+
+int compressionStripSuffix(const char* file_name);
+
+void saveStart(const char* path, bool autosave);
+
+void saveWait();
+
+void saveIdle();
+
+void saveDiscard();
+
+const char* saveProgress();
+
+void undoHistorySetFile(const char* file_name);
+
+bool undoHistoryLoad();
+
+void undoHistorySave(uint64_t hash, size_t end);
+
+uint64_t fnvHash(uint64_t h, const void* data, size_t len);
+
+void transactionCommit();
+
+void transactionJoin();
+
+void transactionSaveRows(int at, int count);
+
+void transactionKeepRow(int at, char* chars, int size);
+
 // Add this to the declarations section where other function prototypes are declared
 void editorInsertRow(int at, const char* s, size_t len);
 
@@ -518,8 +833,12 @@ void enableRawMode() {
     // Save original terminal state into orig_termios.
     if (tcgetattr(STDIN_FILENO, &ec.orig_termios) == -1)
         die("Failed to get current terminal state");
-    // At exit, restore the original state.
-    atexit(disableRawMode);
+    // At exit, restore the original state (the server attaches more
+    // than one terminal).
+    static bool restore_at_exit = false;
+    if (!restore_at_exit)
+        atexit(disableRawMode);
+    restore_at_exit = true;
 
     // Modify the original state to enter in raw mode.
     struct termios raw = ec.orig_termios;
@@ -554,13 +873,27 @@ void enableRawMode() {
         die("Failed to set raw mode");
 }
 
+// A byte read past a UTF-8 sequence, returned by the next editorReadKey().
+static int key_pending = -1;
+
 int editorReadKey() {
     int nread;
     char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        // Ignoring EAGAIN to make it work on Cygwin.
-        if (nread == -1 && errno != EAGAIN)
-            die("Error reading input");
+    if (key_pending != -1) {
+        c = key_pending;
+        key_pending = -1;
+    } else {
+        while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+            // Ignoring EAGAIN to make it work on Cygwin. The server lets
+            // a terminal that fails go.
+            if (nread == -1 && errno != EAGAIN && !serverLeave())
+                die("Error reading input");
+            if (nread == 0)
+                editorIdle();
+            // Prompts give up too when the terminal is let go.
+            if (serverDetaching())
+                return '\x1b';
+        }
     }
 
     // Check escape sequences, if first byte
@@ -619,8 +952,39 @@ int editorReadKey() {
         }
         return '\x1b';
     } else {
-        return c;
+        return (unsigned char) c;
+    }
+}
+
+// Reads the rest of the UTF-8 sequence whose first byte is c, all in seq.
+// Returns its length.
+int editorReadUtf8(int c, char seq[4]) {
+    seq[0] = c;
+    int len = c >= 0xf8 ? 1 : c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+    for (int i = 1; i < len; i++) {
+        char b;
+        if (read(STDIN_FILENO, &b, 1) != 1)
+            return i;
+        if ((b & 0xc0) != 0x80) {
+            key_pending = (unsigned char) b;
+            return i;
+        }
+        seq[i] = b;
     }
+    return len;
+}
+
+// Background work done while waiting for a key, about every 1/10 of a
+// second (VTIME) while the user isn't typing.
+void editorIdle() {
+    serverIdle();
+    journalIdle();
+    saveIdle();
+    bool redraw = bufferStreamIdle();
+    if (ollamaIdle())
+        redraw = true;
+    if (editorLexIdle() || redraw)
+        editorRefreshScreen();
 }
 
 int checkFilePermissions(const char* filename) {
@@ -657,73 +1021,104 @@ int getWindowSize(int* screen_rows, int* screen_cols) {
     }
 }
 
+// Copies what is left of in to out, both at their file positions. Tries
+// a reflink first, which shares the blocks on copy-on-write filesystems,
+// then copies in the kernel, then through a large buffer.
+static bool copyFileData(int in, int out) {
+#ifdef __linux__
+    if (ioctl(out, FICLONE, in) == 0)
+        return true;
+
+    // Each way copies what it can and leaves the rest to the next one.
+    ssize_t n;
+    while ((n = copy_file_range(in, NULL, out, NULL, BACKUP_CHUNK, 0)) > 0) {}
+    if (n == 0)
+        return true;
+    while ((n = sendfile(out, in, NULL, BACKUP_CHUNK)) > 0) {}
+    if (n == 0)
+        return true;
+#endif
+    char* buf = malloc(BACKUP_CHUNK);
+    if (!buf) die("Failed to allocate backup buffer");
+    ssize_t len;
+    bool ok = true;
+    while (ok && ((len = read(in, buf, BACKUP_CHUNK)) > 0 || (len < 0 && errno == EINTR))) {
+        for (ssize_t done = 0, w; ok && done < len; done += w > 0 ? w : 0) {
+            w = write(out, buf + done, len - done);
+            ok = w >= 0 || errno == EINTR;
+        }
+    }
+    free(buf);
+    return ok && len == 0;
+}
+
+// Shifts the backups of filename up by one, dropping the oldest, to make
+// room for a new filename.bak.
+static void rotateBackupFiles(const char* filename) {
+    char from[PATH_MAX], to[PATH_MAX];
+    for (int i = ec.keep_backups - 1; i > 0; i--) {
+        if (i > 1)
+            snprintf(from, sizeof(from), "%s.bak.%d", filename, i - 1);
+        else
+            snprintf(from, sizeof(from), "%s.bak", filename);
+        snprintf(to, sizeof(to), "%s.bak.%d", filename, i);
+        rename(from, to);
+    }
+}
+
+// Copies filename to filename.bak, shifting the older backups up. The
+// copy is made under a temporary name first, so the backups are left as
+// they were if it fails.
 int createBackupFile(const char* filename) {
     if (!filename) return 0;
     
     // Create backup filename
-    char backup_name[PATH_MAX];
+    char backup_name[PATH_MAX], tmp[PATH_MAX + 8];
     snprintf(backup_name, sizeof(backup_name), "%s.bak", filename);
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", backup_name);
     
-    // Try to copy the file
-    FILE* source = fopen(filename, "rb");
-    if (!source) return 0;  // Source file doesn't exist or can't be opened
-    
-    FILE* backup = fopen(backup_name, "wb");
-    if (!backup) {
-        fclose(source);
+    int source = open(filename, O_RDONLY | O_CLOEXEC);
+    if (source == -1) return 0;  // Source file doesn't exist or can't be opened
+    struct stat st;
+    if (fstat(source, &st) == -1) {
+        close(source);
         return 0;
     }
-    
-    int success = 1;
-    char buf[4096];
-    size_t bytes;
-    
-    // Copy the file
-    while ((bytes = fread(buf, 1, sizeof(buf), source)) > 0) {
-        if (fwrite(buf, 1, bytes, backup) != bytes) {
-            success = 0;
-            break;
-        }
+
+    int backup = mkstemp(tmp);
+    if (backup == -1) {
+        close(source);
+        return 0;
     }
     
-    fclose(source);
-    fclose(backup);
+    int success = fchmod(backup, st.st_mode & 0777) == 0 && copyFileData(source, backup);
+    close(source);
+    if (close(backup) == -1)
+        success = 0;
+    if (success) {
+        rotateBackupFiles(filename);
+        success = rename(tmp, backup_name) == 0;
+    }
+    if (!success)
+        unlink(tmp);
     
     return success;
 }
 
 void editorUpdateWindowSize() {
-    if (getWindowSize(&ec.screen_rows, &ec.screen_cols) == -1)
+    if (getWindowSize(&ec.window_rows, &ec.window_cols) == -1)
         die("Failed to get window size");
-    ec.screen_rows -= 2; // Room for the status bar.
+    ec.window_rows -= 2; // Room for the status bar.
+    paneLayout();
 }
 
 
-// Add this function to handle reading from stdin
-void editorOpenFromStdin() {
-    char* line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    
-    // Read line by line from stdin
-    while ((linelen = getline(&line, &linecap, stdin)) != -1) {
-        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-            linelen--;
-        editorInsertRow(ec.num_rows, line, linelen);
-    }
-    
-    free(line);
-    ec.dirty = 0;  // Consider stdin content as "saved"
-    ec.file_name = NULL;  // No filename for stdin content
-}
 
 
 void editorHandleSigwinch() {
+    // The cursor stays where it is in the file, editorScroll() brings it
+    // into view (and with soft wrap, counts the screen lines again).
     editorUpdateWindowSize();
-    if (ec.cursor_y > ec.screen_rows)
-        ec.cursor_y = ec.screen_rows - 1;
-    if (ec.cursor_x > ec.screen_cols)
-        ec.cursor_x = ec.screen_cols - 1;
     editorRefreshScreen();
 }
 
@@ -735,18 +1130,23 @@ void editorRefreshScreen() {
     abufAppend(&ab, "\x1b[?25l", 6);  // Hide cursor
     abufAppend(&ab, "\x1b[H", 3);     // Reset cursor position
 
-    editorDrawRows(&ab);
+    paneDrawAll(&ab);
     
     // Status bar (inverted colors)
+    char status_pos[32];
+    snprintf(status_pos, sizeof(status_pos), "\x1b[%d;1H", ec.window_rows + 1);
+    abufAppend(&ab, status_pos, strlen(status_pos));
     abufAppend(&ab, "\x1b[7m", 4);
     
     // Calculate file info (left side)
     char left_status[80];
-    int left_len = snprintf(left_status, sizeof(left_status), " %.20s - %d lines %s",
+    int left_len = snprintf(left_status, sizeof(left_status), " %s%.20s - %d lines %s%s",
+        bufferStatus(),
         ec.file_name ? ec.file_name : "[No Name]", 
         ec.num_rows,
-        ec.dirty ? "(modified)" : "");
-    if (left_len > ec.screen_cols) left_len = ec.screen_cols;
+        ec.dirty ? "(modified)" : "",
+        saveProgress());
+    if (left_len > ec.window_cols) left_len = ec.window_cols;
 
     // Calculate cursor info (right side)
     char right_status[80];
@@ -757,7 +1157,7 @@ void editorRefreshScreen() {
     abufAppend(&ab, left_status, left_len);
 
     // Fill middle with spaces
-    int padding = ec.screen_cols - left_len - right_len;
+    int padding = ec.window_cols - left_len - right_len;
     while (padding-- > 0) {
         abufAppend(&ab, " ", 1);
     }
@@ -771,10 +1171,33 @@ void editorRefreshScreen() {
 
     // Message bar
     abufAppend(&ab, "\x1b[K", 3);  // Clear the message bar line
+    char counter[48] = "";
+    int counter_len = 0;
+    if (ec.search_query) {
+        searchIndexUpdate();
+        if (ec.search_stale == 0 && ec.search_current == 0 &&
+            ec.search_match_row >= 0 && ec.search_match_row < ec.num_rows)
+            ec.search_current = searchIndexLocate(ec.search_match_row, ec.search_match_col);
+
+        if (ec.search_stale > 0)
+            counter_len = snprintf(counter, sizeof(counter), "counting matches...");
+        else if (ec.search_total == 0)
+            counter_len = snprintf(counter, sizeof(counter), "no matches");
+        else if (ec.search_current == 0)
+            counter_len = snprintf(counter, sizeof(counter), "%d matches", ec.search_total);
+        else
+            counter_len = snprintf(counter, sizeof(counter), "match %d of %d",
+                ec.search_current, ec.search_total);
+        if (counter_len >= ec.window_cols) counter_len = 0;
+    }
     int msglen = strlen(ec.status_msg);
-    if (msglen > ec.screen_cols) msglen = ec.screen_cols;
-    if (msglen && time(NULL) - ec.status_msg_time < 5) {
-        abufAppend(&ab, ec.status_msg, msglen);
+    if (msglen > ec.window_cols - counter_len) msglen = ec.window_cols - counter_len;
+    if (!(msglen && time(NULL) - ec.status_msg_time < 5)) msglen = 0;
+    abufAppend(&ab, ec.status_msg, msglen);
+    if (counter_len) {
+        for (int i = msglen + counter_len; i < ec.window_cols; i++)
+            abufAppend(&ab, " ", 1);
+        abufAppend(&ab, counter, counter_len);
     }
 
     // Position cursor
@@ -784,8 +1207,8 @@ void editorRefreshScreen() {
         cursor_screen_x += 8;
     }
     snprintf(buf, sizeof(buf), "\x1b[%d;%dH", 
-             (ec.cursor_y - ec.row_offset) + 1,
-             cursor_screen_x + 1);
+             ec.screen_top + (ec.soft_wrap ? ec.wrap_cursor : ec.cursor_y - ec.row_offset) + 1,
+             ec.screen_left + cursor_screen_x + 1);
     abufAppend(&ab, buf, strlen(buf));
 
     abufAppend(&ab, "\x1b[?25h", 6);  // Show cursor
@@ -843,22 +1266,16 @@ int isAlsoNumber(int c) {
     return c == '.' || c == 'x' || c == 'a' || c == 'b' || c == 'c' || c == 'd' || c == 'e' || c == 'f';
 }
 
-void editorUpdateSyntax(editor_row* row) {
-    if (!row || row->render_size <= 0) {
-        if (row && row->highlight) {
-            free(row->highlight);
-            row->highlight = NULL;
-        }
-        return;
-    }
-
-    row->highlight = realloc(row->highlight, row->render_size > 0 ? row->render_size : 1);
-    if (!row->highlight) {
-        exit(EXIT_FAILURE);
+// Highlights the render columns of a row from i until end (or a little
+// past it, for a token starting before end) from the state st, and leaves
+// in st the state reached. Returns the column it stopped at. Columns
+// left as they are must have been set to HL_NORMAL.
+static int editorHighlightSpan(editor_row* row, int i, int end, struct lex_state* st) {
+    if (st->line_comment) {
+        if (i < end)
+            memset(&row->highlight[i], HL_SL_COMMENT, end - i);
+        return i > end ? i : end;
     }
-    memset(row->highlight, HL_NORMAL, row->render_size);
-
-    if (!ec.syntax) return;
 
     char** keywords = ec.syntax->keywords;
     char* scs = ec.syntax->singleline_comment_start;
@@ -869,18 +1286,19 @@ void editorUpdateSyntax(editor_row* row) {
     int mcs_len = mcs ? strlen(mcs) : 0;
     int mce_len = mce ? strlen(mce) : 0;
 
-    int prev_sep = 1;
-    int in_string = 0;
-    int in_comment = (row->idx > 0 && ec.row[row->idx - 1].hl_open_comment);
+    int in_comment = st->in_comment;
+    int in_string = st->in_string;
+    int prev_sep = st->prev_sep;
 
-    int i = 0;
-    while (i < row->render_size) {
-        char c = row->render[i];
+    while (i < end) {
+        unsigned char c = row->render[i];
         unsigned char prev_hl = (i > 0) ? row->highlight[i - 1] : HL_NORMAL;
 
         if (scs_len && !in_string && !in_comment) {
             if (!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->highlight[i], HL_SL_COMMENT, row->render_size - i);
+                memset(&row->highlight[i], HL_SL_COMMENT, end - i);
+                st->line_comment = 1;
+                i = end;
                 break;
             }
         }
@@ -945,7 +1363,7 @@ void editorUpdateSyntax(editor_row* row) {
                 if (kw_flag) klen--;
 
                 if (!strncmp(&row->render[i], keywords[j], klen) &&
-                    isSeparator(row->render[i + klen])) {
+                    isSeparator((unsigned char) row->render[i + klen])) {
                     memset(&row->highlight[i], kw_flag ? HL_KEYWORD_2 : HL_KEYWORD_1, klen);
                     i += klen;
                     prev_sep = 0;
@@ -958,11 +1376,72 @@ void editorUpdateSyntax(editor_row* row) {
         i++;
     }
 
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
+    st->in_comment = in_comment;
+    st->in_string = in_string;
+    st->prev_sep = prev_sep;
+    return i;
+}
 
-    if (changed && row->idx + 1 < ec.num_rows) {
-        editorUpdateSyntax(&ec.row[row->idx + 1]);
+// Highlights a row starting in the multiline comment state in_comment.
+// Touches nothing but the row, and sets *lex_pending for long rows left
+// to editorIdle(), so it can run on the worker pool. Returns whether the
+// state the row leaves open for the next one changed.
+static bool rowHighlight(editor_row* row, int in_comment, bool* lex_pending) {
+    if (!row || row->render_size <= 0) {
+        if (row && row->highlight) {
+            free(row->highlight);
+            row->highlight = NULL;
+        }
+        return false;
+    }
+
+    row->highlight = realloc(row->highlight, row->render_size > 0 ? row->render_size : 1);
+    if (!row->highlight) {
+        exit(EXIT_FAILURE);
+    }
+    memset(row->highlight, HL_NORMAL, row->render_size);
+
+    struct row_chunks* rc = row->chunks;
+    if (rc) {
+        rc->lexed = rc->num;
+        rc->dirty_to = 0;
+        rc->resume_valid = false;
+    }
+    if (!ec.syntax) return false;
+
+    struct lex_state st = {.in_comment = in_comment, .prev_sep = 1, .prev_hl = HL_NORMAL};
+    if (rc) {
+        // Long rows are highlighted as far as they are drawn, the rest
+        // from editorIdle(). The row below learns the state left open
+        // once it is done.
+        rc->chunk[0].lex = st;
+        rc->lexed = 0;
+        rc->dirty_to = INT_MAX;
+        *lex_pending = true;
+        return false;
+    }
+    editorHighlightSpan(row, 0, row->render_size, &st);
+
+    int changed = (row->hl_open_comment != st.in_comment);
+    row->hl_open_comment = st.in_comment;
+
+    return changed;
+}
+
+static bool editorHighlightRow(editor_row* row, int in_comment) {
+    return rowHighlight(row, in_comment, &ec.lex_pending);
+}
+
+static bool editorUpdateSyntaxRow(editor_row* row) {
+    int in_comment = (row && row->idx > 0 && ec.row[row->idx - 1].hl_open_comment);
+    return editorHighlightRow(row, in_comment);
+}
+
+void editorUpdateSyntax(editor_row* row) {
+    // Walking down iteratively instead of recursing, so an unterminated
+    // multiline comment at the top of a big file can't blow the stack.
+    while (editorUpdateSyntaxRow(row) && row->idx + 1 < ec.num_rows) {
+        row = &ec.row[row->idx + 1];
     }
 }
 
@@ -999,8 +1478,14 @@ void editorSelectSyntaxHighlight() {
 
     if (!ec.file_name) return;
 
-    char* ext = strrchr(ec.file_name, '.'); // Extract file extension
-    if (!ext) return;
+    // A compressed file is highlighted as what it contains (dump.sql.gz).
+    char* name = strndup(ec.file_name, compressionStripSuffix(ec.file_name));
+    if (!name) die("Failed to allocate file name");
+    char* ext = strrchr(name, '.'); // Extract file extension
+    if (!ext) {
+        free(name);
+        return;
+    }
 
     // Iterate through all known syntax definitions
     for (unsigned int i = 0; i < HL_DB_ENTRIES; i++) {
@@ -1010,7 +1495,7 @@ void editorSelectSyntaxHighlight() {
         for (int j = 0; s->file_match[j]; j++) {
             int is_ext = (s->file_match[j][0] == '.');
             if ((is_ext && ext && !strcmp(ext, s->file_match[j])) ||
-                (!is_ext && strstr(ec.file_name, s->file_match[j]))) {
+                (!is_ext && strstr(name, s->file_match[j]))) {
                 ec.syntax = s;
 
                 // Apply syntax highlighting to all rows
@@ -1018,123 +1503,850 @@ void editorSelectSyntaxHighlight() {
                     editorUpdateSyntax(&ec.row[row]);
                 }
 
+                free(name);
                 return; // Exit after setting the syntax
             }
         }
     }
+    free(name);
 }
 
 
 
 
 
-/*** Row operations ***/
+/*** UTF-8 section ***/
 
-int editorRowCursorXToRenderX(editor_row* row, int cursor_x) {
-    int render_x = 0;
-    for (int j = 0; j < cursor_x && j < row->size; j++) {
-        if (row->chars[j] == '\t')
-            render_x += (MEL_TAB_STOP - 1) - (render_x % MEL_TAB_STOP);
-        render_x++;
+// Code points drawn in no column (combining marks, joiners, variation
+// selectors) and in two (CJK, Hangul, most emoji). A compact take on
+// wcwidth() that doesn't depend on the locale.
+struct code_range {
+    uint32_t first;
+    uint32_t last;
+};
+
+static const struct code_range zero_width[] = {
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF},
+    {0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A},
+    {0x061C, 0x061C}, {0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DC},
+    {0x06DF, 0x06E4}, {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0711, 0x0711},
+    {0x0730, 0x074A}, {0x07A6, 0x07B0}, {0x07EB, 0x07F3}, {0x0816, 0x082D},
+    {0x0859, 0x085B}, {0x08D3, 0x0902}, {0x093A, 0x093A}, {0x093C, 0x093C},
+    {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957}, {0x0962, 0x0963},
+    {0x0981, 0x0981}, {0x09BC, 0x09BC}, {0x09C1, 0x09C4}, {0x09CD, 0x09CD},
+    {0x09E2, 0x09E3}, {0x0A01, 0x0A02}, {0x0A3C, 0x0A3C}, {0x0A41, 0x0A51},
+    {0x0A70, 0x0A71}, {0x0A75, 0x0A75}, {0x0A81, 0x0A82}, {0x0ABC, 0x0ABC},
+    {0x0AC1, 0x0AC8}, {0x0ACD, 0x0ACD}, {0x0AE2, 0x0AE3}, {0x0B01, 0x0B01},
+    {0x0B3C, 0x0B3C}, {0x0B3F, 0x0B3F}, {0x0B41, 0x0B44}, {0x0B4D, 0x0B4D},
+    {0x0B82, 0x0B82}, {0x0BC0, 0x0BC0}, {0x0BCD, 0x0BCD}, {0x0C3E, 0x0C40},
+    {0x0C46, 0x0C56}, {0x0CBC, 0x0CBC}, {0x0CCC, 0x0CCD}, {0x0D41, 0x0D44},
+    {0x0D4D, 0x0D4D}, {0x0DCA, 0x0DCA}, {0x0DD2, 0x0DD6}, {0x0E31, 0x0E31},
+    {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x0EB1, 0x0EB1}, {0x0EB4, 0x0EBC},
+    {0x0EC8, 0x0ECD}, {0x0F18, 0x0F19}, {0x0F35, 0x0F35}, {0x0F37, 0x0F37},
+    {0x0F39, 0x0F39}, {0x0F71, 0x0F7E}, {0x0F80, 0x0F84}, {0x0F86, 0x0F87},
+    {0x0F8D, 0x0FBC}, {0x102D, 0x1030}, {0x1032, 0x1037}, {0x1039, 0x103A},
+    {0x1058, 0x1059}, {0x1160, 0x11FF}, {0x135D, 0x135F}, {0x1712, 0x1714},
+    {0x1732, 0x1734}, {0x17B4, 0x17B5}, {0x17B7, 0x17BD}, {0x17C6, 0x17C6},
+    {0x17C9, 0x17D3}, {0x180B, 0x180F}, {0x1AB0, 0x1AFF}, {0x1B00, 0x1B03},
+    {0x1B34, 0x1B34}, {0x1B36, 0x1B3A}, {0x1B6B, 0x1B73}, {0x1DC0, 0x1DFF},
+    {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064}, {0x20D0, 0x20F0},
+    {0x2CEF, 0x2CF1}, {0x2DE0, 0x2DFF}, {0x302A, 0x302D}, {0x3099, 0x309A},
+    {0xA66F, 0xA672}, {0xA674, 0xA67D}, {0xA69E, 0xA69F}, {0xA8E0, 0xA8F1},
+    {0xFB1E, 0xFB1E}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF},
+    {0x1D167, 0x1D169}, {0x1D173, 0x1D182}, {0x1D185, 0x1D18B}, {0x1D1AA, 0x1D1AD},
+    {0xE0001, 0xE0001}, {0xE0020, 0xE007F}, {0xE0100, 0xE01EF},
+};
+
+static const struct code_range double_width[] = {
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+    {0x23F0, 0x23F0}, {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615},
+    {0x2648, 0x2653}, {0x267F, 0x267F}, {0x2693, 0x2693}, {0x26A1, 0x26A1},
+    {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5}, {0x26CE, 0x26CE},
+    {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+    {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B},
+    {0x2728, 0x2728}, {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755},
+    {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27B0, 0x27B0}, {0x27BF, 0x27BF},
+    {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55}, {0x2E80, 0x303E},
+    {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+    {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19},
+    {0xFE30, 0xFE6F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4},
+    {0x17000, 0x18CFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF},
+    {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F2FF}, {0x1F300, 0x1F320},
+    {0x1F32D, 0x1F335}, {0x1F337, 0x1F37C}, {0x1F37E, 0x1F393}, {0x1F3A0, 0x1F3CA},
+    {0x1F3CF, 0x1F3D3}, {0x1F3E0, 0x1F3F0}, {0x1F3F4, 0x1F3F4}, {0x1F3F8, 0x1F43E},
+    {0x1F440, 0x1F440}, {0x1F442, 0x1F4FC}, {0x1F4FF, 0x1F53D}, {0x1F54B, 0x1F54E},
+    {0x1F550, 0x1F567}, {0x1F57A, 0x1F57A}, {0x1F595, 0x1F596}, {0x1F5A4, 0x1F5A4},
+    {0x1F5FB, 0x1F64F}, {0x1F680, 0x1F6C5}, {0x1F6CC, 0x1F6CC}, {0x1F6D0, 0x1F6D2},
+    {0x1F6D5, 0x1F6D7}, {0x1F6EB, 0x1F6EC}, {0x1F6F4, 0x1F6FC}, {0x1F7E0, 0x1F7EB},
+    {0x1F90C, 0x1F93A}, {0x1F93C, 0x1F945}, {0x1F947, 0x1F9FF}, {0x1FA70, 0x1FAFF},
+    {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+};
+
+static bool codeRangeHas(const struct code_range* range, int num, uint32_t cp) {
+    int lo = 0, hi = num;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (range[mid].last < cp)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-    return render_x;
+    return lo < num && range[lo].first <= cp;
 }
 
+// Returns the screen columns of a code point, 0 to 2.
+static int utf8Width(uint32_t cp) {
+    if (cp < 0x300)
+        return 1;
+    if (codeRangeHas(zero_width, sizeof(zero_width) / sizeof(zero_width[0]), cp))
+        return 0;
+    if (codeRangeHas(double_width, sizeof(double_width) / sizeof(double_width[0]), cp))
+        return 2;
+    return 1;
+}
 
-int editorRowRenderXToCursorX(editor_row* row, int render_x) {
-    int cur_render_x = 0;
-    int cursor_x;
-    for (cursor_x = 0; cursor_x < row -> size; cursor_x++) {
-        if (row -> chars[cursor_x] == '\t')
-            cur_render_x += (MEL_TAB_STOP - 1) - (cur_render_x % MEL_TAB_STOP);
-        cur_render_x++;
+// Control chars, C0 and C1, are never part of a cluster.
+static bool utf8IsControl(uint32_t cp) {
+    return cp < 0x20 || (cp >= 0x7f && cp < 0xa0);
+}
 
-        if (cur_render_x > render_x)
-            return cursor_x;
+// Decodes the sequence at s, of n bytes at most, in *cp. Returns its
+// length, 0 if it isn't valid UTF-8 (overlong, a surrogate, cut short).
+static int utf8Decode(const char* s, int n, uint32_t* cp) {
+    const unsigned char* u = (const unsigned char*) s;
+    int len;
+    uint32_t min;
+    if (u[0] < 0x80) {
+        *cp = u[0];
+        return 1;
+    } else if ((u[0] & 0xe0) == 0xc0) {
+        len = 2, *cp = u[0] & 0x1f, min = 0x80;
+    } else if ((u[0] & 0xf0) == 0xe0) {
+        len = 3, *cp = u[0] & 0x0f, min = 0x800;
+    } else if ((u[0] & 0xf8) == 0xf0) {
+        len = 4, *cp = u[0] & 0x07, min = 0x10000;
+    } else {
+        return 0;
+    }
+    if (len > n)
+        return 0;
+    for (int i = 1; i < len; i++) {
+        if ((u[i] & 0xc0) != 0x80)
+            return 0;
+        *cp = (*cp << 6) | (u[i] & 0x3f);
     }
-    return cursor_x;
+    if (*cp < min || *cp > 0x10ffff || (*cp >= 0xd800 && *cp <= 0xdfff))
+        return 0;
+    return len;
 }
 
-void editorUpdateRow(editor_row* row) {
-    if (!row || !row->chars) return;
-
-    // Counting tabs
-    int tabs = 0;
-    for (int j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') tabs++;
+// Returns the length of the grapheme cluster at s, of n bytes at most,
+// and its screen columns in *width. A cluster is a code point with the
+// marks following it and what a zero width joiner joins to it, or a pair
+// of regional indicators (a flag). Bytes that aren't UTF-8 and control
+// chars stand alone, as does a mark with nothing before it, one column
+// each. Tabs are left to the caller.
+static int utf8Cluster(const char* s, int n, int* width) {
+    const unsigned char* u = (const unsigned char*) s;
+    *width = 1;
+    // ASCII not followed by a mark, nearly everything
+    if (u[0] < 0x80 && (n == 1 || u[1] < 0x80))
+        return 1;
+
+    uint32_t cp;
+    int len = utf8Decode(s, n, &cp);
+    if (len == 0 || utf8IsControl(cp))
+        return len ? len : 1;
+    int w = utf8Width(cp);
+    bool flag = cp >= 0x1f1e6 && cp <= 0x1f1ff;
+    bool join = false;
+    while (len < n && u[len] >= 0x80) {
+        uint32_t next;
+        int l = utf8Decode(&s[len], n - len, &next);
+        if (l == 0 || len + l > UCHAR_MAX || utf8IsControl(next))
+            break;
+        bool regional = next >= 0x1f1e6 && next <= 0x1f1ff;
+        bool modifier = next >= 0x1f3fb && next <= 0x1f3ff;
+        if (!join && !modifier && !(flag && regional) && utf8Width(next) != 0)
+            break;
+        join = next == 0x200d;
+        flag = false;
+        len += l;
     }
+    if (w > 0)
+        *width = w;
+    return len;
+}
 
-    // Freeing the old render buffer
-    free(row->render);
+// Tells whether the cluster at s, n bytes long, can go to the terminal as
+// it is, unlike control chars, bytes that aren't UTF-8 and lone marks.
+static bool utf8Drawable(const char* s, int n) {
+    uint32_t cp;
+    if (utf8Decode(s, n, &cp) == 0 || utf8IsControl(cp))
+        return false;
+    return utf8Width(cp) != 0;
+}
 
-    // Allocating memory for the new render buffer
-    size_t render_size = row->size + tabs * (MEL_TAB_STOP - 1) + 1;
-    row->render = malloc(render_size);
-    if (!row->render) {
-        row->render_size = 0;
-        return;
+
+// Length of each cluster of a run along a coordinate.
+static int wideRunStep(const struct wide_run* w, enum row_coord coord) {
+    switch (coord) {
+        case ROW_CHARS: return w->bytes;
+        case ROW_RENDER: return w->bytes == 1 ? w->width : w->bytes;
+        default: return w->width;
     }
+}
 
-    // Rendering of content
-    int idx = 0;
-    for (int j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % MEL_TAB_STOP != 0 && idx < render_size - 1) {
-                row->render[idx++] = ' ';
-            }
-        } else if (idx < render_size - 1) {
-            row->render[idx++] = row->chars[j];
-        }
+static int wideRunStart(const struct wide_run* w, enum row_coord coord) {
+    switch (coord) {
+        case ROW_CHARS: return w->x;
+        case ROW_RENDER: return w->render;
+        default: return w->col;
     }
-    row->render[idx] = '\0';
-    row->render_size = idx;
+}
 
-    // Syntax highlighting update
-    editorUpdateSyntax(row);
+static int wideRunEnd(const struct wide_run* w, enum row_coord coord) {
+    return wideRunStart(w, coord) + w->count * wideRunStep(w, coord);
 }
 
+// A cluster can join the last run when it's the same kind and right after
+// it. Tabs don't, an edit may change the width of one.
+static bool wideRunJoins(const struct wide_run* w, int x, int bytes, int width) {
+    return bytes > 1 && w->bytes == bytes && w->width == width &&
+           wideRunEnd(w, ROW_CHARS) == x;
+}
 
-void editorInsertRow(int at, const char* s, size_t len) {
-    // Checking the validity of the insertion position
-    if (at < 0 || at > ec.num_rows) return;
+// Returns the runs of a row ending at v or before.
+int rowWideFind(const editor_row* row, int v, enum row_coord coord) {
+    int lo = 0, hi = row->num_wide;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (wideRunEnd(&row->wide[mid], coord) <= v)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
-    // Allocation of memory for new line with check
-    editor_row* new_rows = realloc(ec.row, sizeof(editor_row) * (ec.num_rows + 1));
-    if (!new_rows) {
-        editorSetStatusMessage("Failed to allocate memory for new row");
-        return;
+// Maps position v of a row from one coordinate to another, a binary
+// search among the runs. Inside a cluster it maps to the start of it,
+// unless the cluster is as long in both (the spaces of a tab).
+int rowMapX(const editor_row* row, enum row_coord from, enum row_coord to, int v) {
+    int i = rowWideFind(row, v, from);
+    if (i < row->num_wide && wideRunStart(&row->wide[i], from) <= v) {
+        const struct wide_run* w = &row->wide[i];
+        int off = v - wideRunStart(w, from);
+        int step_from = wideRunStep(w, from);
+        int step_to = wideRunStep(w, to);
+        if (step_from == step_to)
+            return wideRunStart(w, to) + off;
+        return wideRunStart(w, to) + off / step_from * step_to;
     }
-    ec.row = new_rows;
+    if (i == 0)
+        return v;
+    return wideRunEnd(&row->wide[i - 1], to) + (v - wideRunEnd(&row->wide[i - 1], from));
+}
 
-    // Shift existing lines
-    memmove(&ec.row[at + 1], &ec.row[at], sizeof(editor_row) * (ec.num_rows - at));
-    
-    // Updating indexes for shifted rows
-    for (int j = at + 1; j <= ec.num_rows; j++) {
-        ec.row[j].idx = j;
+// Returns the first char of the cluster char x is part of, and its length
+// in *len.
+int rowCluster(const editor_row* row, int x, int* len) {
+    int i = rowWideFind(row, x, ROW_CHARS);
+    if (i < row->num_wide && row->wide[i].x <= x) {
+        const struct wide_run* w = &row->wide[i];
+        *len = w->bytes;
+        return w->x + (x - w->x) / w->bytes * w->bytes;
     }
+    *len = 1;
+    return x;
+}
 
-    // Initializing a new line
-    ec.row[at].idx = at;
-    ec.row[at].size = len;
-    ec.row[at].chars = malloc(len + 1);
-    if (!ec.row[at].chars) {
-        editorSetStatusMessage("Failed to allocate memory for row content");
-        return;
+// Measures the cluster at char j of a row, at screen column col: returns
+// its length, and its columns in *width.
+static int rowClusterMeasure(const editor_row* row, int j, int col, int* width) {
+    if (row->chars[j] == '\t') {
+        *width = MEL_TAB_STOP - col % MEL_TAB_STOP;
+        return 1;
     }
+    return utf8Cluster(&row->chars[j], row->size - j, width);
+}
 
-    // Content copying
-    if (s && len > 0) {
-        memcpy(ec.row[at].chars, s, len);
+
+/*** Long rows section ***/
+
+// Rows of minified or single line files can be megabytes long. They are
+// cut in chunks of about LONG_ROW_CHUNK chars, each knowing the render
+// column it starts at and the state of the highlighter there. An edit
+// renders again the chunks it touched, moves the render, highlight and
+// runs of the rest, and highlights from the chunk before it until the state
+// at a chunk start is the one it had before, meaning the rest doesn't
+// change. When it doesn't come to that (an opened string), and for rows
+// just loaded, the part on screen is highlighted when drawn and the rest
+// from editorIdle().
+
+// Returns the last chunk starting at char x or before.
+static int rowChunkFind(const struct row_chunks* rc, int x) {
+    int lo = 0, hi = rc->num - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (rc->chunk[mid].start <= x)
+            lo = mid;
+        else
+            hi = mid - 1;
     }
-    ec.row[at].chars[len] = '\0';
+    return lo;
+}
 
-    // Initializing the render buffer
-    ec.row[at].render = NULL;
-    ec.row[at].render_size = 0;
-    ec.row[at].highlight = NULL;
-    ec.row[at].hl_open_comment = 0;
+static bool rowChunksReserve(struct row_chunks* rc, int num) {
+    if (num <= rc->cap)
+        return true;
+    int cap = rc->cap ? rc->cap : 16;
+    while (cap < num)
+        cap *= 2;
+    struct row_chunk* chunk = realloc(rc->chunk, sizeof(struct row_chunk) * cap);
+    if (!chunk)
+        return false;
+    rc->chunk = chunk;
+    rc->cap = cap;
+    return true;
+}
+
+void rowChunksFree(editor_row* row) {
+    if (!row->chunks)
+        return;
+    free(row->chunks->chunk);
+    free(row->chunks);
+    row->chunks = NULL;
+}
+
+// Highlights a long row on from where it was left until a chunk starting
+// at render column target or later, or the end. Returns whether the state
+// the row leaves open for the next one changed, once it is done.
+static bool editorRowLexTo(editor_row* row, int target) {
+    struct row_chunks* rc = row->chunks;
+    if (rc->lexed >= rc->num)
+        return false;
+    if (!ec.syntax) {
+        // Changed parts were left HL_NORMAL, nothing to do.
+        rc->lexed = rc->num;
+        rc->dirty_to = 0;
+        rc->resume_valid = false;
+        return false;
+    }
+
+    int j = rc->lexed;
+    if (rc->resume_valid)
+        rc->chunk[j].lex = rc->resume;
+    rc->resume_valid = false;
+    struct lex_state st = rc->chunk[j].lex;
+    while (true) {
+        int i = rc->chunk[j].render_start + st.skip;
+        int end = j + 1 < rc->num ? rc->chunk[j + 1].render_start : row->render_size;
+        if (i < end)
+            memset(&row->highlight[i], HL_NORMAL, end - i);
+        i = editorHighlightSpan(row, i, end, &st);
+        if (++j == rc->num)
+            break;
+
+        struct row_chunk* c = &rc->chunk[j];
+        st.skip = i - c->render_start;
+        st.prev_hl = i > 0 ? row->highlight[i - 1] : HL_NORMAL;
+        if (c->render_start >= rc->dirty_to && !memcmp(&st, &c->lex, sizeof(st))) {
+            // Same state on the same text: the rest is highlighted already.
+            rc->lexed = rc->num;
+            rc->dirty_to = 0;
+            return false;
+        }
+        if (c->render_start >= target) {
+            // The chunk keeps the state its highlight was made with, the
+            // rest may only be reused from there on.
+            rc->lexed = j;
+            rc->resume = st;
+            rc->resume_valid = true;
+            if (rc->dirty_to < c->render_start)
+                rc->dirty_to = c->render_start;
+            return false;
+        }
+        c->lex = st;
+    }
+
+    rc->lexed = rc->num;
+    rc->dirty_to = 0;
+    bool changed = row->hl_open_comment != st.in_comment;
+    row->hl_open_comment = st.in_comment;
+    return changed;
+}
+
+// Highlights a long row up to render column target, unless it is too far
+// ahead of where it is, and the rows below if it is done and leaves
+// another state open.
+void editorRowLex(editor_row* row, int target) {
+    struct row_chunks* rc = row->chunks;
+    if (!rc || rc->lexed >= rc->num ||
+        target - rc->chunk[rc->lexed].render_start > LEX_MAX_COLUMNS)
+        return;
+    if (editorRowLexTo(row, target) && row->idx + 1 < ec.num_rows)
+        editorUpdateSyntax(&ec.row[row->idx + 1]);
+}
+
+// Goes on highlighting the long rows edits left partly highlighted.
+// Returns whether it did.
+bool editorLexIdle() {
+    if (!ec.lex_pending)
+        return false;
+    ec.lex_pending = false;
+    int budget = LEX_IDLE_COLUMNS;
+    for (int i = 0; i < ec.num_rows; i++) {
+        editor_row* row = &ec.row[i];
+        if (!row->chunks || row->chunks->lexed >= row->chunks->num)
+            continue;
+        struct row_chunks* rc = row->chunks;
+        while (budget > 0 && rc->lexed < rc->num && !stdinHasInput()) {
+            int from = rc->chunk[rc->lexed].render_start;
+            editorRowLex(row, from + LEX_SLICE_COLUMNS);
+            budget -= (rc->lexed < rc->num ? rc->chunk[rc->lexed].render_start : row->render_size) - from;
+        }
+        if (rc->lexed < rc->num)
+            ec.lex_pending = true;
+    }
+    return true;
+}
+
+// Updates a long row where removed chars at `at` were replaced by the
+// inserted ones, already in chars.
+static void editorUpdateLongRow(editor_row* row, int at, int removed, int inserted) {
+    struct row_chunks* rc = row->chunks;
+    int d = inserted - removed;
+    int old_size = row->size - d;
+    int old_render_size = row->render_size;
+
+    // The chunk the edit starts in and those it reaches are rendered
+    // again, up to chunk m that starts after it, or the end. An edit at
+    // the start of a chunk may join the cluster before it, that chunk is
+    // rendered again too.
+    int k = rowChunkFind(rc, at);
+    if (k > 0 && rc->chunk[k].start == at)
+        k--;
+    int m = k + 1;
+    while (m < rc->num && (rc->chunk[m].start < at + removed ||
+                           rc->chunk[m].start + d <= rc->chunk[k].start))
+        m++;
+    int from = rc->chunk[k].start;
+    int to = (m < rc->num ? rc->chunk[m].start : old_size) + d;
+    int rs_k = rc->chunk[k].render_start;
+    int cs_k = rowMapX(row, ROW_RENDER, ROW_COLUMNS, rs_k);
+
+    // Measuring them, and the chunks after as long as a cluster now runs
+    // into them.
+    int fresh_end = rs_k;
+    int fresh_col = cs_k;
+    int fresh_runs = 0;
+    struct wide_run last = {0};
+    for (int j = from; j < to;) {
+        int width;
+        int n = rowClusterMeasure(row, j, fresh_col, &width);
+        if (n > 1 || width != 1) {
+            if (!fresh_runs || !wideRunJoins(&last, j, n, width)) {
+                last = (struct wide_run) {j, 0, 0, 0, n, width};
+                fresh_runs++;
+            }
+            last.count++;
+        }
+        fresh_end += row->chars[j] == '\t' ? width : n;
+        fresh_col += width;
+        j += n;
+        while (j > to) {
+            m++;
+            to = (m < rc->num ? rc->chunk[m].start : old_size) + d;
+        }
+    }
+    int rs_m = m < rc->num ? rc->chunk[m].render_start : old_render_size;
+    int cs_m = rowMapX(row, ROW_RENDER, ROW_COLUMNS, rs_m);
+
+    // What comes after is moved by shift in render and shift_col on
+    // screen, but the first tab after it is now wider or narrower when
+    // shift_col isn't a multiple of the tab stop, and what comes after that
+    // moved by as much more.
+    int shift = fresh_end - rs_m;
+    int shift_col = fresh_col - cs_m;
+    int tab = -1;
+    int tab_render = 0, tab_col = 0, old_width = 0, new_width = 0;
+    char* t = to < row->size && shift_col % MEL_TAB_STOP ?
+              memchr(&row->chars[to], '\t', row->size - to) : NULL;
+    if (t) {
+        tab = t - row->chars;
+        tab_render = rowMapX(row, ROW_CHARS, ROW_RENDER, tab - d);
+        tab_col = rowMapX(row, ROW_CHARS, ROW_COLUMNS, tab - d);
+        old_width = MEL_TAB_STOP - tab_col % MEL_TAB_STOP;
+        new_width = MEL_TAB_STOP - (tab_col + shift_col) % MEL_TAB_STOP;
+    }
+    int shift_after = shift + new_width - old_width;
+    int shift_col_after = shift_col + new_width - old_width;
+
+    int render_size = old_render_size + shift_after;
+    if (render_size > old_render_size) {
+        row->render = realloc(row->render, render_size + 1);
+        row->highlight = realloc(row->highlight, render_size);
+        if (!row->render || !row->highlight) die("Failed to allocate row");
+    }
+    char* r = row->render;
+    unsigned char* hl = row->highlight;
+    if (tab == -1) {
+        memmove(&r[rs_m + shift], &r[rs_m], old_render_size - rs_m);
+        memmove(&hl[rs_m + shift], &hl[rs_m], old_render_size - rs_m);
+    } else {
+        // Both parts move the same way, the one moving away first.
+        int after = tab_render + old_width;
+        unsigned char tab_hl = hl[tab_render];
+        for (int pass = 0; pass < 2; pass++) {
+            if ((pass == 0) == (shift > 0)) {
+                memmove(&r[after + shift_after], &r[after], old_render_size - after);
+                memmove(&hl[after + shift_after], &hl[after], old_render_size - after);
+            } else {
+                memmove(&r[rs_m + shift], &r[rs_m], tab_render - rs_m);
+                memmove(&hl[rs_m + shift], &hl[rs_m], tab_render - rs_m);
+            }
+        }
+        memset(&r[tab_render + shift], ' ', new_width);
+        memset(&hl[tab_render + shift], tab_hl, new_width);
+    }
+    r[render_size] = '\0';
+    row->render_size = render_size;
+
+    // Same for the runs: those of the chunks rendered again are listed
+    // again, the others moved, and the tab gets its new width, or loses
+    // or gets a run when it's one column wide. A run going on across the
+    // start or the end of those chunks is cut there.
+    int wide_from = rowWideFind(row, from, ROW_CHARS);
+    int wide_to = rowWideFind(row, to - d, ROW_CHARS);
+    struct wide_run head = {0};
+    if (wide_from < row->num_wide && row->wide[wide_from].x < from) {
+        head = row->wide[wide_from];
+        head.count = (from - head.x) / head.bytes;
+        fresh_runs++;
+    }
+    if (wide_to < row->num_wide && row->wide[wide_to].x < to - d) {
+        struct wide_run* w = &row->wide[wide_to];
+        int cut = (to - d - w->x) / w->bytes;
+        w->x += cut * w->bytes;
+        w->render += cut * wideRunStep(w, ROW_RENDER);
+        w->col += cut * w->width;
+        w->count -= cut;
+    }
+    int tab_run = tab == -1 ? 0 : rowWideFind(row, tab - d, ROW_CHARS) + fresh_runs - (wide_to - wide_from);
+    bool had_run = tab != -1 && old_width != 1;
+    bool has_run = tab != -1 && new_width != 1;
+    int num_wide = row->num_wide + fresh_runs - (wide_to - wide_from);
+    if (num_wide + has_run > row->num_wide) {
+        row->wide = realloc(row->wide, sizeof(struct wide_run) * (num_wide + has_run));
+        if (!row->wide) die("Failed to allocate row");
+    }
+    if (row->wide)
+        memmove(&row->wide[wide_from + fresh_runs], &row->wide[wide_to],
+                sizeof(struct wide_run) * (row->num_wide - wide_to));
+    for (int j = wide_from + fresh_runs; j < num_wide; j++) {
+        struct wide_run* w = &row->wide[j];
+        bool past_tab = tab != -1 && w->x > tab - d;
+        w->x += d;
+        w->render += past_tab ? shift_after : shift;
+        w->col += past_tab ? shift_col_after : shift_col;
+    }
+    if (had_run && has_run) {
+        row->wide[tab_run].width = new_width;
+    } else if (had_run) {
+        memmove(&row->wide[tab_run], &row->wide[tab_run + 1],
+                sizeof(struct wide_run) * (num_wide - tab_run - 1));
+        num_wide--;
+    } else if (has_run) {
+        memmove(&row->wide[tab_run + 1], &row->wide[tab_run],
+                sizeof(struct wide_run) * (num_wide - tab_run));
+        row->wide[tab_run] = (struct wide_run) {tab, tab_render + shift, tab_col + shift_col, 1, 1, new_width};
+        num_wide++;
+    }
+    row->num_wide = num_wide;
+
+    // The chunks rendered again are cut anew if they grew too big. The
+    // first one keeps its state, the others get one that never matches.
+    int len = to - from;
+    int pieces = len > 2 * LONG_ROW_CHUNK ? len / LONG_ROW_CHUNK : (len > 0 || k == 0);
+    struct lex_state first = rc->chunk[k].lex;
+    if (!rowChunksReserve(rc, rc->num + pieces - (m - k))) die("Failed to allocate row");
+    memmove(&rc->chunk[k + pieces], &rc->chunk[m], sizeof(struct row_chunk) * (rc->num - m));
+    rc->num += pieces - (m - k);
+
+    int col = rs_k;
+    int screen_col = cs_k;
+    int edit_end = -1;
+    int piece = 0;
+    int wi = wide_from;
+    if (head.count)
+        row->wide[wi++] = head;
+    int fresh_from = wi;
+    for (int j = from; j < to;) {
+        if (piece < pieces && j - from >= piece * LONG_ROW_CHUNK) {
+            rc->chunk[k + piece] = (struct row_chunk) {j, col, first};
+            if (piece > 0)
+                rc->chunk[k + piece].lex.skip = -1;
+            piece++;
+        }
+        if (edit_end == -1 && j >= at + inserted)
+            edit_end = col;
+        int width;
+        int n = rowClusterMeasure(row, j, screen_col, &width);
+        if (n > 1 || width != 1) {
+            if (wi > fresh_from && wideRunJoins(&row->wide[wi - 1], j, n, width))
+                row->wide[wi - 1].count++;
+            else
+                row->wide[wi++] = (struct wide_run) {j, col, screen_col, 1, n, width};
+        }
+        if (row->chars[j] == '\t') {
+            memset(&r[col], ' ', width);
+            memset(&hl[col], HL_NORMAL, width);
+            col += width;
+        } else {
+            memcpy(&r[col], &row->chars[j], n);
+            memset(&hl[col], HL_NORMAL, n);
+            col += n;
+        }
+        screen_col += width;
+        j += n;
+    }
+    if (edit_end == -1)
+        edit_end = col;
+
+    for (int j = k + pieces; j < rc->num; j++) {
+        struct row_chunk* c = &rc->chunk[j];
+        c->render_start += (tab == -1 || c->start + d <= tab) ? shift : shift_after;
+        c->start += d;
+    }
+
+    // Highlighting starts again far enough before the edit for the tokens
+    // looking ahead into it, and can't stop before the end of the chunks
+    // rendered again.
+    int j0 = pieces ? k : k - 1;
+    while (j0 > 0 && rs_k - rc->chunk[j0].render_start < LEX_LOOKBACK)
+        j0--;
+    if (rc->lexed > j0) {
+        rc->lexed = j0;
+        rc->resume_valid = false;
+    }
+    int dirty_to = rc->dirty_to;
+    if (dirty_to > rs_k && dirty_to != INT_MAX)
+        dirty_to = dirty_to >= rs_m ? dirty_to + (shift > shift_after ? shift : shift_after) : col;
+    rc->dirty_to = dirty_to > col ? dirty_to : col;
+
+    searchIndexInvalidateRow(row);
+    wrapIndexInvalidateRow(row);
+    editorRowLex(row, edit_end);
+    if (rc->lexed < rc->num)
+        ec.lex_pending = true;
+}
+
+
+
+/*** Row operations ***/
+
+// Screen column of char cursor_x, and back.
+int editorRowCursorXToRenderX(editor_row* row, int cursor_x) {
+    if (cursor_x > row->size)
+        cursor_x = row->size;
+    if (cursor_x <= 0)
+        return 0;
+    return rowMapX(row, ROW_CHARS, ROW_COLUMNS, cursor_x);
+}
+
+
+int editorRowRenderXToCursorX(editor_row* row, int render_x) {
+    if (render_x <= 0)
+        return 0;
+    int cursor_x = rowMapX(row, ROW_COLUMNS, ROW_CHARS, render_x);
+    return cursor_x < row->size ? cursor_x : row->size;
+}
+
+// Appends a cluster to the runs of a row being rendered.
+static bool rowWideAdd(editor_row* row, int* cap, int x, int render, int col, int bytes, int width) {
+    if (row->num_wide && wideRunJoins(&row->wide[row->num_wide - 1], x, bytes, width)) {
+        row->wide[row->num_wide - 1].count++;
+        return true;
+    }
+    if (row->num_wide == *cap) {
+        int new_cap = *cap ? *cap * 2 : 16;
+        struct wide_run* wide = realloc(row->wide, sizeof(struct wide_run) * new_cap);
+        if (!wide) return false;
+        row->wide = wide;
+        *cap = new_cap;
+    }
+    row->wide[row->num_wide++] = (struct wide_run) {x, render, col, 1, bytes, width};
+    return true;
+}
+
+// Rebuilds the render buffer of a row from its chars, and its runs. Touches
+// nothing but the row, so rows can be rendered on worker threads.
+static bool editorRenderRow(editor_row* row) {
+    // Counting tabs
+    int tabs = 0;
+    for (int j = 0; j < row->size; j++) {
+        if (row->chars[j] == '\t') tabs++;
+    }
+
+    // Freeing the old render buffer
+    free(row->render);
+    free(row->wide);
+    row->wide = NULL;
+    row->num_wide = 0;
+
+    // Long rows are cut in chunks, the others lose theirs.
+    struct row_chunks* rc = row->chunks;
+    if (row->size >= LONG_ROW_SIZE && !rc) {
+        rc = row->chunks = calloc(1, sizeof(struct row_chunks));
+    } else if (row->size < LONG_ROW_SIZE && rc) {
+        rowChunksFree(row);
+        rc = NULL;
+    }
+    if (rc) {
+        rc->num = 0;
+        if (!rowChunksReserve(rc, (row->size + LONG_ROW_CHUNK - 1) / LONG_ROW_CHUNK)) {
+            rowChunksFree(row);
+            rc = NULL;
+        }
+    }
+
+    // Allocating memory for the new render buffer, UTF-8 sequences are
+    // rendered as they are.
+    size_t render_size = row->size + tabs * (MEL_TAB_STOP - 1) + 1;
+    row->render = malloc(render_size);
+    if (!row->render)
+        goto fail;
+
+    // Rendering of content. Chunks start at the first cluster after the
+    // end of the one before.
+    int idx = 0;
+    int col = 0;
+    int cap = 0;
+    int chunk_end = 0;
+    for (int j = 0; j < row->size;) {
+        if (rc && j >= chunk_end) {
+            rc->chunk[rc->num++] = (struct row_chunk) {.start = j, .render_start = idx};
+            chunk_end = j + LONG_ROW_CHUNK;
+        }
+        unsigned char c = row->chars[j];
+        if (c >= 0x20 && c < 0x7f && (j + 1 == row->size || (unsigned char) row->chars[j + 1] < 0x80)) {
+            row->render[idx++] = c;
+            col++;
+            j++;
+            continue;
+        }
+        int width;
+        int n = rowClusterMeasure(row, j, col, &width);
+        if ((n > 1 || width != 1) && !rowWideAdd(row, &cap, j, idx, col, n, width))
+            goto fail;
+        if (c == '\t') {
+            memset(&row->render[idx], ' ', width);
+            idx += width;
+        } else {
+            memcpy(&row->render[idx], &row->chars[j], n);
+            idx += n;
+        }
+        col += width;
+        j += n;
+    }
+    row->render[idx] = '\0';
+    row->render_size = idx;
+    if (cap > row->num_wide && row->num_wide) {
+        struct wide_run* wide = realloc(row->wide, sizeof(struct wide_run) * row->num_wide);
+        if (wide) row->wide = wide;
+    }
+    return true;
+
+fail:
+    free(row->render);
+    row->render = NULL;
+    row->render_size = 0;
+    free(row->wide);
+    row->wide = NULL;
+    row->num_wide = 0;
+    rowChunksFree(row);
+    return false;
+}
+
+void editorUpdateRow(editor_row* row) {
+    if (!row || !row->chars) return;
+    if (!editorRenderRow(row)) return;
+    searchIndexInvalidateRow(row);
+    wrapIndexInvalidateRow(row);
+
+    // Syntax highlighting update
+    editorUpdateSyntax(row);
+}
+
+// Updates a row where removed chars at `at` were replaced by the inserted
+// ones. Only long rows make use of knowing where.
+void editorUpdateRowPart(editor_row* row, int at, int removed, int inserted) {
+    if (!row || !row->chars) return;
+    if (!row->chunks || row->size < LONG_ROW_SIZE / 2 || !row->render) {
+        editorUpdateRow(row);
+        return;
+    }
+    editorUpdateLongRow(row, at, removed, inserted);
+}
+
+
+// Makes room for count more rows, growing the array geometrically.
+void editorReserveRows(int count) {
+    if (ec.num_rows + count <= ec.row_cap)
+        return;
+    int cap = ec.row_cap ? ec.row_cap : 64;
+    while (cap < ec.num_rows + count)
+        cap *= 2;
+    editor_row* rows = realloc(ec.row, sizeof(editor_row) * cap);
+    if (!rows) die("Failed to allocate rows");
+    ec.row = rows;
+    ec.row_cap = cap;
+}
+
+void editorInsertRow(int at, const char* s, size_t len) {
+    // Checking the validity of the insertion position
+    if (at < 0 || at > ec.num_rows) return;
+
+    editorReserveRows(1);
+
+    // Shift existing lines
+    memmove(&ec.row[at + 1], &ec.row[at], sizeof(editor_row) * (ec.num_rows - at));
+    wrapIndexRowsMoved(at);
+    searchSumsRowsMoved(at);
+    paneRowsMoved(at, 1);
+    
+    // Updating indexes for shifted rows
+    for (int j = at + 1; j <= ec.num_rows; j++) {
+        ec.row[j].idx = j;
+    }
+
+    // Initializing a new line
+    ec.row[at].idx = at;
+    ec.row[at].size = len;
+    ec.row[at].frozen = 0;
+    ec.row[at].chars = malloc(len + 1);
+    if (!ec.row[at].chars) {
+        editorSetStatusMessage("Failed to allocate memory for row content");
+        return;
+    }
+
+    // Content copying
+    if (s && len > 0) {
+        memcpy(ec.row[at].chars, s, len);
+    }
+    ec.row[at].chars[len] = '\0';
+
+    // Initializing the render buffer
+    ec.row[at].render = NULL;
+    ec.row[at].render_size = 0;
+    ec.row[at].highlight = NULL;
+    ec.row[at].wide = NULL;
+    ec.row[at].num_wide = 0;
+    ec.row[at].chunks = NULL;
+    ec.row[at].hl_open_comment = 0;
+    ec.row[at].match_count = -1;
+    ec.row[at].wrap_lines = 0;
 
     // Update line with checks
     editorUpdateRow(&ec.row[at]);
@@ -1145,6 +2357,7 @@ void editorInsertRow(int at, const char* s, size_t len) {
         return;
     }
 
+    if (ec.search_query) ec.search_stale++;
     ec.num_rows++;
     ec.dirty++;
 }
@@ -1154,9 +2367,40 @@ void editorInsertRow(int at, const char* s, size_t len) {
 
 
 void editorFreeRow(editor_row* row) {
+    if (ec.search_query) {
+        if (row->match_count >= 0)
+            ec.search_total -= row->match_count;
+        else
+            ec.search_stale--;
+        ec.search_current = 0;
+    }
     free(row -> render);
-    free(row -> chars);
+    editorRowReleaseChars(row);
     free(row -> highlight);
+    free(row -> wide);
+    rowChunksFree(row);
+}
+
+// Lets go of the content of row, which a save may still be writing.
+void editorRowReleaseChars(editor_row* row) {
+    if (row->frozen)
+        saveKeepChars(row->chars);
+    else
+        free(row->chars);
+    row->frozen = 0;
+}
+
+// Gives row its own copy of its content if a save is writing it, before
+// it is changed in place.
+void editorRowThaw(editor_row* row) {
+    if (!row->frozen)
+        return;
+    char* chars = malloc(row->size + 1);
+    if (!chars) die("Failed to allocate row");
+    memcpy(chars, row->chars, row->size + 1);
+    saveKeepChars(row->chars);
+    row->chars = chars;
+    row->frozen = 0;
 }
 
 void editorDelRow(int at) {
@@ -1164,6 +2408,9 @@ void editorDelRow(int at) {
         return;
     editorFreeRow(&ec.row[at]);
     memmove(&ec.row[at], &ec.row[at + 1], sizeof(editor_row) * (ec.num_rows - at - 1));
+    wrapIndexRowsMoved(at);
+    searchSumsRowsMoved(at);
+    paneRowsMoved(at, -1);
 
     for (int j = at; j < ec.num_rows - 1; j++) {
         ec.row[j].idx--;
@@ -1183,6 +2430,8 @@ void editorFlipRow(int dir) {
     ec.row[ec.cursor_y - dir].idx -= dir;
 
     int first = (dir == 1) ? ec.cursor_y - 1 : ec.cursor_y;
+    wrapIndexSwapRows(first);
+    searchSumsSwapRows(first);
     editorUpdateSyntax(&ec.row[first]);
     editorUpdateSyntax(&ec.row[first] + 1);
     if (ec.num_rows - ec.cursor_y > 2)
@@ -1224,6 +2473,7 @@ void editorRowInsertChar(editor_row* row, int at, int c) {
         return;
     }
 
+    editorRowThaw(row);
     row->chars = realloc(row->chars, row->size + 2);
     if (!row->chars) {
         perror("Failed to allocate memory for chars");
@@ -1235,7 +2485,7 @@ void editorRowInsertChar(editor_row* row, int at, int c) {
     row->size++;
     row->chars[row->size] = '\0';
 
-    editorUpdateRow(row);
+    editorUpdateRowPart(row, at, 0, 1);
 }
 
 void editorInsertNewline() {
@@ -1249,9 +2499,11 @@ void editorInsertNewline() {
         editorInsertRow(ec.cursor_y + 1, &row->chars[ec.cursor_x], row->size - ec.cursor_x);
         if (ec.cursor_y + 1 < ec.num_rows) {
             row = &ec.row[ec.cursor_y];  // Update the pointer after insertion
+            editorRowThaw(row);
+            int cut = row->size - ec.cursor_x;
             row->size = ec.cursor_x;
             row->chars[row->size] = '\0';
-            editorUpdateRow(row);
+            editorUpdateRowPart(row, ec.cursor_x, cut, 0);
         }
     }
     ec.cursor_y++;
@@ -1279,10 +2531,11 @@ void editorGoToLine() {
     ec.cursor_y = line_number - 1;
     ec.cursor_x = 0;
 
-    // Ensure cursor is within visible area
-    if (ec.cursor_y < ec.row_offset) {
+    // Ensure cursor is within visible area, by screen lines in
+    // editorScroll() with soft wrap
+    if (!ec.soft_wrap && ec.cursor_y < ec.row_offset) {
         ec.row_offset = ec.cursor_y;
-    } else if (ec.cursor_y >= ec.row_offset + ec.screen_rows) {
+    } else if (!ec.soft_wrap && ec.cursor_y >= ec.row_offset + ec.screen_rows) {
         ec.row_offset = ec.cursor_y - ec.screen_rows + 1;
     }
 
@@ -1304,6 +2557,7 @@ void editorRowAppendString(editor_row* row, char* s, size_t len) {
     if (!row || !s) return;
 
     // Allocating memory for extended string
+    editorRowThaw(row);
     char* new_chars = realloc(row->chars, row->size + len + 1);
     if (!new_chars) {
         editorSetStatusMessage("Failed to allocate memory for append");
@@ -1316,7 +2570,7 @@ void editorRowAppendString(editor_row* row, char* s, size_t len) {
     row->size += len;
     row->chars[row->size] = '\0';
 
-    editorUpdateRow(row);
+    editorUpdateRowPart(row, row->size - len, 0, len);
     ec.dirty++;
 }
 
@@ -1325,9 +2579,10 @@ void editorRowDelChar(editor_row* row, int at) {
         return;
     // Overwriting the deleted character with the characters that come
     // after it.
+    editorRowThaw(row);
     memmove(&row -> chars[at], &row -> chars[at + 1], row -> size - at);
     row -> size--;
-    editorUpdateRow(row);
+    editorUpdateRowPart(row, at, 1, 0);
     ec.dirty++;
 }
 
@@ -1336,9 +2591,10 @@ void editorRowDelString(editor_row* row, int at, int len) {
         return;
     // Overwriting the deleted string with the characters that come
     // after it.
+    editorRowThaw(row);
     memmove(&row -> chars[at], &row -> chars[at + len], row -> size - (at + len) + 1);
     row -> size -= len;
-    editorUpdateRow(row);
+    editorUpdateRowPart(row, at, len, 0);
     ec.dirty += len;
 }
 
@@ -1346,13 +2602,15 @@ void editorRowInsertString(editor_row* row, int at, char* str) {
     int len = strlen(str);
     if (at < 0 || at > row -> size)
         return;
+    editorRowThaw(row);
     row->chars = realloc(row->chars, row->size + strlen(str) + 2);
     // Move 'after-at' part of string content to the end.
     memmove(&row -> chars[at + len], &row -> chars[at], row -> size - at);
     // Copy contents of str into the created space.
     memcpy(&row -> chars[at], str, strlen(str));
     row -> size += len;
-    editorUpdateRow(row);
+    row -> chars[row -> size] = '\0';
+    editorUpdateRowPart(row, at, 0, len);
     ec.dirty += len;
 }
 
@@ -1371,6 +2629,7 @@ void editorInsertChar(int c) {
     if (!row || !row->chars) return;
 
     // Allocating memory for a new symbol
+    editorRowThaw(row);
     char* new_chars = realloc(row->chars, row->size + 2);
     if (!new_chars) {
         editorSetStatusMessage("Failed to allocate memory for character");
@@ -1385,7 +2644,7 @@ void editorInsertChar(int c) {
     row->chars[row->size] = '\0';
 
     // Row update
-    editorUpdateRow(row);
+    editorUpdateRowPart(row, ec.cursor_x, 0, 1);
     ec.cursor_x++;
     ec.dirty++;
 }
@@ -1401,8 +2660,14 @@ void editorDelChar() {
 
     editor_row* row = &ec.row[ec.cursor_y];
     if (ec.cursor_x > 0) {
-        editorRowDelChar(row, ec.cursor_x - 1);
-        ec.cursor_x--;
+        // The whole cluster before the cursor goes, marks and all.
+        int len;
+        int start = rowCluster(row, ec.cursor_x - 1, &len);
+        if (start == ec.cursor_x - 1)
+            editorRowDelChar(row, start);
+        else
+            editorRowDelString(row, start, ec.cursor_x - start);
+        ec.cursor_x = start;
     // Deleting a line and moving up all the content.
     } else {
         ec.cursor_x = ec.row[ec.cursor_y - 1].size;
@@ -1414,30 +2679,302 @@ void editorDelChar() {
 
 /*** File I/O ***/
 
-char* editorRowsToString(int* buf_len) {
-    int total_len = 0;
-    int j;
-    // Adding up the lengths of each row of text, adding 1
-    // to each one for the newline character we'll add to
-    // the end of each line.
-    for (j = 0; j < ec.num_rows; j++) {
-        total_len += ec.row[j].size + 1;
-    }
-    *buf_len = total_len;
-
-    char* buf = malloc(total_len);
-    char* p = buf;
-    // Copying the contents of each row to the end of the
-    // buffer, appending a newline character after each
-    // row.
-    for (j = 0; j < ec.num_rows; j++) {
-        memcpy(p, ec.row[j].chars, ec.row[j].size);
-        p += ec.row[j].size;
-        *p = '\n';
-        p++;
+// Compressed files are read and written through the compressor's own
+// program, gzip or zstd, at the level they were written with when it can
+// be told (gzip records whether it was the fastest or the best).
+struct compression {
+    const char* program;
+    const char* magic;
+    int magic_len;
+    const char* suffix;
+    int level;              // Level used when the file doesn't tell
+};
+
+static const struct compression COMPRESSIONS[] = {
+    [COMPRESS_NONE] = {NULL, "", 0, "", 0},
+    [COMPRESS_GZIP] = {"gzip", "\x1f\x8b", 2, ".gz", 6},
+    [COMPRESS_ZSTD] = {"zstd", "\x28\xb5\x2f\xfd", 4, ".zst", 3},
+};
+
+#define COMPRESSIONS_ENTRIES (int) (sizeof(COMPRESSIONS) / sizeof(COMPRESSIONS[0]))
+
+// Compression of a file, from the first bytes of it.
+static int compressionFromMagic(const unsigned char* head, size_t len, int* level) {
+    for (int i = COMPRESS_NONE + 1; i < COMPRESSIONS_ENTRIES; i++) {
+        const struct compression* c = &COMPRESSIONS[i];
+        if (len >= (size_t) c->magic_len && memcmp(head, c->magic, c->magic_len) == 0) {
+            *level = c->level;
+            if (i == COMPRESS_GZIP && len > 8)
+                *level = head[8] == 2 ? 9 : head[8] == 4 ? 1 : c->level;
+            return i;
+        }
     }
+    *level = 0;
+    return COMPRESS_NONE;
+}
 
-    return buf;
+// Compression of a new file, from its suffix.
+int compressionFromName(const char* file_name, int* level) {
+    size_t len = strlen(file_name);
+    for (int i = COMPRESS_NONE + 1; i < COMPRESSIONS_ENTRIES; i++) {
+        size_t suffix_len = strlen(COMPRESSIONS[i].suffix);
+        if (len > suffix_len && strcmp(file_name + len - suffix_len, COMPRESSIONS[i].suffix) == 0) {
+            *level = COMPRESSIONS[i].level;
+            return i;
+        }
+    }
+    *level = 0;
+    return COMPRESS_NONE;
+}
+
+// Length of file_name without the suffix of a compressed file.
+int compressionStripSuffix(const char* file_name) {
+    int level;
+    int c = compressionFromName(file_name, &level);
+    return strlen(file_name) - strlen(COMPRESSIONS[c].suffix);
+}
+
+// Runs argv with in and out as its standard input and output. Returns
+// its pid, or -1 if it couldn't be started.
+static pid_t spawnFilter(char* const argv[], int in, int out) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        if (null != -1)
+            dup2(null, STDERR_FILENO);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+static bool filterSucceeded(pid_t pid) {
+    int status;
+    while (waitpid(pid, &status, 0) == -1)
+        if (errno != EINTR)
+            return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Hashes what is left of fd with FNV-1a.
+static bool hashFd(int fd, uint64_t* hash) {
+    char buf[64 << 10];
+    ssize_t n;
+    *hash = FNV_BASIS;
+    while ((n = read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR))
+        *hash = fnvHash(*hash, buf, n > 0 ? n : 0);
+    return n == 0;
+}
+
+// Appends a row at the end, rendered and highlighted once.
+static void editorAppendRow(const char* s, size_t len) {
+    editorReserveRows(1);
+    editor_row* row = &ec.row[ec.num_rows];
+    *row = (editor_row) {.idx = ec.num_rows, .size = len, .match_count = -1};
+    row->chars = malloc(len + 1);
+    if (!row->chars) die("Failed to allocate row");
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+    if (!editorRenderRow(row)) die("Failed to allocate row");
+    editorHighlightRow(row, ec.num_rows > 0 && ec.row[ec.num_rows - 1].hl_open_comment);
+    ec.num_rows++;
+    if (ec.search_query) ec.search_stale++;
+}
+
+// Appends the complete lines of buf as rows, and what is left too at the
+// end of the input. Returns the bytes used.
+static size_t editorAppendLines(const char* buf, size_t len, bool eof) {
+    const char* start = buf;
+    const char* end = buf + len;
+    const char* nl;
+    while ((nl = memchr(start, '\n', end - start)) || (eof && start < end)) {
+        const char* line_end = nl ? nl : end;
+        size_t line_len = line_end - start;
+        while (line_len > 0 && start[line_len - 1] == '\r')
+            line_len--;
+        editorAppendRow(start, line_len);
+        start = nl ? nl + 1 : end;
+    }
+    return start - buf;
+}
+
+// Appends the lines read from fd as rows, reading it in large chunks.
+static void editorLoadRows(int fd) {
+    size_t cap = LOAD_CHUNK * 2, len = 0;
+    char* buf = malloc(cap);
+    if (!buf) die("Failed to allocate file buffer");
+    bool eof = false;
+    while (!eof) {
+        if (cap - len < LOAD_CHUNK) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+            if (!buf) die("Failed to allocate file buffer");
+        }
+        ssize_t n = read(fd, buf + len, cap - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            die("Failed to read file");
+        eof = n == 0;
+        len += n;
+        size_t used = editorAppendLines(buf, len, eof);
+        len -= used;
+        memmove(buf, buf + used, len);
+    }
+    free(buf);
+}
+
+
+// Rows written by one writev call, two buffers each (chars and newline).
+#define SAVE_BATCH_ROWS 512
+
+// Writes the rows to fd, a line each, straight from the rows. Adds the
+// bytes written to len as it goes and hashes them into hash. Returns false with
+// errno set if a write fails.
+static bool editorWriteRows(int fd, editor_row* rows, int num_rows, volatile size_t* len,
+                            uint64_t* hash) {
+    struct iovec iov[2 * SAVE_BATCH_ROWS];
+    for (int j = 0; j < num_rows; ) {
+        int count = 0;
+        for (; j < num_rows && count < 2 * SAVE_BATCH_ROWS; j++) {
+            iov[count++] = (struct iovec) {rows[j].chars, rows[j].size};
+            iov[count++] = (struct iovec) {"\n", 1};
+            *hash = fnvHash(fnvHash(*hash, rows[j].chars, rows[j].size), "\n", 1);
+            *len += rows[j].size + 1;
+        }
+
+        // A short write leaves the rest of the batch to write again.
+        struct iovec* v = iov;
+        while (count > 0) {
+            ssize_t n = writev(fd, v, count < IOV_MAX ? count : IOV_MAX);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                return false;
+            for (; count > 0 && (size_t) n >= v->iov_len; v++, count--)
+                n -= v->iov_len;
+            if (count > 0) {
+                v->iov_base = (char*) v->iov_base + n;
+                v->iov_len -= n;
+            }
+        }
+    }
+    return true;
+}
+
+// Writes the rows to fd through the compressor, then hashes what it wrote.
+static const char* editorWriteCompressed(int fd, editor_row* rows, int num_rows, int compression,
+                                         int level, volatile size_t* len, uint64_t* hash) {
+    char level_arg[8];
+    snprintf(level_arg, sizeof(level_arg), "-%d", level);
+    char* argv[] = {(char*) COMPRESSIONS[compression].program, "-c", level_arg, NULL};
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1)
+        return "can't start compressor";
+    pid_t pid = spawnFilter(argv, pipe_fds[0], fd);
+    close(pipe_fds[0]);
+    if (pid == -1) {
+        close(pipe_fds[1]);
+        return "can't start compressor";
+    }
+
+    uint64_t content_hash = FNV_BASIS;
+    bool written = editorWriteRows(pipe_fds[1], rows, num_rows, len, &content_hash);
+    int save_errno = errno;
+    close(pipe_fds[1]);
+    if (!filterSucceeded(pid)) {
+        errno = written ? EIO : save_errno;
+        return "compressor failed";
+    }
+    if (!written) {
+        errno = save_errno;
+        return "write failed";
+    }
+    if (lseek(fd, 0, SEEK_SET) == -1 || !hashFd(fd, hash))
+        return "can't read back file";
+    return NULL;
+}
+
+// Writes the rows to file_name without ever leaving it half written:
+// they go to a temporary file in the same directory, which is synced and
+// renamed over it, keeping its mode and owner. Symbolic links are
+// followed, so the file they point to is replaced. Sets len to the bytes
+// written and hash to the FNV-1a hash of the file. Compressed files go
+// through their compressor. Returns NULL, or what failed with errno set.
+const char* editorWriteFile(const char* file_name, editor_row* rows, int num_rows,
+                            int compression, int level, volatile size_t* len, uint64_t* hash) {
+    char* target = realpath(file_name, NULL);
+    if (!target && errno != ENOENT)
+        return "can't resolve path";
+    if (!target && !(target = strdup(file_name)))
+        die("Failed to allocate file name");
+
+    char* slash = strrchr(target, '/');
+    size_t dir_len = slash ? (size_t) (slash - target) + 1 : 0;
+    size_t tmp_size = strlen(target) + 16;
+    char* tmp = malloc(tmp_size);
+    if (!tmp) die("Failed to allocate file name");
+    snprintf(tmp, tmp_size, "%.*s.%s.XXXXXX", (int) dir_len, target, target + dir_len);
+
+    const char* failed = NULL;
+    struct stat st;
+    bool exists = stat(target, &st) == 0;
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        failed = "can't create temporary file";
+        goto out;
+    }
+
+    // A new file gets the mode creating it would have given it.
+    mode_t mode;
+    if (exists) {
+        mode = st.st_mode & 07777;
+        // Only root may give it away. Without its owner and group, it
+        // loses what they granted.
+        if (fchown(fd, st.st_uid, st.st_gid) == -1 && fchown(fd, -1, st.st_gid) == -1)
+            mode &= ~(S_ISUID | S_ISGID);
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        mode = 0666 & ~mask;
+    }
+
+    *len = 0;
+    *hash = FNV_BASIS;
+    if (fchmod(fd, mode) == -1)
+        failed = "can't set file mode";
+    else if (compression != COMPRESS_NONE)
+        failed = editorWriteCompressed(fd, rows, num_rows, compression, level, len, hash);
+    else if (!editorWriteRows(fd, rows, num_rows, len, hash))
+        failed = "write failed";
+    if (!failed && fsync(fd) == -1)
+        failed = "sync failed";
+    if (close(fd) == -1 && !failed)
+        failed = "close failed";
+    if (!failed && rename(tmp, target) == -1)
+        failed = "can't replace file";
+    if (failed) {
+        int save_errno = errno;
+        unlink(tmp);
+        errno = save_errno;
+        goto out;
+    }
+
+    // The rename is only durable once the directory is synced too.
+    if (dir_len)
+        target[dir_len] = '\0';
+    int dir_fd = open(dir_len ? target : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd != -1) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+out:
+    free(tmp);
+    free(target);
+    return failed;
 }
 
 static int fileExists(const char* file_name) {
@@ -1449,25 +2986,38 @@ void editorOpen(char* file_name) {
     if (file_name) {
         free(ec.file_name);
         ec.file_name = strdup(file_name);
+        editorSelectSyntaxHighlight();
 
-        FILE* fp = fopen(file_name, "r");
-        if (!fp) {
-            perror("fopen");
+        int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            perror("open");
             exit(1);
         }
 
-        char* line = NULL;
-        size_t linecap = 0;
-        ssize_t linelen;
-        while ((linelen = getline(&line, &linecap, fp)) != -1) {
-            while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-                linelen--;
-            editorInsertRow(ec.num_rows, line, linelen);
+        // Compressed files are read through their decompressor.
+        unsigned char head[16];
+        ssize_t head_len = pread(fd, head, sizeof(head), 0);
+        ec.compression = compressionFromMagic(head, head_len > 0 ? head_len : 0,
+                                              &ec.compression_level);
+        if (ec.compression == COMPRESS_NONE) {
+            editorLoadRows(fd);
+        } else {
+            const char* program = COMPRESSIONS[ec.compression].program;
+            char* argv[] = {(char*) program, "-dc", NULL};
+            int pipe_fds[2];
+            pid_t pid = -1;
+            if (pipe2(pipe_fds, O_CLOEXEC) == 0) {
+                pid = spawnFilter(argv, fd, pipe_fds[1]);
+                close(pipe_fds[1]);
+                editorLoadRows(pipe_fds[0]);
+                close(pipe_fds[0]);
+            }
+            if (pid == -1 || !filterSucceeded(pid)) {
+                fprintf(stderr, "Can't decompress %s with %s\n", file_name, program);
+                exit(1);
+            }
         }
-        free(line);
-        fclose(fp);
-
-        editorSelectSyntaxHighlight();
+        close(fd);
     } else {
         ec.file_name = NULL;  // No file name, starting fresh
     }
@@ -1477,489 +3027,5018 @@ void editorOpen(char* file_name) {
 
 
 void editorSave() {
-    if (ec.file_name == NULL) {
-        char* new_name = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+    // Without its oldest lines (-m), a followed file would lose them if
+    // saved over.
+    bool truncated = ec.file_name && ec.dropped_rows > 0;
+    if (ec.file_name == NULL || truncated) {
+        char* new_name = editorPrompt(truncated ?
+            "Oldest lines were dropped, save as: %s (ESC to cancel)" :
+            "Save as: %s (ESC to cancel)", NULL);
         if (new_name == NULL) {
             editorSetStatusMessage("Save aborted");
             return;
         }
+        if (truncated && strcmp(new_name, ec.file_name) == 0) {
+            editorSetStatusMessage("Can't save over %s, its oldest lines were dropped", new_name);
+            free(new_name);
+            return;
+        }
+        free(ec.file_name);
         ec.file_name = new_name;
+        ec.compression = compressionFromName(new_name, &ec.compression_level);
         editorSelectSyntaxHighlight();
     }
 
-    // Create backup if requested and file exists
-    if (ec.create_backup && access(ec.file_name, F_OK) == 0) {
-        if (!createBackupFile(ec.file_name)) {
-            editorSetStatusMessage("Warning: Failed to create backup file");
-        }
-    }
+    // Records of earlier sessions are loaded before the file changes
+    // from what they were written for, to be saved along with this one's.
+    undoHistoryLoad();
+    saveStart(ec.file_name, false);
+}
 
-    int len;
-    char* buf = editorRowsToString(&len);
-    if (!buf) {
-        editorSetStatusMessage("Failed to prepare content for saving");
-        return;
-    }
+/*** Worker pool section ***/
+
+// A small pool of threads running jobs split in parts over the rows
+// (search, match counting). Jobs are cut in more parts than there are
+// threads so they balance out. The calling thread only waits, watching
+// the terminal, so a pending keystroke can cancel a long job.
+
+// Max worker threads.
+#define WORKERS_MAX 16
+// Files with fewer rows are searched on the calling thread.
+#define WORKERS_MIN_ROWS 32768
+// Parts per worker thread a job is split in.
+#define WORKERS_PARTS_PER_THREAD 8
+
+typedef void (*worker_job)(void* arg, int worker, int part);
+
+struct worker_pool {
+    pthread_t threads[WORKERS_MAX];
+    int num_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    worker_job job;
+    void* arg;
+    int num_parts;
+    int next_part;
+    int running;                // Parts taken but not finished yet
+    unsigned long generation;   // Incremented for every job
+    volatile int cancel;        // Set to make workers drop the rest of the job
+} workers = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER
+};
 
-    FILE* fp = fopen(ec.file_name, "w");
-    if (!fp) {
-        free(buf);
-        editorSetStatusMessage("Can't save file. Error occurred: %s", strerror(errno));
-        return;
+static void* workerMain(void* arg) {
+    int worker = (int) (intptr_t) arg;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&workers.lock);
+    while (1) {
+        while (workers.generation == seen)
+            pthread_cond_wait(&workers.wake, &workers.lock);
+        seen = workers.generation;
+
+        while (workers.next_part < workers.num_parts && !workers.cancel) {
+            int part = workers.next_part++;
+            workers.running++;
+            pthread_mutex_unlock(&workers.lock);
+            workers.job(workers.arg, worker, part);
+            pthread_mutex_lock(&workers.lock);
+            workers.running--;
+        }
+        if (workers.running == 0)
+            pthread_cond_signal(&workers.done);
     }
+    return NULL;
+}
 
-    size_t written = fwrite(buf, sizeof(char), len, fp);
-    int save_errno = errno;
-    
-    if (fclose(fp) < 0) {
-        free(buf);
-        editorSetStatusMessage("Error closing file: %s", strerror(errno));
-        return;
+// Number of worker threads jobs are run on, 0 if they run inline.
+int workersCount() {
+    if (ec.jobs <= 1)
+        return 0;
+    while (workers.num_threads < ec.jobs && workers.num_threads < WORKERS_MAX) {
+        if (pthread_create(&workers.threads[workers.num_threads], NULL, workerMain,
+                           (void*) (intptr_t) workers.num_threads) != 0)
+            break;
+        pthread_detach(workers.threads[workers.num_threads]);
+        workers.num_threads++;
     }
+    return workers.num_threads > 1 ? workers.num_threads : 0;
+}
 
-    free(buf);
+// Keys waiting on the terminal. Anything else on stdin, like /dev/null
+// or a pipe at its end under --batch, always polls readable and would
+// cancel every job.
+bool stdinHasInput() {
+    if (!isatty(STDIN_FILENO))
+        return false;
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0;
+}
 
-    if (written == (size_t)len) {
-        ec.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-    } else {
-        editorSetStatusMessage("Can't save file. Error occurred: %s", strerror(save_errno));
+bool workersCancelled() {
+    return workers.cancel;
+}
+
+// Runs num_parts parts of job on the pool and waits for them. With
+// cancellable set, input waiting on the terminal cancels the job.
+// Returns false if the job was cancelled before all parts ran.
+bool workersRun(worker_job job, void* arg, int num_parts, bool cancellable) {
+    pthread_mutex_lock(&workers.lock);
+    workers.job = job;
+    workers.arg = arg;
+    workers.num_parts = num_parts;
+    workers.next_part = 0;
+    workers.running = 0;
+    workers.cancel = 0;
+    workers.generation++;
+    pthread_cond_broadcast(&workers.wake);
+
+    while ((workers.next_part < workers.num_parts && !workers.cancel) || workers.running > 0) {
+        if (workers.cancel || !cancellable) {
+            pthread_cond_wait(&workers.done, &workers.lock);
+            continue;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 20 * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&workers.done, &workers.lock, &deadline);
+        if (stdinHasInput())
+            workers.cancel = 1;
     }
+    bool completed = !workers.cancel;
+    workers.num_parts = 0;
+    pthread_mutex_unlock(&workers.lock);
+    return completed;
 }
 
-/*** Search section ***/
+/*** Regular expression section ***/
+
+// Regular expressions are parsed into a small syntax tree, compiled into a
+// Thompson NFA program and run by a Pike VM: every thread advances over
+// the text in lock step, so matching is linear in the text size and
+// never backtracks, whatever the pattern looks like.
+//
+// Supported syntax: literals, ., [...] and [^...] classes with ranges,
+// \d \D \w \W \s \S \t, ^ $ \b \B anchors, (...) capture groups, (?:...),
+// | alternation and the * + ? {m} {m,} {m,n} quantifiers (add ? for the
+// lazy variants).
+
+// Max capture groups, including group 0 for the whole match.
+#define REGEX_MAX_GROUPS 10
+// Max number of instructions of a compiled program.
+#define REGEX_MAX_PROGRAM 8192
+// Max repetition count of a {m,n} quantifier.
+#define REGEX_MAX_REPEAT 255
+
+enum regex_op {
+    RE_CHAR,
+    RE_ANY,
+    RE_CLASS,
+    RE_BOL,
+    RE_EOL,
+    RE_WORDB,
+    RE_NWORDB,
+    RE_SPLIT,
+    RE_JMP,
+    RE_SAVE,
+    RE_MATCH
+};
 
-void editorReplace() {
-    char* search_pattern = editorPrompt("Search pattern: %s (ESC to cancel)", NULL);
+struct regex_inst {
+    int op;
+    int x; // Character, class index, capture slot or first jump target.
+    int y; // Second jump target of RE_SPLIT.
+};
+
+enum regex_node_type {
+    RN_EMPTY,
+    RN_CHAR,
+    RN_ANY,
+    RN_CLASS,
+    RN_ASSERT,
+    RN_CAT,
+    RN_ALT,
+    RN_REPEAT,
+    RN_GROUP
+};
+
+struct regex_node {
+    int type;
+    int value;      // Character, class index, assertion opcode or group index.
+    int min, max;   // Repetition bounds, max is -1 for unbounded.
+    bool greedy;
+    struct regex_node* left;
+    struct regex_node* right;
+};
+
+struct regex {
+    struct regex_inst* prog;
+    int len;
+    unsigned char (*classes)[32];
+    int num_classes;
+    int num_groups;             // Including group 0.
+    unsigned char fold[256];
+    int first_byte;             // Only byte a match can start with, or -1.
+    bool use_first_set;         // True if first_set filters start positions.
+    unsigned char first_set[32];
+
+    // Pike VM scratch space, sized for the program at compile time.
+    int* mark;
+    int gen;
+    int* list_pc[2];
+    int* list_caps[2];
+    int* match_caps;
+    int* tmp_caps;
+};
+
+struct regex_parser {
+    const char* p;
+    const char* error;
+    struct regex* re;
+    struct regex_node* nodes;
+    int num_nodes;
+    int max_nodes;
+    bool ignore_case;
+};
+
+static int regexIsWord(int c) {
+    return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+static struct regex_node* regexNode(struct regex_parser* ps, int type) {
+    if (ps->num_nodes == ps->max_nodes) {
+        ps->error = "pattern too complex";
+        return NULL;
+    }
+    struct regex_node* n = &ps->nodes[ps->num_nodes++];
+    memset(n, 0, sizeof(*n));
+    n->type = type;
+    return n;
+}
+
+static int regexNewClass(struct regex_parser* ps) {
+    struct regex* re = ps->re;
+    unsigned char (*classes)[32] = realloc(re->classes, sizeof(*classes) * (re->num_classes + 1));
+    if (!classes) die("Failed to allocate regex class");
+    re->classes = classes;
+    memset(re->classes[re->num_classes], 0, 32);
+    return re->num_classes++;
+}
+
+static void regexClassAdd(struct regex_parser* ps, int cls, int c) {
+    unsigned char* set = ps->re->classes[cls];
+    set[c >> 3] |= 1 << (c & 7);
+    if (ps->ignore_case && isalpha(c)) {
+        int other = islower(c) ? toupper(c) : tolower(c);
+        set[other >> 3] |= 1 << (other & 7);
+    }
+}
+
+// Adds the \d, \w or \s family named by e (negated for upper case) to cls.
+// Returns false if e doesn't name a family.
+static bool regexClassAddEscape(struct regex_parser* ps, int cls, int e) {
+    int lower = tolower(e);
+    if (lower != 'd' && lower != 'w' && lower != 's')
+        return false;
+    for (int c = 0; c < 256; c++) {
+        bool in = (lower == 'd') ? isdigit(c) != 0 :
+                  (lower == 'w') ? regexIsWord(c) != 0 : isspace(c) != 0;
+        if (in != (e != lower))
+            regexClassAdd(ps, cls, c);
+    }
+    return true;
+}
+
+static int regexEscapeChar(int e) {
+    switch (e) {
+        case 't': return '\t';
+        case 'n': return '\n';
+        case 'r': return '\r';
+        default: return e;
+    }
+}
+
+static struct regex_node* regexParseAlt(struct regex_parser* ps);
+
+static struct regex_node* regexParseClass(struct regex_parser* ps) {
+    struct regex_node* n = regexNode(ps, RN_CLASS);
+    if (!n) return NULL;
+    n->value = regexNewClass(ps);
+
+    bool negate = false;
+    if (*ps->p == '^') {
+        negate = true;
+        ps->p++;
+    }
+    bool first = true;
+    while (*ps->p && (*ps->p != ']' || first)) {
+        int lo = (unsigned char) *ps->p++;
+        first = false;
+        if (lo == '\\' && *ps->p) {
+            int e = (unsigned char) *ps->p++;
+            if (regexClassAddEscape(ps, n->value, e))
+                continue;
+            lo = regexEscapeChar(e);
+        }
+        int hi = lo;
+        if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+            hi = (unsigned char) ps->p[1];
+            ps->p += 2;
+            if (hi == '\\' && *ps->p)
+                hi = regexEscapeChar((unsigned char) *ps->p++);
+            if (hi < lo) {
+                ps->error = "invalid range in []";
+                return NULL;
+            }
+        }
+        for (int c = lo; c <= hi; c++)
+            regexClassAdd(ps, n->value, c);
+    }
+    if (*ps->p != ']') {
+        ps->error = "missing ]";
+        return NULL;
+    }
+    ps->p++;
+
+    if (negate) {
+        unsigned char* set = ps->re->classes[n->value];
+        for (int i = 0; i < 32; i++)
+            set[i] = ~set[i];
+    }
+    return n;
+}
+
+static struct regex_node* regexParseAtom(struct regex_parser* ps) {
+    struct regex_node* n;
+    int c = (unsigned char) *ps->p++;
+
+    switch (c) {
+        case '(':
+            {
+                int group = -1;
+                if (ps->p[0] == '?' && ps->p[1] == ':') {
+                    ps->p += 2;
+                } else if (ps->re->num_groups < REGEX_MAX_GROUPS) {
+                    group = ps->re->num_groups++;
+                }
+                struct regex_node* inner = regexParseAlt(ps);
+                if (!inner) return NULL;
+                if (*ps->p != ')') {
+                    ps->error = "missing )";
+                    return NULL;
+                }
+                ps->p++;
+                if (group == -1) return inner;
+                n = regexNode(ps, RN_GROUP);
+                if (!n) return NULL;
+                n->value = group;
+                n->left = inner;
+                return n;
+            }
+        case '[':
+            return regexParseClass(ps);
+        case '.':
+            return regexNode(ps, RN_ANY);
+        case '^':
+        case '$':
+            n = regexNode(ps, RN_ASSERT);
+            if (n) n->value = (c == '^') ? RE_BOL : RE_EOL;
+            return n;
+        case '\\':
+            c = (unsigned char) *ps->p;
+            if (!c) {
+                ps->error = "trailing \\";
+                return NULL;
+            }
+            ps->p++;
+            if (c == 'b' || c == 'B') {
+                n = regexNode(ps, RN_ASSERT);
+                if (n) n->value = (c == 'b') ? RE_WORDB : RE_NWORDB;
+                return n;
+            }
+            if (strchr("dDwWsS", c)) {
+                n = regexNode(ps, RN_CLASS);
+                if (!n) return NULL;
+                n->value = regexNewClass(ps);
+                regexClassAddEscape(ps, n->value, c);
+                return n;
+            }
+            c = regexEscapeChar(c);
+            break;
+        case '*':
+        case '+':
+        case '?':
+            ps->error = "nothing to repeat";
+            return NULL;
+    }
+
+    n = regexNode(ps, RN_CHAR);
+    if (n) n->value = ps->re->fold[c];
+    return n;
+}
+
+// Parses "{m}", "{m,}" or "{m,n}". Returns false (consuming nothing) if
+// the brace doesn't start a valid quantifier, so it's taken literally.
+static bool regexParseBraces(struct regex_parser* ps, int* min, int* max) {
+    const char* p = ps->p + 1;
+    if (!isdigit((unsigned char) *p))
+        return false;
+    *min = strtol(p, (char**) &p, 10);
+    *max = *min;
+    if (*p == ',') {
+        p++;
+        *max = -1;
+        if (isdigit((unsigned char) *p))
+            *max = strtol(p, (char**) &p, 10);
+    }
+    if (*p != '}')
+        return false;
+    ps->p = p + 1;
+    return true;
+}
+
+static struct regex_node* regexParseRepeat(struct regex_parser* ps) {
+    struct regex_node* atom = regexParseAtom(ps);
+    while (atom) {
+        int min, max;
+        char q = *ps->p;
+        if (q == '*') {
+            min = 0; max = -1; ps->p++;
+        } else if (q == '+') {
+            min = 1; max = -1; ps->p++;
+        } else if (q == '?') {
+            min = 0; max = 1; ps->p++;
+        } else if (q == '{' && regexParseBraces(ps, &min, &max)) {
+            if (min > REGEX_MAX_REPEAT || max > REGEX_MAX_REPEAT || (max != -1 && max < min)) {
+                ps->error = "invalid {m,n} repetition";
+                return NULL;
+            }
+        } else {
+            break;
+        }
+        struct regex_node* n = regexNode(ps, RN_REPEAT);
+        if (!n) return NULL;
+        n->min = min;
+        n->max = max;
+        n->greedy = true;
+        if (*ps->p == '?') {
+            n->greedy = false;
+            ps->p++;
+        }
+        n->left = atom;
+        atom = n;
+    }
+    return atom;
+}
+
+static struct regex_node* regexParseCat(struct regex_parser* ps) {
+    struct regex_node* left = NULL;
+    while (*ps->p && *ps->p != '|' && *ps->p != ')') {
+        struct regex_node* right = regexParseRepeat(ps);
+        if (!right) return NULL;
+        if (!left) {
+            left = right;
+            continue;
+        }
+        struct regex_node* n = regexNode(ps, RN_CAT);
+        if (!n) return NULL;
+        n->left = left;
+        n->right = right;
+        left = n;
+    }
+    return left ? left : regexNode(ps, RN_EMPTY);
+}
+
+static struct regex_node* regexParseAlt(struct regex_parser* ps) {
+    struct regex_node* left = regexParseCat(ps);
+    while (left && *ps->p == '|') {
+        ps->p++;
+        struct regex_node* right = regexParseCat(ps);
+        if (!right) return NULL;
+        struct regex_node* n = regexNode(ps, RN_ALT);
+        if (!n) return NULL;
+        n->left = left;
+        n->right = right;
+        left = n;
+    }
+    return left;
+}
+
+static int regexEmit(struct regex* re, int op, int x, int y) {
+    if (re->len == REGEX_MAX_PROGRAM)
+        return -1;
+    re->prog[re->len].op = op;
+    re->prog[re->len].x = x;
+    re->prog[re->len].y = y;
+    return re->len++;
+}
+
+// Emits the code of a syntax tree node. Returns false if the program
+// grows past REGEX_MAX_PROGRAM.
+static bool regexCompileNode(struct regex* re, struct regex_node* n) {
+    int split, jmp;
+    switch (n->type) {
+        case RN_EMPTY:
+            return true;
+        case RN_CHAR:
+            return regexEmit(re, RE_CHAR, n->value, 0) != -1;
+        case RN_ANY:
+            return regexEmit(re, RE_ANY, 0, 0) != -1;
+        case RN_CLASS:
+            return regexEmit(re, RE_CLASS, n->value, 0) != -1;
+        case RN_ASSERT:
+            return regexEmit(re, n->value, 0, 0) != -1;
+        case RN_CAT:
+            return regexCompileNode(re, n->left) && regexCompileNode(re, n->right);
+        case RN_GROUP:
+            return regexEmit(re, RE_SAVE, 2 * n->value, 0) != -1 &&
+                   regexCompileNode(re, n->left) &&
+                   regexEmit(re, RE_SAVE, 2 * n->value + 1, 0) != -1;
+        case RN_ALT:
+            if ((split = regexEmit(re, RE_SPLIT, 0, 0)) == -1) return false;
+            re->prog[split].x = re->len;
+            if (!regexCompileNode(re, n->left)) return false;
+            if ((jmp = regexEmit(re, RE_JMP, 0, 0)) == -1) return false;
+            re->prog[split].y = re->len;
+            if (!regexCompileNode(re, n->right)) return false;
+            re->prog[jmp].x = re->len;
+            return true;
+        case RN_REPEAT:
+            {
+                for (int i = 0; i < n->min; i++)
+                    if (!regexCompileNode(re, n->left)) return false;
+
+                if (n->max == -1) {
+                    // L1: split L2, L3; L2: code; jmp L1; L3:
+                    if ((split = regexEmit(re, RE_SPLIT, 0, 0)) == -1) return false;
+                    int body = re->len;
+                    if (!regexCompileNode(re, n->left)) return false;
+                    if (regexEmit(re, RE_JMP, split, 0) == -1) return false;
+                    re->prog[split].x = n->greedy ? body : re->len;
+                    re->prog[split].y = n->greedy ? re->len : body;
+                    return true;
+                }
+
+                // Optional copies: split L, end; L: code; split L', end; L': code...
+                int splits[REGEX_MAX_REPEAT];
+                int num_splits = 0;
+                for (int i = n->min; i < n->max; i++) {
+                    if ((split = regexEmit(re, RE_SPLIT, 0, 0)) == -1) return false;
+                    splits[num_splits++] = split;
+                    if (!regexCompileNode(re, n->left)) return false;
+                }
+                for (int i = 0; i < num_splits; i++) {
+                    re->prog[splits[i]].x = n->greedy ? splits[i] + 1 : re->len;
+                    re->prog[splits[i]].y = n->greedy ? re->len : splits[i] + 1;
+                }
+                return true;
+            }
+    }
+    return false;
+}
+
+// Computes the set of bytes a match can start with. Gives up (and
+// disables the filter) when a match may start with an assertion or
+// match the empty string.
+static void regexComputeFirstSet(struct regex* re) {
+    int* stack = malloc(sizeof(int) * re->len);
+    bool* seen = calloc(re->len, sizeof(bool));
+    if (!stack || !seen) die("Failed to allocate regex");
+
+    memset(re->first_set, 0, sizeof(re->first_set));
+    re->use_first_set = true;
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0 && re->use_first_set) {
+        int pc = stack[--top];
+        if (seen[pc]) continue;
+        seen[pc] = true;
+        struct regex_inst* in = &re->prog[pc];
+        switch (in->op) {
+            case RE_CHAR:
+                for (int c = 0; c < 256; c++)
+                    if (re->fold[c] == in->x)
+                        re->first_set[c >> 3] |= 1 << (c & 7);
+                break;
+            case RE_CLASS:
+                for (int i = 0; i < 32; i++)
+                    re->first_set[i] |= re->classes[in->x][i];
+                break;
+            case RE_SPLIT:
+                stack[top++] = in->y;
+                stack[top++] = in->x;
+                break;
+            case RE_JMP:
+                stack[top++] = in->x;
+                break;
+            case RE_SAVE:
+                stack[top++] = pc + 1;
+                break;
+            default:
+                re->use_first_set = false;
+                break;
+        }
+    }
+    free(stack);
+    free(seen);
+
+    re->first_byte = -1;
+    if (!re->use_first_set) return;
+    int count = 0;
+    for (int c = 0; c < 256; c++) {
+        if (re->first_set[c >> 3] & (1 << (c & 7))) {
+            re->first_byte = c;
+            count++;
+        }
+    }
+    if (count != 1) re->first_byte = -1;
+}
+
+void regexFree(struct regex* re) {
+    if (!re) return;
+    free(re->prog);
+    free(re->classes);
+    free(re->mark);
+    free(re->list_pc[0]);
+    free(re->list_pc[1]);
+    free(re->list_caps[0]);
+    free(re->list_caps[1]);
+    free(re->match_caps);
+    free(re->tmp_caps);
+    free(re);
+}
+
+// Compiles pattern. Returns NULL and points error to a description of
+// the problem if the pattern is invalid.
+struct regex* regexCompile(const char* pattern, bool ignore_case, const char** error) {
+    struct regex* re = calloc(1, sizeof(struct regex));
+    if (!re) die("Failed to allocate regex");
+    for (int c = 0; c < 256; c++)
+        re->fold[c] = ignore_case ? tolower(c) : c;
+    re->num_groups = 1;
+
+    struct regex_parser ps = {0};
+    ps.p = pattern;
+    ps.re = re;
+    ps.ignore_case = ignore_case;
+    ps.max_nodes = 4 * strlen(pattern) + 8;
+    ps.nodes = malloc(sizeof(struct regex_node) * ps.max_nodes);
+    if (!ps.nodes) die("Failed to allocate regex");
+
+    struct regex_node* root = regexParseAlt(&ps);
+    if (root && *ps.p == ')') {
+        root = NULL;
+        ps.error = "unmatched )";
+    }
+
+    re->prog = malloc(sizeof(struct regex_inst) * REGEX_MAX_PROGRAM);
+    if (!re->prog) die("Failed to allocate regex");
+    if (root) {
+        // The whole match is capture group 0.
+        if (regexEmit(re, RE_SAVE, 0, 0) == -1 || !regexCompileNode(re, root) ||
+            regexEmit(re, RE_SAVE, 1, 0) == -1 || regexEmit(re, RE_MATCH, 0, 0) == -1) {
+            ps.error = "pattern too large";
+        }
+    }
+    free(ps.nodes);
+
+    if (!root || ps.error) {
+        *error = ps.error ? ps.error : "invalid pattern";
+        regexFree(re);
+        return NULL;
+    }
+
+    struct regex_inst* prog = realloc(re->prog, sizeof(struct regex_inst) * re->len);
+    if (prog) re->prog = prog;
+    regexComputeFirstSet(re);
+
+    int ncap = 2 * re->num_groups;
+    re->mark = calloc(re->len, sizeof(int));
+    re->list_pc[0] = malloc(sizeof(int) * re->len);
+    re->list_pc[1] = malloc(sizeof(int) * re->len);
+    re->list_caps[0] = malloc(sizeof(int) * re->len * ncap);
+    re->list_caps[1] = malloc(sizeof(int) * re->len * ncap);
+    re->match_caps = malloc(sizeof(int) * ncap);
+    re->tmp_caps = malloc(sizeof(int) * ncap);
+    if (!re->mark || !re->list_pc[0] || !re->list_pc[1] || !re->list_caps[0] ||
+        !re->list_caps[1] || !re->match_caps || !re->tmp_caps)
+        die("Failed to allocate regex");
+    return re;
+}
+
+// Adds a thread at pc to list l, following jumps, splits, saves and
+// assertions right away so the list only holds threads waiting on a byte.
+static void regexAddThread(struct regex* re, int l, int* count, int pc, int* caps,
+                           const unsigned char* text, int len, int pos) {
+    if (re->mark[pc] == re->gen)
+        return;
+    re->mark[pc] = re->gen;
+
+    struct regex_inst* in = &re->prog[pc];
+    switch (in->op) {
+        case RE_JMP:
+            regexAddThread(re, l, count, in->x, caps, text, len, pos);
+            return;
+        case RE_SPLIT:
+            regexAddThread(re, l, count, in->x, caps, text, len, pos);
+            regexAddThread(re, l, count, in->y, caps, text, len, pos);
+            return;
+        case RE_SAVE:
+            {
+                int old = caps[in->x];
+                caps[in->x] = pos;
+                regexAddThread(re, l, count, pc + 1, caps, text, len, pos);
+                caps[in->x] = old;
+            }
+            return;
+        case RE_BOL:
+            if (pos == 0)
+                regexAddThread(re, l, count, pc + 1, caps, text, len, pos);
+            return;
+        case RE_EOL:
+            if (pos == len)
+                regexAddThread(re, l, count, pc + 1, caps, text, len, pos);
+            return;
+        case RE_WORDB:
+        case RE_NWORDB:
+            {
+                bool before = pos > 0 && regexIsWord(text[pos - 1]);
+                bool after = pos < len && regexIsWord(text[pos]);
+                if ((before != after) == (in->op == RE_WORDB))
+                    regexAddThread(re, l, count, pc + 1, caps, text, len, pos);
+            }
+            return;
+    }
+
+    int ncap = 2 * re->num_groups;
+    re->list_pc[l][*count] = pc;
+    memcpy(&re->list_caps[l][*count * ncap], caps, sizeof(int) * ncap);
+    (*count)++;
+}
+
+// Finds the leftmost match starting at or after start. On success fills
+// caps with 2 * num_groups offsets (-1 for groups that didn't take part).
+bool regexExec(struct regex* re, const char* text, int len, int start, int* caps) {
+    const unsigned char* t = (const unsigned char*) text;
+    int ncap = 2 * re->num_groups;
+    int cur = 0;
+    int count[2] = {0, 0};
+    bool matched = false;
+
+    re->gen++;
+    for (int pos = start; pos <= len; pos++) {
+        if (!matched) {
+            // Nothing in flight: skip straight to a byte a match can start with.
+            if (count[cur] == 0 && re->use_first_set) {
+                if (re->first_byte != -1) {
+                    const unsigned char* hit = memchr(t + pos, re->first_byte, len - pos);
+                    if (!hit) break;
+                    pos = hit - t;
+                } else {
+                    while (pos < len && !(re->first_set[t[pos] >> 3] & (1 << (t[pos] & 7))))
+                        pos++;
+                    if (pos == len) break;
+                }
+            }
+            for (int i = 0; i < ncap; i++)
+                re->tmp_caps[i] = -1;
+            regexAddThread(re, cur, &count[cur], 0, re->tmp_caps, t, len, pos);
+        }
+        if (count[cur] == 0) {
+            // An assertion may have failed here and hold at the next byte.
+            if (matched)
+                break;
+            re->gen++;
+            continue;
+        }
+
+        int next = 1 - cur;
+        count[next] = 0;
+        re->gen++;
+        for (int i = 0; i < count[cur]; i++) {
+            int pc = re->list_pc[cur][i];
+            int* thread_caps = &re->list_caps[cur][i * ncap];
+            struct regex_inst* in = &re->prog[pc];
+            bool step = false;
+
+            switch (in->op) {
+                case RE_CHAR:
+                    step = pos < len && re->fold[t[pos]] == in->x;
+                    break;
+                case RE_ANY:
+                    step = pos < len;
+                    break;
+                case RE_CLASS:
+                    step = pos < len && (re->classes[in->x][t[pos] >> 3] & (1 << (t[pos] & 7)));
+                    break;
+                case RE_MATCH:
+                    // Threads are in priority order: the ones after
+                    // this match can only give lower priority matches.
+                    memcpy(re->match_caps, thread_caps, sizeof(int) * ncap);
+                    matched = true;
+                    i = count[cur];
+                    break;
+            }
+            if (step)
+                regexAddThread(re, next, &count[next], pc + 1, thread_caps, t, len, pos + 1);
+        }
+        cur = next;
+    }
+
+    if (matched)
+        memcpy(caps, re->match_caps, sizeof(int) * ncap);
+    return matched;
+}
+
+/*** Search engine section ***/
+
+// Precompiled query. Literal queries use a Boyer-Moore-Horspool skip
+// table, so a miss usually advances by the whole pattern length;
+// SEARCH_REGEX queries are compiled into a regex program.
+struct search_query {
+    char* pattern;              // Pattern, case folded for literal SEARCH_IGNORE_CASE
+    int len;                    // Pattern length, 0 if the query is invalid
+    int flags;                  // SEARCH_* flags
+    int skip[256];              // Bad character shifts, indexed by text byte
+    unsigned char fold[256];    // Identity or lower case mapping of text bytes
+    struct regex* re;           // Compiled program for SEARCH_REGEX
+    const char* error;          // Why the regex didn't compile
+};
+
+// Offsets of a match: caps[0] and caps[1] delimit the whole match,
+// caps[2 * n] and caps[2 * n + 1] capture group n (-1 if unset).
+struct search_match {
+    int caps[2 * REGEX_MAX_GROUPS];
+    int num_groups;
+};
+
+// Returns false (leaving an empty query that never matches) if the
+// pattern is an invalid regular expression.
+bool searchCompile(struct search_query* q, const char* pattern, int flags) {
+    q->len = strlen(pattern);
+    q->flags = flags;
+    q->re = NULL;
+    q->error = NULL;
+    q->pattern = malloc(q->len + 1);
+    if (!q->pattern) die("Failed to allocate search pattern");
+
+    if (flags & SEARCH_REGEX) {
+        memcpy(q->pattern, pattern, q->len + 1);
+        q->re = regexCompile(pattern, flags & SEARCH_IGNORE_CASE, &q->error);
+        if (!q->re) {
+            q->len = 0;
+            return false;
+        }
+        return true;
+    }
+
+    for (int c = 0; c < 256; c++)
+        q->fold[c] = (flags & SEARCH_IGNORE_CASE) ? tolower(c) : c;
+    for (int i = 0; i <= q->len; i++)
+        q->pattern[i] = q->fold[(unsigned char) pattern[i]];
+
+    // Shifts are computed on folded bytes and then spread to every byte
+    // folding to them, so both cases of a letter share the same shift.
+    int folded_skip[256];
+    for (int c = 0; c < 256; c++)
+        folded_skip[c] = q->len;
+    for (int i = 0; i < q->len - 1; i++)
+        folded_skip[(unsigned char) q->pattern[i]] = q->len - 1 - i;
+    for (int c = 0; c < 256; c++)
+        q->skip[c] = folded_skip[q->fold[c]];
+    return true;
+}
+
+void searchFree(struct search_query* q) {
+    free(q->pattern);
+    regexFree(q->re);
+    q->pattern = NULL;
+    q->re = NULL;
+    q->len = 0;
+}
+
+static int searchLiteral(const struct search_query* q, const char* text, int len, int start) {
+    int m = q->len;
+    if (len - start < m)
+        return -1;
+
+    const unsigned char* t = (const unsigned char*) text;
+    const unsigned char* p = (const unsigned char*) q->pattern;
+
+    // memchr is vectorized by the C library, hard to beat for one byte.
+    if (m == 1 && !(q->flags & SEARCH_IGNORE_CASE)) {
+        const char* hit = memchr(text + start, p[0], len - start);
+        return hit ? hit - text : -1;
+    }
+
+    int last = m - 1;
+    for (int i = start; i <= len - m; i += q->skip[t[i + last]]) {
+        if (q->fold[t[i + last]] != p[last])
+            continue;
+        int j = 0;
+        while (j < last && q->fold[t[i + j]] == p[j])
+            j++;
+        if (j == last)
+            return i;
+    }
+    return -1;
+}
+
+// Returns the offset of the first match starting at or after start,
+// or -1 if there is none. Fills m (if not NULL) with the match bounds.
+int searchForward(const struct search_query* q, const char* text, int len, int start,
+                  struct search_match* m) {
+    if (q->len == 0 || start < 0 || start > len)
+        return -1;
+
+    if (q->re) {
+        struct search_match tmp;
+        if (!m) m = &tmp;
+        m->num_groups = q->re->num_groups;
+        return regexExec(q->re, text, len, start, m->caps) ? m->caps[0] : -1;
+    }
+
+    int pos = searchLiteral(q, text, len, start);
+    if (m && pos != -1) {
+        m->num_groups = 1;
+        m->caps[0] = pos;
+        m->caps[1] = pos + q->len;
+    }
+    return pos;
+}
+
+// Returns the offset of the last match starting before `before`,
+// or -1 if there is none. Fills m (if not NULL) with the match bounds.
+// Matches are the ones searching forward finds and draws, each going on
+// from the end of the one before, which keeps it linear in the row.
+int searchBackward(const struct search_query* q, const char* text, int len, int before,
+                   struct search_match* m) {
+    struct search_match current;
+    int found = -1;
+    int pos = searchForward(q, text, len, 0, &current);
+    while (pos != -1 && pos < before) {
+        found = pos;
+        if (m) *m = current;
+        int end = current.caps[1] > pos ? current.caps[1] : pos + 1;
+        pos = searchForward(q, text, len, end, &current);
+    }
+    return found;
+}
+
+// Writes the replacement text for match m of text to out (if not NULL)
+// and returns its length. For regular expressions \0 to \9 insert
+// capture groups and \\ a backslash.
+size_t searchWriteReplacement(const struct search_query* q, const char* replacement,
+                              const char* text, const struct search_match* m, char* out) {
+    if (!q->re) {
+        size_t len = strlen(replacement);
+        if (out) memcpy(out, replacement, len);
+        return len;
+    }
+
+    size_t n = 0;
+    for (const char* r = replacement; *r; r++) {
+        if (r[0] == '\\' && isdigit((unsigned char) r[1])) {
+            int group = r[1] - '0';
+            r++;
+            if (group >= m->num_groups || m->caps[2 * group] == -1)
+                continue;
+            int glen = m->caps[2 * group + 1] - m->caps[2 * group];
+            if (out) memcpy(&out[n], &text[m->caps[2 * group]], glen);
+            n += glen;
+            continue;
+        }
+        if (r[0] == '\\' && r[1] == '\\')
+            r++;
+        if (out) out[n] = *r;
+        n++;
+    }
+    return n;
+}
+
+// Looks at step i of a search going in `direction` from (row, col): step
+// 0 is the rest of the starting row, step num_rows the part of it before
+// the starting point, reached after wrapping around. Returns the render
+// column of the match found there or -1.
+static int searchRowStep(const struct search_query* q, int direction, int row, int col,
+                         bool inclusive, int i, int* current) {
+    *current = row + i * direction;
+    *current = ((*current % ec.num_rows) + ec.num_rows) % ec.num_rows;
+    editor_row* r = &ec.row[*current];
+    int pos;
+
+    if (direction > 0) {
+        int start = (i == 0) ? col + (inclusive ? 0 : 1) : 0;
+        // Going on from a match, the next one starts past its end.
+        struct search_match m;
+        if (i == 0 && !inclusive &&
+            searchForward(q, r->render, r->render_size, col, &m) == col && m.caps[1] > start)
+            start = m.caps[1];
+        pos = searchForward(q, r->render, r->render_size, start, NULL);
+        if (i == ec.num_rows && pos >= col)
+            pos = -1;
+    } else {
+        int before = r->render_size;
+        if (i == 0 && col < INT_MAX)
+            before = col + (inclusive ? 1 : 0);
+        pos = searchBackward(q, r->render, r->render_size, before, NULL);
+        if (i == ec.num_rows && pos <= col)
+            pos = -1;
+    }
+    return pos;
+}
+
+struct search_rows_job {
+    struct search_query* queries;   // One per worker, regex programs aren't shareable
+    int direction;
+    int row;
+    int col;
+    bool inclusive;
+    int steps_per_part;
+    int* part_row;                  // First match of every part, -1 if none
+    int* part_col;
+    volatile int best_part;         // Lowest part with a match so far
+};
+
+static void searchRowsPart(void* arg, int worker, int part) {
+    struct search_rows_job* job = arg;
+    int first = part * job->steps_per_part;
+    int last = first + job->steps_per_part;
+    if (last > ec.num_rows + 1)
+        last = ec.num_rows + 1;
+
+    for (int i = first; i < last; i++) {
+        // A match in an earlier part wins anyway, and so does the user.
+        if (job->best_part < part || workersCancelled())
+            return;
+        int current;
+        int pos = searchRowStep(&job->queries[worker], job->direction, job->row, job->col,
+                                job->inclusive, i, &current);
+        if (pos != -1) {
+            job->part_row[part] = current;
+            job->part_col[part] = pos;
+            pthread_mutex_lock(&workers.lock);
+            if (part < job->best_part)
+                job->best_part = part;
+            pthread_mutex_unlock(&workers.lock);
+            return;
+        }
+    }
+}
+
+// Searches the rows on the worker pool. Parts cover consecutive steps of
+// the search order, so the first part with a match has the same match
+// the sequential search would find.
+static int searchRowsParallel(const struct search_query* q, int num_threads, int direction,
+                              int row, int col, bool inclusive, int* match_row, int* match_col) {
+    int num_parts = num_threads * WORKERS_PARTS_PER_THREAD;
+    struct search_rows_job job;
+    job.direction = direction;
+    job.row = row;
+    job.col = col;
+    job.inclusive = inclusive;
+    job.steps_per_part = (ec.num_rows + 1 + num_parts - 1) / num_parts;
+    job.best_part = num_parts;
+    job.queries = malloc(sizeof(struct search_query) * num_threads);
+    job.part_row = malloc(sizeof(int) * num_parts);
+    job.part_col = malloc(sizeof(int) * num_parts);
+    if (!job.queries || !job.part_row || !job.part_col)
+        die("Failed to allocate search job");
+    for (int w = 0; w < num_threads; w++)
+        searchCompile(&job.queries[w], q->pattern, q->flags);
+    for (int p = 0; p < num_parts; p++)
+        job.part_row[p] = -1;
+
+    int result = workersRun(searchRowsPart, &job, num_parts, true) ? 0 : -1;
+    if (result == 0 && job.best_part < num_parts) {
+        *match_row = job.part_row[job.best_part];
+        *match_col = job.part_col[job.best_part];
+        result = 1;
+    }
+
+    for (int w = 0; w < num_threads; w++)
+        searchFree(&job.queries[w]);
+    free(job.queries);
+    free(job.part_row);
+    free(job.part_col);
+    return result;
+}
+
+// Looks for the next match in render coordinates, going in `direction`
+// from (row, col). The match at (row, col) itself counts only when
+// inclusive is set. Wraps around the buffer once. Returns 1 if a match
+// was found, 0 if there is none and -1 if the user interrupted it.
+int searchRows(const struct search_query* q, int direction, int row, int col,
+               bool inclusive, int* match_row, int* match_col) {
+    if (ec.num_rows == 0 || q->len == 0)
+        return 0;
+    if (row < 0 || row >= ec.num_rows) {
+        row = direction > 0 ? 0 : ec.num_rows - 1;
+        col = direction > 0 ? 0 : INT_MAX;
+        inclusive = true;
+    }
+
+    int num_threads = workersCount();
+    if (num_threads && ec.num_rows >= WORKERS_MIN_ROWS) {
+        // Most searches hit close by: look at the first rows here
+        // before paying for waking up the pool.
+        for (int i = 0; i < 64; i++) {
+            int pos = searchRowStep(q, direction, row, col, inclusive, i, match_row);
+            if (pos != -1) {
+                *match_col = pos;
+                return 1;
+            }
+        }
+        return searchRowsParallel(q, num_threads, direction, row, col, inclusive,
+                                  match_row, match_col);
+    }
+
+    for (int i = 0; i <= ec.num_rows; i++) {
+        int pos = searchRowStep(q, direction, row, col, inclusive, i, match_row);
+        if (pos != -1) {
+            *match_col = pos;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*** Match index section ***/
+
+// The match index keeps, for the active search query, the number of
+// matches of every row (editor_row.match_count) and their total. Edited
+// rows are only marked stale and recounted on demand, and when the query
+// grows literally only rows that matched the shorter query are recounted,
+// so typing a query or editing never rescans the whole file. Prefix sums
+// of the counts give the position of the current match.
+
+// Counts the matches of q starting before `before` in a row, the ones
+// drawn highlighted: each one is looked for from the end of the last.
+static int searchCountMatches(const struct search_query* q, const editor_row* row, int before) {
+    struct search_match m;
+    int count = 0;
+    int pos = searchForward(q, row->render, row->render_size, 0, &m);
+    while (pos != -1 && pos < before) {
+        count++;
+        int end = m.caps[1] > pos ? m.caps[1] : pos + 1;
+        pos = searchForward(q, row->render, row->render_size, end, &m);
+    }
+    return count;
+}
+
+static int searchCountRow(editor_row* row, int before) {
+    return searchCountMatches(ec.search_query, row, before);
+}
+
+// Matches of the rows before row i.
+static int searchSumsBefore(int i) {
+    if (i > ec.search_sums.num)
+        i = ec.search_sums.num;
+    int sum = 0;
+    for (; i > 0; i -= i & -i)
+        sum += ec.search_sums.tree[i];
+    return sum;
+}
+
+static void searchSumsAdd(int i, int delta) {
+    if (i < 0)
+        return;
+    for (i++; i <= ec.search_sums.num; i += i & -i)
+        ec.search_sums.tree[i] += delta;
+}
+
+// All rows were counted again: the sums are built again when next
+// needed.
+void searchSumsReset() {
+    ec.search_sums.num = -1;
+}
+
+// Rows from at on moved, as a row was inserted or deleted there: the
+// sums of the rows before it stay, the others are added again as rows
+// appended at the end are.
+void searchSumsRowsMoved(int at) {
+    if (ec.search_sums.num > at)
+        ec.search_sums.num = at;
+}
+
+// Two rows next to each other swapped places.
+void searchSumsSwapRows(int i) {
+    if (i + 1 >= ec.search_sums.num) {
+        searchSumsRowsMoved(i);
+        return;
+    }
+    int a = ec.row[i].match_count > 0 ? ec.row[i].match_count : 0;
+    int b = ec.row[i + 1].match_count > 0 ? ec.row[i + 1].match_count : 0;
+    searchSumsAdd(i, a - b);
+    searchSumsAdd(i + 1, b - a);
+}
+
+static void searchSumsUpdate() {
+    struct match_sums* s = &ec.search_sums;
+    if (s->num == ec.num_rows)
+        return;
+    if (ec.num_rows + 1 > s->cap) {
+        int cap = s->cap ? s->cap : 64;
+        while (cap < ec.num_rows + 1)
+            cap *= 2;
+        int* tree = realloc(s->tree, sizeof(int) * cap);
+        if (!tree) die("Failed to allocate match index");
+        s->tree = tree;
+        s->cap = cap;
+    }
+
+    // Rows appended at the end go in one by one.
+    if (s->num != -1 && s->num < ec.num_rows) {
+        while (s->num < ec.num_rows) {
+            int i = ++s->num;
+            int count = ec.row[i - 1].match_count > 0 ? ec.row[i - 1].match_count : 0;
+            s->tree[i] = count + searchSumsBefore(i - 1) - searchSumsBefore(i - (i & -i));
+        }
+        return;
+    }
+
+    s->num = ec.num_rows;
+    s->tree[0] = 0;
+    for (int i = 0; i < ec.num_rows; i++)
+        s->tree[i + 1] = ec.row[i].match_count > 0 ? ec.row[i].match_count : 0;
+    for (int i = 1; i <= ec.num_rows; i++) {
+        int parent = i + (i & -i);
+        if (parent <= ec.num_rows)
+            s->tree[parent] += s->tree[i];
+    }
+}
+
+void searchIndexReset() {
+    searchSumsReset();
+    for (int i = 0; i < ec.num_rows; i++)
+        ec.row[i].match_count = -1;
+    ec.search_total = 0;
+    ec.search_stale = ec.num_rows;
+    ec.search_current = 0;
+}
+
+// The query got longer without changing what was typed before: rows
+// without matches can't have any now, only the others need a recount.
+void searchIndexNarrow() {
+    for (int i = 0; i < ec.num_rows; i++) {
+        if (ec.row[i].match_count > 0)
+            searchIndexInvalidateRow(&ec.row[i]);
+    }
+}
+
+void searchIndexInvalidateRow(editor_row* row) {
+    if (!ec.search_query || row->match_count < 0)
+        return;
+    ec.search_total -= row->match_count;
+    searchSumsAdd(row - ec.row, -row->match_count);
+    row->match_count = -1;
+    ec.search_stale++;
+    ec.search_current = 0;
+}
+
+struct search_count_job {
+    struct search_query* queries;   // One per worker
+    int rows_per_part;
+};
+
+static void searchCountPart(void* arg, int worker, int part) {
+    struct search_count_job* job = arg;
+    int first = part * job->rows_per_part;
+    int last = first + job->rows_per_part;
+    if (last > ec.num_rows)
+        last = ec.num_rows;
+
+    for (int i = first; i < last && !workersCancelled(); i++) {
+        editor_row* row = &ec.row[i];
+        if (row->match_count >= 0)
+            continue;
+        row->match_count = searchCountMatches(&job->queries[worker], row, INT_MAX);
+    }
+}
+
+// Counts the stale rows on the worker pool. Counting stops when a key is
+// pressed; rows left uncounted stay stale for the next update.
+static void searchIndexUpdateParallel(int num_threads) {
+    int num_parts = num_threads * WORKERS_PARTS_PER_THREAD;
+    struct search_count_job job;
+    job.rows_per_part = (ec.num_rows + num_parts - 1) / num_parts;
+    job.queries = malloc(sizeof(struct search_query) * num_threads);
+    if (!job.queries) die("Failed to allocate search job");
+    for (int w = 0; w < num_threads; w++)
+        searchCompile(&job.queries[w], ec.search_query->pattern, ec.search_query->flags);
+
+    workersRun(searchCountPart, &job, num_parts, true);
+    searchSumsReset();
+
+    ec.search_total = 0;
+    ec.search_stale = 0;
+    for (int i = 0; i < ec.num_rows; i++) {
+        if (ec.row[i].match_count >= 0)
+            ec.search_total += ec.row[i].match_count;
+        else
+            ec.search_stale++;
+    }
+
+    for (int w = 0; w < num_threads; w++)
+        searchFree(&job.queries[w]);
+    free(job.queries);
+}
+
+void searchIndexUpdate() {
+    if (!ec.search_query || ec.search_stale <= 0)
+        return;
+    int num_threads = workersCount();
+    if (num_threads && ec.search_stale >= WORKERS_MIN_ROWS) {
+        searchIndexUpdateParallel(num_threads);
+        return;
+    }
+    for (int i = 0; i < ec.num_rows; i++) {
+        editor_row* row = &ec.row[i];
+        if (row->match_count < 0) {
+            row->match_count = searchCountRow(row, INT_MAX);
+            ec.search_total += row->match_count;
+            searchSumsAdd(i, row->match_count);
+        }
+    }
+    ec.search_stale = 0;
+}
+
+// Returns the 1-based position among all matches of the match starting
+// at render column col of row. All rows must have been counted.
+int searchIndexLocate(int row, int col) {
+    searchSumsUpdate();
+    return 1 + searchSumsBefore(row) + searchCountRow(&ec.row[row], col);
+}
+
+/*** Replace section ***/
+
+// A global replacement builds the new content of every row in a single
+// pass over its matches, then renders and highlights the row once. Rows
+// are cut in parts run on the worker pool. A part highlights its rows
+// starting from the multiline comment state the row before it had before
+// the replacement; part boundaries where that state changed are fixed up
+// once all parts are done.
+
+// Former content of a replaced row, kept for the undo record.
+struct replace_old_row {
+    int row;
+    char* chars;
+    int size;
+    int frozen;     // A save is writing chars
+};
+
+struct replace_part {
+    int open_before;                // State left open by the row before the part
+    int replaced;                   // Replacements made in the part
+    bool lex_pending;               // Long rows left partly highlighted
+    struct replace_old_row* old;    // Rows replaced, in order
+    int num_old;
+    int max_old;
+};
+
+struct replace_job {
+    struct search_query* queries;   // One per worker
+    const char* replacement;
+    int rows_per_part;
+    bool keep_old;                  // Keep replaced rows for a transaction
+    struct replace_part* parts;
+};
+
+// Returns the content of row with every match replaced in a new buffer,
+// or NULL if the row has no match.
+static char* replaceRowContent(const struct search_query* q, const char* replacement,
+                               editor_row* row, int* new_size, int* count) {
+    char* out = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    int copied = 0;     // Chars of the row already copied or replaced
+    struct search_match m;
+
+    *count = 0;
+    int pos = searchForward(q, row->chars, row->size, 0, &m);
+    while (pos != -1) {
+        size_t replacement_len = searchWriteReplacement(q, replacement, row->chars, &m, NULL);
+        // Room for this match and everything after it left as it is.
+        size_t need = len + (pos - copied) + replacement_len + (row->size - pos) + 1;
+        if (need > cap) {
+            cap = need > cap * 2 ? need : cap * 2;
+            out = realloc(out, cap);
+            if (!out) die("Failed to allocate replaced row");
+        }
+        memcpy(&out[len], &row->chars[copied], pos - copied);
+        len += pos - copied;
+        len += searchWriteReplacement(q, replacement, row->chars, &m, &out[len]);
+        copied = m.caps[1];
+        (*count)++;
+        // Step over empty matches so they can't repeat forever.
+        int next = m.caps[1] > pos ? m.caps[1] : pos + 1;
+        pos = searchForward(q, row->chars, row->size, next, &m);
+    }
+    if (!out)
+        return NULL;
+
+    memcpy(&out[len], &row->chars[copied], row->size - copied);
+    len += row->size - copied;
+    out[len] = '\0';
+    *new_size = len;
+    return out;
+}
+
+static void replaceRowsPart(void* arg, int worker, int part) {
+    struct replace_job* job = arg;
+    struct replace_part* p = &job->parts[part];
+    int first = part * job->rows_per_part;
+    int last = first + job->rows_per_part;
+    if (last > ec.num_rows)
+        last = ec.num_rows;
+
+    // State left open by the previous row now, and when the current row
+    // was last highlighted. Unchanged rows are highlighted again only
+    // when they differ.
+    int in_comment = p->open_before;
+    int was_in_comment = in_comment;
+    for (int i = first; i < last; i++) {
+        editor_row* row = &ec.row[i];
+        int was_open = row->hl_open_comment;
+        int new_size;
+        int count;
+        char* chars = replaceRowContent(&job->queries[worker], job->replacement, row,
+                                        &new_size, &count);
+        if (chars) {
+            // Content a save is writing is let go of after the job.
+            if (job->keep_old || row->frozen) {
+                if (p->num_old == p->max_old) {
+                    p->max_old = p->max_old ? p->max_old * 2 : 64;
+                    p->old = realloc(p->old, sizeof(struct replace_old_row) * p->max_old);
+                    if (!p->old) die("Failed to allocate replaced rows");
+                }
+                p->old[p->num_old++] = (struct replace_old_row) {i, row->chars, row->size, row->frozen};
+            } else {
+                free(row->chars);
+            }
+            row->chars = chars;
+            row->size = new_size;
+            row->frozen = 0;
+            editorRenderRow(row);
+            row->wrap_lines = 0;
+            p->replaced += count;
+        }
+        if (chars || in_comment != was_in_comment)
+            rowHighlight(row, in_comment, &p->lex_pending);
+        in_comment = row->hl_open_comment;
+        was_in_comment = was_open;
+    }
+}
+
+// Replaces every match of q in the buffer. Returns the number of
+// replacements. Inside a transaction the replaced rows are handed over
+// to it.
+int editorReplaceAll(struct search_query* q, const char* replacement) {
+    if (ec.num_rows == 0 || q->len == 0)
+        return 0;
+
+    int num_threads = workersCount();
+    if (ec.num_rows < WORKERS_MIN_ROWS)
+        num_threads = 0;
+    int num_parts = num_threads ? num_threads * WORKERS_PARTS_PER_THREAD : 1;
+
+    struct replace_job job;
+    job.replacement = replacement;
+    job.rows_per_part = (ec.num_rows + num_parts - 1) / num_parts;
+    job.keep_old = ec.transaction != NULL;
+    job.parts = calloc(num_parts, sizeof(struct replace_part));
+    job.queries = num_threads ? malloc(sizeof(struct search_query) * num_threads) : q;
+    if (!job.parts || !job.queries)
+        die("Failed to allocate replace job");
+    for (int w = 0; w < num_threads; w++)
+        searchCompile(&job.queries[w], q->pattern, q->flags);
+    for (int p = 0; p < num_parts; p++) {
+        int first = p * job.rows_per_part;
+        job.parts[p].open_before = (first > 0 && first <= ec.num_rows) ?
+            ec.row[first - 1].hl_open_comment : 0;
+    }
+
+    if (num_threads)
+        workersRun(replaceRowsPart, &job, num_parts, false);
+    else
+        replaceRowsPart(&job, 0, 0);
+
+    int replacements = 0;
+    for (int p = 0; p < num_parts; p++) {
+        struct replace_part* part = &job.parts[p];
+        replacements += part->replaced;
+        if (part->lex_pending)
+            ec.lex_pending = true;
+        for (int i = 0; i < part->num_old; i++) {
+            struct replace_old_row* old = &part->old[i];
+            char* chars = old->chars;
+            if (old->frozen) {
+                saveKeepChars(old->chars);
+                if (!ec.transaction)
+                    continue;
+                if (!(chars = malloc(old->size + 1))) die("Failed to allocate undo record");
+                memcpy(chars, old->chars, old->size + 1);
+            }
+            transactionKeepRow(old->row, chars, old->size);
+        }
+        free(part->old);
+        int first = p * job.rows_per_part;
+        if (first > 0 && first < ec.num_rows &&
+            ec.row[first - 1].hl_open_comment != part->open_before)
+            editorUpdateSyntax(&ec.row[first]);
+    }
+
+    if (replacements) {
+        if (ec.search_query)
+            searchIndexReset();
+        wrapIndexReset();
+        ec.dirty += replacements;
+    }
+
+    for (int w = 0; w < num_threads; w++)
+        searchFree(&job.queries[w]);
+    if (num_threads)
+        free(job.queries);
+    free(job.parts);
+    return replacements;
+}
+
+/*** Search section ***/
+
+void editorReplace() {
+    char* search_pattern = editorPrompt("Search pattern: %s (ESC to cancel)", NULL);
     if (!search_pattern) {
         editorSetStatusMessage("Replace canceled");
         return;
     }
 
-    char* replace_pattern = editorPrompt("Replace with: %s (ESC to cancel)", NULL);
-    if (!replace_pattern) {
-        free(search_pattern);
-        editorSetStatusMessage("Replace canceled");
+    char* replace_pattern = editorPrompt("Replace with: %s (ESC to cancel)", NULL);
+    if (!replace_pattern) {
+        free(search_pattern);
+        editorSetStatusMessage("Replace canceled");
+        return;
+    }
+
+    struct search_query q;
+    if (!searchCompile(&q, search_pattern, ec.search_flags)) {
+        editorSetStatusMessage("Invalid regular expression: %s", q.error);
+        searchFree(&q);
+        free(search_pattern);
+        free(replace_pattern);
+        return;
+    }
+
+    transactionBegin();
+    int replacements = editorReplaceAll(&q, replace_pattern);
+    if (ec.cursor_y < ec.num_rows && ec.cursor_x > ec.row[ec.cursor_y].size)
+        ec.cursor_x = ec.row[ec.cursor_y].size;
+    // Before the commit, which says so if the edit can't be undone.
+    editorSetStatusMessage("Replaced %d occurrences", replacements);
+    transactionCommit();
+
+    searchFree(&q);
+    free(search_pattern);
+    free(replace_pattern);
+}
+
+void editorSearchCallback(char* query, int key) {
+   static int last_match = -1;     // Row of the current match, -1 if none
+   static int last_match_col = 0;  // Render column of the current match
+   static char* saved_query = NULL;
+   static struct search_query compiled = {0};
+
+   if (key == '\x1b' || key == '\r') {
+       // ESC after a match stays there, and Ctrl-N and Ctrl-R go on from
+       // it, but the highlighting and the counter are turned off.
+       if (key == '\x1b' && last_match != -1) {
+           ec.search_query = NULL;
+           ec.search_match_row = -1;
+           return;
+       }
+       last_match = -1;
+       if (saved_query) {
+           free(saved_query);
+           saved_query = NULL;
+       }
+       ec.search_query = NULL;
+       searchFree(&compiled);
+       return;
+   }
+
+   int direction = 1;
+   bool inclusive = false;
+
+   if (key == CTRL_KEY('n') || key == ARROW_DOWN || key == ARROW_RIGHT) {
+       query = saved_query;
+   } else if (key == CTRL_KEY('r') || key == ARROW_UP || key == ARROW_LEFT) {
+       direction = -1;
+       query = saved_query;
+   } else if (query && query[0] &&
+              (!saved_query || strcmp(query, saved_query) != 0 ||
+               compiled.flags != ec.search_flags || !ec.search_query)) {
+       // The query changed while typing: look again from the current match
+       // (or the cursor) instead of restarting from the top of the file,
+       // so a growing query stays on the match it already found.
+       bool narrowed = ec.search_query && saved_query &&
+           !(ec.search_flags & SEARCH_REGEX) && compiled.flags == ec.search_flags &&
+           strncmp(query, saved_query, strlen(saved_query)) == 0;
+       free(saved_query);
+       saved_query = strdup(query);
+       searchFree(&compiled);
+       // An incomplete regex is common while typing, just wait for more.
+       ec.search_query = searchCompile(&compiled, saved_query, ec.search_flags) ? &compiled : NULL;
+       if (narrowed)
+           searchIndexNarrow();
+       else
+           searchIndexReset();
+       ec.search_match_row = -1;
+       inclusive = true;
+   } else {
+       return;
+   }
+
+   if (!query || compiled.len == 0)
+       return;
+
+   int from_row = last_match;
+   int from_col = last_match_col;
+   if (last_match == -1 || last_match >= ec.num_rows) {
+       from_row = ec.cursor_y;
+       from_col = (ec.cursor_y < ec.num_rows)
+           ? rowMapX(&ec.row[ec.cursor_y], ROW_CHARS, ROW_RENDER, ec.cursor_x) : 0;
+       inclusive = true;
+   }
+
+   int current, match_col;
+   int found = searchRows(&compiled, direction, from_row, from_col, inclusive, &current, &match_col);
+   if (found <= 0) {
+       // When interrupted, the key that did it starts a new search anyway.
+       if (found == 0)
+           ec.search_match_row = -1;
+       return;
+   }
+
+   editor_row* row = &ec.row[current];
+   last_match = current;
+   last_match_col = match_col;
+   // The position among all matches is worked out when the screen is
+   // drawn, once every row has been counted.
+   ec.search_match_row = current;
+   ec.search_match_col = match_col;
+   ec.search_current = 0;
+   ec.cursor_y = current;
+   ec.cursor_x = rowMapX(row, ROW_RENDER, ROW_CHARS, match_col);
+   if (ec.cursor_x > row->size)
+       ec.cursor_x = row->size;
+
+   if (current < ec.row_offset) {
+       ec.row_offset = current;
+   } else if (current >= ec.row_offset + ec.screen_rows) {
+       ec.row_offset = current - ec.screen_rows + 1;
+   }
+
+   int rx = editorRowCursorXToRenderX(row, ec.cursor_x);
+   if (rx < ec.col_offset) {
+       ec.col_offset = rx;
+   } else if (rx >= ec.col_offset + ec.screen_cols) {
+       ec.col_offset = rx - ec.screen_cols + 1;
+   }
+   ec.render_x = rx;
+}
+
+
+
+void editorSearch() {
+    char* query = editorPrompt("Search: %s (Use ESC / Enter / Arrows)", editorSearchCallback);
+
+    if (query) {
+        free(query);
+    } else {
+        editorRefreshScreen();
+    }
+}
+
+/*** Action section ***/
+
+// Undo history is an append-only log of records in one contiguous arena
+// (ec.undo). A record is
+//
+//     payload length, type, cursor x, cursor y, flags    varints
+//     payload                                            string or diff
+//     length of the two above                            varint, reversed
+//
+// so the log can be walked forwards to redo and backwards to undo. Typed
+// text grows the payload of the last record in place. When the log
+// would outgrow its budget, the oldest records are dropped.
+
+// Record flags
+#define UNDO_ON_TILDE (1 << 0)      // Cursor was past the last row
+#define UNDO_HAS_STRING (1 << 1)    // Payload is a string, NUL included
+#define UNDO_JOINED (1 << 2)        // Undone and redone with the record before
+
+static size_t varintSize(size_t v) {
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static unsigned char* varintPut(unsigned char* p, size_t v) {
+    while (v >= 0x80) {
+        *p++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static const unsigned char* varintGet(const unsigned char* p, size_t* v) {
+    int shift = 0;
+    *v = 0;
+    do {
+        *v |= (size_t) (*p & 0x7f) << shift;
+        shift += 7;
+    } while (*p++ & 0x80);
+    return p;
+}
+
+// Writes v with its bytes in reverse order, readable from the end.
+static unsigned char* varintPutReversed(unsigned char* p, size_t v) {
+    size_t n = varintSize(v);
+    varintPut(p, v);
+    for (size_t i = 0; i < n / 2; i++) {
+        unsigned char tmp = p[i];
+        p[i] = p[n - 1 - i];
+        p[n - 1 - i] = tmp;
+    }
+    return p + n;
+}
+
+// Reads the reversed varint ending right before end.
+static size_t varintGetReversed(const unsigned char* end) {
+    size_t v = 0;
+    int shift = 0;
+    const unsigned char* p = end;
+    do {
+        p--;
+        v |= (size_t) (*p & 0x7f) << shift;
+        shift += 7;
+    } while (*p & 0x80);
+    return v;
+}
+
+// Like varintGet(), but returns NULL instead of reading past end.
+static const unsigned char* varintGetBounded(const unsigned char* p, const unsigned char* end,
+                                             size_t* v) {
+    for (const unsigned char* q = p; q < end && q - p < 10; q++) {
+        if (!(*q & 0x80))
+            return varintGet(p, v);
+    }
+    return NULL;
+}
+
+// Bytes taken by a record with payload_len bytes of payload.
+static size_t undoRecordSize(ActionType t, int x, int y, int flags, size_t payload_len) {
+    size_t size = varintSize(payload_len) + varintSize(t) + varintSize(x) +
+        varintSize(y) + varintSize(flags) + payload_len;
+    return size + varintSize(size);
+}
+
+// Writes the header and the trailer of a record at dst. Returns where
+// its payload goes.
+static unsigned char* undoPutRecord(unsigned char* dst, ActionType t, int x, int y, int flags,
+                                    size_t payload_len) {
+    unsigned char* p = dst;
+    p = varintPut(p, payload_len);
+    p = varintPut(p, t);
+    p = varintPut(p, x);
+    p = varintPut(p, y);
+    p = varintPut(p, flags);
+    varintPutReversed(p + payload_len, (p - dst) + payload_len);
+    return p;
+}
+
+// Decodes the record at p into action, reading nothing past end. Returns
+// where the record ends, or NULL if it is cut short.
+static const unsigned char* undoDecodeRecord(const unsigned char* p, const unsigned char* end,
+                                             Action* action) {
+    const unsigned char* start = p;
+    size_t payload_len, type, x, y, flags;
+    if (!(p = varintGetBounded(p, end, &payload_len)) ||
+        !(p = varintGetBounded(p, end, &type)) ||
+        !(p = varintGetBounded(p, end, &x)) ||
+        !(p = varintGetBounded(p, end, &y)) ||
+        !(p = varintGetBounded(p, end, &flags)) ||
+        (size_t) (end - p) < payload_len)
+        return NULL;
+
+    action->t = type;
+    action->cpos_x = x;
+    action->cpos_y = y;
+    action->cursor_on_tilde = flags & UNDO_ON_TILDE;
+    action->joined = flags & UNDO_JOINED;
+    action->string = (flags & UNDO_HAS_STRING) ? (char*) p : NULL;
+    action->diff = action->t == Transaction ? p : NULL;
+    if (action->string && (payload_len == 0 || p[payload_len - 1] != '\0'))
+        return NULL;
+
+    size_t size = (p - start) + payload_len;
+    p += payload_len;
+    if ((size_t) (end - p) < varintSize(size))
+        return NULL;
+    return p + varintSize(size);
+}
+
+// Start of the record ending at offset end of the log.
+static size_t undoRecordStart(size_t end) {
+    size_t size = varintGetReversed(ec.undo.buf + end);
+    return end - varintSize(size) - size;
+}
+
+// Decodes the record starting at offset start of the log into action.
+// Returns the offset the record ends at.
+static size_t undoDecode(size_t start, Action* action) {
+    return undoDecodeRecord(ec.undo.buf + start, ec.undo.buf + ec.undo.len, action) - ec.undo.buf;
+}
+
+// Drops the oldest records until incoming more bytes fit in half the
+// budget, so trimming doesn't happen again on the next record.
+static void undoTrim(size_t incoming) {
+    if (ec.undo.len + incoming <= ec.undo.budget)
+        return;
+    size_t cut = ec.undo.len;   // Start of the oldest record kept
+    while (cut > 0) {
+        size_t start = undoRecordStart(cut);
+        if (ec.undo.len - start + incoming > ec.undo.budget / 2)
+            break;
+        cut = start;
+    }
+    if (cut == 0)
+        return;
+
+    memmove(ec.undo.buf, ec.undo.buf + cut, ec.undo.len - cut);
+    ec.undo.len -= cut;
+    ec.undo.current = ec.undo.current > cut ? ec.undo.current - cut : 0;
+    ec.undo.last = ec.undo.last > cut ? ec.undo.last - cut : 0;
+    if (ec.undo.clean != UNDO_NOT_CLEAN)
+        ec.undo.clean = ec.undo.clean >= cut ? ec.undo.clean - cut : UNDO_NOT_CLEAN;
+    if (ec.undo.saving != UNDO_NOT_CLEAN)
+        ec.undo.saving = ec.undo.saving >= cut ? ec.undo.saving - cut : UNDO_NOT_CLEAN;
+    ec.undo.trimmed = true;
+}
+
+// Drops the records that could be redone, before a new one goes in.
+static void undoTruncate() {
+    if (ec.undo.clean != UNDO_NOT_CLEAN && ec.undo.clean > ec.undo.current)
+        ec.undo.clean = UNDO_NOT_CLEAN;
+    if (ec.undo.saving != UNDO_NOT_CLEAN && ec.undo.saving > ec.undo.current)
+        ec.undo.saving = UNDO_NOT_CLEAN;
+    ec.undo.len = ec.undo.current;
+}
+
+// Grows the arena to hold size more bytes, not past the budget.
+static void undoReserve(size_t size) {
+    if (ec.undo.len + size <= ec.undo.cap)
+        return;
+    size_t cap = ec.undo.cap ? ec.undo.cap : 4096;
+    while (cap < ec.undo.len + size)
+        cap *= 2;
+    if (cap > ec.undo.budget)
+        cap = ec.undo.len + size > ec.undo.budget ? ec.undo.len + size : ec.undo.budget;
+    unsigned char* buf = realloc(ec.undo.buf, cap);
+    if (!buf) die("Failed to allocate undo history");
+    ec.undo.buf = buf;
+    ec.undo.cap = cap;
+}
+
+// A record larger than the whole budget isn't kept, and the history
+// before it goes too, as the edit can't be undone. Returns true then.
+static bool undoOverBudget(size_t size) {
+    if (size <= ec.undo.budget)
+        return false;
+    undoForget();
+    editorSetStatusMessage("Edit too large for the undo budget (-u), it can't be undone");
+    return true;
+}
+
+// Appends a record with room for payload_len bytes of payload, dropping
+// the records that could be redone. Returns where the payload goes, or
+// NULL if undo is disabled or the record is over the budget.
+static unsigned char* undoAddRecord(ActionType t, int x, int y, int flags, size_t payload_len) {
+    if (ec.undo.budget == 0)
+        return NULL;
+    undoTruncate();
+
+    size_t size = undoRecordSize(t, x, y, flags, payload_len);
+    if (undoOverBudget(size))
+        return NULL;
+    undoTrim(size);
+    undoReserve(size);
+    unsigned char* p = undoPutRecord(ec.undo.buf + ec.undo.len, t, x, y, flags, payload_len);
+    ec.undo.last = ec.undo.len;
+    ec.undo.len += size;
+    ec.undo.current = ec.undo.len;
+    return p;
+}
+
+static void undoAddAction(Action* action) {
+    int flags = (action->cursor_on_tilde ? UNDO_ON_TILDE : 0) |
+        (action->string ? UNDO_HAS_STRING : 0);
+    size_t len = action->string ? strlen(action->string) + 1 : 0;
+    unsigned char* p = undoAddRecord(action->t, action->cpos_x, action->cpos_y, flags, len);
+    if (p && len)
+        memcpy(p, action->string, len);
+}
+
+// Appends an encoded record as it is, dropping the records that could be
+// redone. Returns false if it isn't kept.
+static bool undoAddEncoded(const unsigned char* record, size_t len) {
+    if (ec.undo.budget == 0)
+        return false;
+    undoTruncate();
+    if (undoOverBudget(len))
+        return false;
+    undoTrim(len);
+    undoReserve(len);
+    memcpy(ec.undo.buf + ec.undo.len, record, len);
+    ec.undo.last = ec.undo.len;
+    ec.undo.len += len;
+    ec.undo.current = ec.undo.len;
+    return true;
+}
+
+void undoFree() {
+    free(ec.undo.buf);
+    ec.undo.buf = NULL;
+    ec.undo.len = ec.undo.cap = ec.undo.current = ec.undo.last = 0;
+}
+
+// Drops the whole history, when the rows it points at moved.
+void undoForget() {
+    ec.undo.len = ec.undo.current = ec.undo.last = 0;
+    ec.undo.clean = ec.undo.saving = UNDO_NOT_CLEAN;
+    ec.undo.trimmed = true;
+}
+
+/* Transactions */
+
+static void undoFreeDiff(struct undo_diff* diff) {
+    for (int i = 0; i < diff->num_hunks; i++) {
+        for (int j = 0; j < diff->hunks[i].num_stored; j++)
+            free(diff->hunks[i].lines[j]);
+        free(diff->hunks[i].lines);
+        free(diff->hunks[i].sizes);
+    }
+    free(diff->hunks);
+    free(diff);
+}
+
+static struct undo_hunk* undoAddHunk(struct undo_diff* diff, int at, int count) {
+    if (diff->num_hunks == diff->max_hunks) {
+        diff->max_hunks = diff->max_hunks ? diff->max_hunks * 2 : 16;
+        diff->hunks = realloc(diff->hunks, sizeof(struct undo_hunk) * diff->max_hunks);
+        if (!diff->hunks) die("Failed to allocate undo record");
+    }
+    struct undo_hunk* h = &diff->hunks[diff->num_hunks++];
+    h->at = at;
+    h->num_present = count;
+    h->num_stored = 0;
+    h->max_stored = count ? count : 1;
+    h->lines = malloc(sizeof(char*) * h->max_stored);
+    h->sizes = malloc(sizeof(int) * h->max_stored);
+    if (!h->lines || !h->sizes) die("Failed to allocate undo record");
+    return h;
+}
+
+// The run opened by transactionSaveRows() ends where the rows that
+// followed it start now.
+static void transactionCloseRun(struct undo_diff* diff) {
+    if (diff->open_tail < 0) return;
+    struct undo_hunk* h = &diff->hunks[diff->num_hunks - 1];
+    h->num_present = ec.num_rows - diff->open_tail - h->at;
+    diff->open_tail = -1;
+}
+
+// Starts grouping edits into a single undo record. Transactions nest,
+// the outermost commit records them.
+void transactionBegin() {
+    if (ec.transaction_depth++ > 0 || (ec.undo.budget == 0 && !journalActive())) return;
+    ec.transaction = calloc(1, sizeof(struct undo_diff));
+    if (!ec.transaction) die("Failed to allocate undo record");
+    ec.transaction->open_tail = -1;
+    ec.transaction->before_x = ec.cursor_x;
+    ec.transaction->before_y = ec.cursor_y;
+}
+
+// Makes the transaction one with the record before it, for an edit made
+// in steps other edits may come between, like a streamed response.
+void transactionJoin() {
+    if (ec.transaction)
+        ec.transaction->joined = true;
+}
+
+// Saves rows [at, at + count) before the transaction edits them. The edit
+// may turn them into any number of rows, but must leave the rows after
+// them alone until the next call or the commit. Runs must be saved from
+// the top of the buffer down.
+void transactionSaveRows(int at, int count) {
+    struct undo_diff* diff = ec.transaction;
+    if (!diff) return;
+    transactionCloseRun(diff);
+    struct undo_hunk* h = undoAddHunk(diff, at, count);
+    for (int i = 0; i < count; i++) {
+        h->lines[i] = malloc(ec.row[at + i].size + 1);
+        if (!h->lines[i]) die("Failed to allocate undo record");
+        memcpy(h->lines[i], ec.row[at + i].chars, ec.row[at + i].size + 1);
+        h->sizes[i] = ec.row[at + i].size;
+    }
+    h->num_stored = count;
+    diff->open_tail = ec.num_rows - at - count;
+}
+
+// Hands the former content of row `at`, changed in place, over to the
+// transaction. Rows must be handed over from the top of the buffer down.
+void transactionKeepRow(int at, char* chars, int size) {
+    struct undo_diff* diff = ec.transaction;
+    if (!diff) {
+        free(chars);
+        return;
+    }
+    transactionCloseRun(diff);
+    struct undo_hunk* h = diff->num_hunks ? &diff->hunks[diff->num_hunks - 1] : NULL;
+    if (!h || h->at + h->num_present != at || h->num_present != h->num_stored) {
+        h = undoAddHunk(diff, at, 0);
+    } else if (h->num_stored == h->max_stored) {
+        h->max_stored *= 2;
+        h->lines = realloc(h->lines, sizeof(char*) * h->max_stored);
+        h->sizes = realloc(h->sizes, sizeof(int) * h->max_stored);
+        if (!h->lines || !h->sizes) die("Failed to allocate undo record");
+    }
+    h->lines[h->num_stored] = chars;
+    h->sizes[h->num_stored] = size;
+    h->num_stored++;
+    h->num_present++;
+}
+
+// Records the transaction as one record, without executing it again. The
+// payload is the cursor after the edit and the runs of rows it changed,
+// each as its first row, its number of rows before and after the edit,
+// then the rows before and the rows after.
+void transactionCommit() {
+    if (ec.transaction_depth == 0 || --ec.transaction_depth > 0) return;
+    struct undo_diff* diff = ec.transaction;
+    ec.transaction = NULL;
+    if (!diff) return;
+    transactionCloseRun(diff);
+    if (diff->num_hunks == 0) {
+        undoFreeDiff(diff);
+        return;
+    }
+
+    size_t size = varintSize(ec.cursor_x) + varintSize(ec.cursor_y) + varintSize(diff->num_hunks);
+    for (int i = 0; i < diff->num_hunks; i++) {
+        struct undo_hunk* h = &diff->hunks[i];
+        size += varintSize(h->at) + varintSize(h->num_stored) + varintSize(h->num_present);
+        for (int j = 0; j < h->num_stored; j++)
+            size += varintSize(h->sizes[j]) + h->sizes[j];
+        for (int j = 0; j < h->num_present; j++)
+            size += varintSize(ec.row[h->at + j].size) + ec.row[h->at + j].size;
+    }
+
+    // With undo disabled, or the record over its budget, the record is
+    // still built for the journal.
+    int flags = diff->joined ? UNDO_JOINED : 0;
+    size_t record_size = undoRecordSize(Transaction, diff->before_x, diff->before_y, flags, size);
+    unsigned char* record;
+    unsigned char* p = undoAddRecord(Transaction, diff->before_x, diff->before_y, flags, size);
+    bool kept = p != NULL;
+    if (kept) {
+        record = ec.undo.buf + ec.undo.last;
+    } else {
+        record = malloc(record_size);
+        if (!record) die("Failed to allocate undo record");
+        p = undoPutRecord(record, Transaction, diff->before_x, diff->before_y, flags, size);
+    }
+    p = varintPut(p, ec.cursor_x);
+    p = varintPut(p, ec.cursor_y);
+    p = varintPut(p, diff->num_hunks);
+    for (int i = 0; i < diff->num_hunks; i++) {
+        struct undo_hunk* h = &diff->hunks[i];
+        p = varintPut(p, h->at);
+        p = varintPut(p, h->num_stored);
+        p = varintPut(p, h->num_present);
+        for (int j = 0; j < h->num_stored; j++) {
+            p = varintPut(p, h->sizes[j]);
+            memcpy(p, h->lines[j], h->sizes[j]);
+            p += h->sizes[j];
+        }
+        for (int j = 0; j < h->num_present; j++) {
+            editor_row* row = &ec.row[h->at + j];
+            p = varintPut(p, row->size);
+            memcpy(p, row->chars, row->size);
+            p += row->size;
+        }
+    }
+    journalRecord(JOURNAL_EDIT, record, record_size);
+    if (!kept)
+        free(record);
+    undoFreeDiff(diff);
+}
+
+// A run of a Transaction record, decoded.
+struct undo_run {
+    int at;
+    int num_before;
+    int num_after;
+    const unsigned char* before;    // Encoded rows before the edit
+    const unsigned char* after;     // Encoded rows after it
+};
+
+static const unsigned char* undoSkipRows(const unsigned char* p, int count) {
+    for (int i = 0; i < count; i++) {
+        size_t size;
+        p = varintGet(p, &size);
+        p += size;
+    }
+    return p;
+}
+
+// Replaces rows [at, at + num_present) with num_lines encoded rows.
+// Rows keeping their place are only rendered, undoApplyDiff() highlights
+// them.
+static void undoReplaceRows(int at, int num_present, const unsigned char* p, int num_lines) {
+    for (int i = 0; i < num_lines; i++) {
+        size_t size;
+        p = varintGet(p, &size);
+        if (i < num_present) {
+            editor_row* row = &ec.row[at + i];
+            char* chars = malloc(size + 1);
+            if (!chars) die("Failed to allocate row");
+            memcpy(chars, p, size);
+            chars[size] = '\0';
+            editorRowReleaseChars(row);
+            row->chars = chars;
+            row->size = size;
+            editorRenderRow(row);
+            searchIndexInvalidateRow(row);
+            wrapIndexInvalidateRow(row);
+            ec.dirty++;
+        } else {
+            editorInsertRow(at + i, (const char*) p, size);
+        }
+        p += size;
+    }
+    for (int i = num_lines; i < num_present; i++)
+        editorDelRow(at + num_lines);
+}
+
+// Run rows are positions after the edit, so undo replaces runs bottom up
+// and redo top down: either way the runs not replaced yet keep their
+// positions.
+static void undoApplyDiff(Action* action, bool redo) {
+    const unsigned char* p = action->diff;
+    size_t after_x, after_y, num_runs;
+    p = varintGet(p, &after_x);
+    p = varintGet(p, &after_y);
+    p = varintGet(p, &num_runs);
+
+    struct undo_run* runs = malloc(sizeof(struct undo_run) * num_runs);
+    if (!runs) die("Failed to allocate undo runs");
+    for (size_t i = 0; i < num_runs; i++) {
+        size_t at, num_before, num_after;
+        p = varintGet(p, &at);
+        p = varintGet(p, &num_before);
+        p = varintGet(p, &num_after);
+        runs[i].at = at;
+        runs[i].num_before = num_before;
+        runs[i].num_after = num_after;
+        runs[i].before = p;
+        runs[i].after = p = undoSkipRows(p, num_before);
+        p = undoSkipRows(p, num_after);
+    }
+
+    for (size_t k = 0; k < num_runs; k++) {
+        struct undo_run* r = &runs[redo ? k : num_runs - 1 - k];
+        if (redo)
+            undoReplaceRows(r->at, r->num_before, r->after, r->num_after);
+        else
+            undoReplaceRows(r->at, r->num_after, r->before, r->num_before);
+    }
+
+    // Highlighting in a single pass down the buffer, each replaced row and
+    // the rows whose multiline comment state changed under them once.
+    // After an undo, runs below ones that changed the number of rows have
+    // moved.
+    int shift = 0;
+    int next = 0;   // First row not highlighted yet
+    for (size_t k = 0; k < num_runs; k++) {
+        int first = runs[k].at + shift;
+        int count = redo ? runs[k].num_after : runs[k].num_before;
+        int row = first > next ? first : next;
+        bool changed = true;
+        while (row < ec.num_rows && (row <= first + count || changed))
+            changed = editorUpdateSyntaxRow(&ec.row[row++]);
+        next = row;
+        if (!redo)
+            shift += runs[k].num_before - runs[k].num_after;
+    }
+    free(runs);
+
+    ec.cursor_x = redo ? (int) after_x : action->cpos_x;
+    ec.cursor_y = redo ? (int) after_y : action->cpos_y;
+    if (ec.cursor_y > ec.num_rows)
+        ec.cursor_y = ec.num_rows;
+    if (ec.cursor_y < ec.num_rows && ec.cursor_x > ec.row[ec.cursor_y].size)
+        ec.cursor_x = ec.row[ec.cursor_y].size;
+}
+
+void execute(Action* action) {
+    if(!action) return;
+    switch(action->t) {
+        case InsertChar:
+            {
+                ec.cursor_x = action->cpos_x;
+                ec.cursor_y = action->cpos_y;
+                if(ec.cursor_y < ec.num_rows) {
+                    editorRowInsertString(&ec.row[ec.cursor_y], ec.cursor_x, action->string);
+                    ec.cursor_x += strlen(action->string);
+                } else {
+                    editorInsertChar((unsigned char) *action->string);
+                    if (ec.cursor_y < ec.num_rows && action->string[1]) {
+                        editorRowInsertString(&ec.row[ec.cursor_y], ec.cursor_x, action->string + 1);
+                        ec.cursor_x += strlen(action->string + 1);
+                    }
+                }
+            }
+            break;
+        case DelChar:
+            {
+                ec.cursor_x = action->cpos_x;
+                ec.cursor_y = action->cpos_y;
+                // The chars recorded go, a whole cluster.
+                int len = action->string ? strlen(action->string) : 0;
+                if (len > 1 && ec.cursor_y < ec.num_rows && ec.cursor_x >= len) {
+                    editorRowDelString(&ec.row[ec.cursor_y], ec.cursor_x - len, len);
+                    ec.cursor_x -= len;
+                } else {
+                    editorDelChar();
+                }
+            }
+            break;
+        case PasteLine:
+            {
+                ec.cursor_x = action->cpos_x;
+                ec.cursor_y = action->cpos_y;
+                // store current copied char buffer
+                char* curr_copy_buffer = ec.copied_char_buffer;
+                // set editor copy buffer to action string
+                ec.copied_char_buffer = action->string;
+                editorPaste();
+                // reset editor copy buffer
+                ec.copied_char_buffer = curr_copy_buffer;
+            }
+            break;
+        case CutLine:
+            {
+                ec.cursor_x = action->cpos_x;
+                ec.cursor_y = action->cpos_y;
+                editorCut();
+            }
+            break;
+        case FlipDown:
+            {
+                ec.cursor_x = action->cpos_x;
+                ec.cursor_y = action->cpos_y;
+                editorFlipRow(-1);
+            }
+            break;
+        case FlipUp:
+            {
+                ec.cursor_x = action->cpos_x;
+                ec.cursor_y = action->cpos_y;
+                editorFlipRow(1);
+            }
+            break;
+        case NewLine:
+            {
+                ec.cursor_x = action->cpos_x;
+                ec.cursor_y = action->cpos_y;
+                editorInsertNewline();
+            }
+            break;
+        case Transaction:
+            undoApplyDiff(action, true);
+            break;
+        default: break;
+    }
+}
+
+void revert(Action *action) {
+    if(!action) return;
+    switch(action->t) {
+        case InsertChar:
+            {
+                ec.cursor_x = action->cpos_x;
+                ec.cursor_y = action->cpos_y;
+                editorRowDelString(&ec.row[ec.cursor_y], ec.cursor_x, strlen(action->string));
+                if(action->cursor_on_tilde)
+                    editorDelRow(ec.cursor_y);
+            }
+            break;
+        case DelChar:
+            {
+                if(action->string) {
+                    int len = strlen(action->string);
+                    ec.cursor_x = action->cpos_x - len;
+                    ec.cursor_y = action->cpos_y;
+                    if (len > 1) {
+                        editorRowInsertString(&ec.row[ec.cursor_y], ec.cursor_x, action->string);
+                        ec.cursor_x += len;
+                    } else {
+                        editorInsertChar((unsigned char) *action->string);
+                    }
+                } else {
+                    editorInsertNewline();
+                }
+            }
+            break;
+        case PasteLine:
+            {
+                ec.cursor_x = action->cpos_x;
+                ec.cursor_y = action->cpos_y;
+                editor_row* row = &ec.row[ec.cursor_y];
+                if(action->string) {
+                    editorRowDelString(row, ec.cursor_x, strlen(action->string));
+                    if(action->cursor_on_tilde) editorDelRow(ec.cursor_y);
+                }
+            }
+            break;
+        case CutLine:
+            {
+                ec.cursor_x = 0;
+                ec.cursor_y = action->cpos_y;
+                editorInsertRow(ec.cursor_y, "", 0);
+                // store current copied char buffer
+                char* curr_copy_buffer = ec.copied_char_buffer;
+                // set editor copy buffer to action string
+                ec.copied_char_buffer = action->string;
+                editorPaste();
+                // reset editor copy buffer
+                ec.copied_char_buffer = curr_copy_buffer;
+            }
+            break;
+        case FlipDown:
+            {
+                ec.cursor_x = action->cpos_x;
+                ec.cursor_y = action->cpos_y + 1;
+                editorFlipRow(1);
+            }
+            break;
+        case FlipUp:
+            {
+                ec.cursor_x = action->cpos_x;
+                ec.cursor_y = action->cpos_y - 1;
+                editorFlipRow(-1);
+            }
+            break;
+        case NewLine:
+            {
+                ec.cursor_x = 0;
+                ec.cursor_y = action->cpos_y + 1;
+                editorDelChar();
+            }
+            break;
+        case Transaction:
+            undoApplyDiff(action, false);
+            break;
+        default: break;
+    }
+}
+
+
+// If last action is InsertChar operation and the current action is also InsertChar
+// Instead of creating new action, this function appends the char (a whole
+// UTF-8 sequence) to the string stored in the last record, provided the
+// current action does append at the end of the row
+bool concatWithLastAction(ActionType t, char* str) {
+    if (t != InsertChar)
+        return false;
+    size_t n = strlen(str);
+    if (ec.undo.len == 0 || ec.undo.current != ec.undo.len ||
+        ec.undo.clean == ec.undo.len || ec.undo.saving == ec.undo.len ||
+        ec.undo.len + n + 1 > ec.undo.budget)
+        return false;
+
+    Action last;
+    undoDecode(ec.undo.last, &last);
+    if (last.t != t || !last.string || last.cpos_y != ec.cursor_y ||
+        last.cpos_x + (int) strlen(last.string) != ec.cursor_x)
+        return false;
+
+    editorRowInsertString(&ec.row[ec.cursor_y], ec.cursor_x, str);
+    ec.cursor_x += n;
+
+    // The string is the end of the payload: it grows by n bytes in place,
+    // shifting only when its length needs one more varint byte.
+    unsigned char* start = ec.undo.buf + ec.undo.last;
+    size_t payload_len;
+    varintGet(start, &payload_len);
+    size_t grow = varintSize(payload_len + n) - varintSize(payload_len);
+    size_t size = ((unsigned char*) last.string - start) + payload_len;
+    size_t new_size = size + grow + n;
+    undoReserve(grow + n + varintSize(new_size));
+    start = ec.undo.buf + ec.undo.last;
+    unsigned char* header_end = start + varintSize(payload_len);
+    if (grow)
+        memmove(header_end + grow, header_end, size - (header_end - start));
+    varintPut(start, payload_len + n);
+    unsigned char* nul = start + new_size - 1;
+    memcpy(nul - n, str, n);
+    nul[0] = '\0';
+    varintPutReversed(start + new_size, new_size);
+    ec.undo.len = ec.undo.current = ec.undo.last + new_size + varintSize(new_size);
+    return true;
+}
+
+// Executes an action and records it in the undo log.
+// Takes ActionType and char* as paramaters for use in undo/redo operation
+void makeAction(ActionType t, char* str) {
+    Action action = {t, ec.cursor_x, ec.cursor_y, ec.cursor_y == ec.num_rows, str, NULL, false};
+    // Inside a transaction the edit is recorded by the transaction itself.
+    if (ec.transaction) {
+        execute(&action);
+    } else {
+        journalAction(&action);
+        if (!concatWithLastAction(t, str)) {
+            undoAddAction(&action);
+            execute(&action);
+        }
+    }
+    free(str);
+}
+
+// Undoes the last record. Returns whether it was joined to the one
+// before, to be undone with it.
+bool undo() {
+    // History of earlier sessions is only read when reaching back to it.
+    if (ec.undo.current == 0 && !undoHistoryLoad()) return false;
+    Action action;
+    size_t start = undoRecordStart(ec.undo.current);
+    undoDecode(start, &action);
+    journalRecord(JOURNAL_UNDO, ec.undo.buf + start, ec.undo.current - start);
+    revert(&action);
+    ec.undo.current = start;
+    if (ec.undo.current == ec.undo.clean) {
+        ec.dirty = 0;
+    }
+    return action.joined;
+}
+
+// Redoes the next record. Returns whether the one after it is joined to
+// it, to be redone with it.
+bool redo() {
+    if (ec.undo.current == ec.undo.len) return false;
+    Action action;
+    size_t end = undoDecode(ec.undo.current, &action);
+    journalRecord(JOURNAL_REDO, ec.undo.buf + ec.undo.current, end - ec.undo.current);
+    execute(&action);
+    ec.undo.current = end;
+    if (ec.undo.current == ec.undo.clean)
+        ec.dirty = 0;
+    if (ec.undo.current == ec.undo.len)
+        return false;
+    undoDecode(ec.undo.current, &action);
+    return action.joined;
+}
+
+/*** Journal section ***/
+
+// Until a file is saved, every edit is also appended to a journal next
+// to it (.name.mel-journal), so a crash or a dropped session loses
+// nothing. The journal starts with the size and modification time of the
+// file it applies to, followed by one entry per edit: a JOURNAL_* byte
+// and an undo record (see the Action section). Undo and redo entries
+// carry the record they apply, for when replay finds it missing from the
+// undo log. Entries are written to the file once a second or when the
+// user stops typing, and synced to disk at most once a second.
+
+#define JOURNAL_MAGIC "mel journal 1\n"
+// Buffered entries are written once they take this many bytes.
+#define JOURNAL_FLUSH_BYTES (64 << 10)
+// Seconds between writes, and between syncs, of the journal.
+#define JOURNAL_INTERVAL 1.0
+
+struct journal {
+    char* path;                 // NULL if there is no file to journal
+    int fd;                     // -1 until the first edit
+    unsigned char* buf;         // Entries not written yet
+    size_t len;
+    size_t cap;
+    bool replaying;             // Replayed edits are in the journal already
+    bool disabled;              // Nothing is journaled (--batch)
+    bool unsynced;              // Written since the last sync
+    double last_write;
+    double last_sync;
+    off_t file_size;            // The file the journal applies to
+    struct timespec file_mtime;
+} journal = {.fd = -1};
+
+static double journalNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+bool journalActive() {
+    return journal.path != NULL;
+}
+
+static void journalReserve(size_t size) {
+    if (journal.len + size <= journal.cap)
+        return;
+    size_t cap = journal.cap ? journal.cap : 4096;
+    while (cap < journal.len + size)
+        cap *= 2;
+    unsigned char* buf = realloc(journal.buf, cap);
+    if (!buf) die("Failed to allocate journal");
+    journal.buf = buf;
+    journal.cap = cap;
+}
+
+// Stops journaling, keeping whatever was written.
+static void journalDisable(const char* why) {
+    editorSetStatusMessage("Journal disabled: %s: %s", why, strerror(errno));
+    if (journal.fd != -1)
+        close(journal.fd);
+    journal.fd = -1;
+    free(journal.path);
+    journal.path = NULL;
+    journal.len = 0;
+}
+
+static void journalWrite() {
+    size_t done = 0;
+    while (done < journal.len) {
+        ssize_t n = write(journal.fd, journal.buf + done, journal.len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            journalDisable("write failed");
+            return;
+        }
+        done += n;
+    }
+    journal.len = 0;
+    journal.unsynced = true;
+    journal.last_write = journalNow();
+}
+
+// Creates the journal, at the first edit after opening or saving.
+static bool journalCreate() {
+    journal.fd = open(journal.path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (journal.fd == -1) {
+        journalDisable("can't create it");
+        return false;
+    }
+    unsigned char header[sizeof(JOURNAL_MAGIC) + 30];
+    unsigned char* p = header + strlen(JOURNAL_MAGIC);
+    memcpy(header, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC));
+    p = varintPut(p, journal.file_size);
+    p = varintPut(p, journal.file_mtime.tv_sec);
+    p = varintPut(p, journal.file_mtime.tv_nsec);
+
+    // The header goes first, the entries already buffered after it.
+    size_t len = p - header;
+    journalReserve(len);
+    memmove(journal.buf + len, journal.buf, journal.len);
+    memcpy(journal.buf, header, len);
+    journal.len += len;
+    journal.last_sync = journalNow();
+    return true;
+}
+
+// Appends an entry with an undo record to the journal.
+void journalRecord(int kind, const unsigned char* record, size_t len) {
+    if (!journal.path || journal.replaying)
+        return;
+    journalReserve(1 + len);
+    journal.buf[journal.len] = kind;
+    memcpy(journal.buf + journal.len + 1, record, len);
+    journal.len += 1 + len;
+
+    if (journal.fd == -1 && !journalCreate())
+        return;
+    if (journal.len >= JOURNAL_FLUSH_BYTES || journalNow() - journal.last_write >= JOURNAL_INTERVAL)
+        journalWrite();
+}
+
+void journalAction(Action* action) {
+    if (!journal.path || journal.replaying)
+        return;
+    int flags = (action->cursor_on_tilde ? UNDO_ON_TILDE : 0) |
+        (action->string ? UNDO_HAS_STRING : 0);
+    size_t len = action->string ? strlen(action->string) + 1 : 0;
+    size_t size = undoRecordSize(action->t, action->cpos_x, action->cpos_y, flags, len);
+
+    // Encoded in place rather than through a temporary record, it is the
+    // one entry written for every key.
+    journalReserve(1 + size);
+    journal.buf[journal.len] = JOURNAL_EDIT;
+    unsigned char* p = undoPutRecord(journal.buf + journal.len + 1, action->t,
+                                     action->cpos_x, action->cpos_y, flags, len);
+    if (len)
+        memcpy(p, action->string, len);
+    journal.len += 1 + size;
+
+    if (journal.fd == -1 && !journalCreate())
+        return;
+    if (journal.len >= JOURNAL_FLUSH_BYTES || journalNow() - journal.last_write >= JOURNAL_INTERVAL)
+        journalWrite();
+}
+
+// Writes what was buffered as soon as the user pauses, syncing it when
+// the last sync is old enough.
+void journalIdle() {
+    if (journal.fd == -1)
+        return;
+    if (journal.len)
+        journalWrite();
+    if (journal.fd != -1 && journal.unsynced && journalNow() - journal.last_sync >= JOURNAL_INTERVAL) {
+        fdatasync(journal.fd);
+        journal.unsynced = false;
+        journal.last_sync = journalNow();
+    }
+}
+
+// Writes and syncs everything, before mel stops running for a while.
+void journalFlush() {
+    if (journal.fd == -1)
+        return;
+    if (journal.len)
+        journalWrite();
+    if (journal.fd != -1 && journal.unsynced) {
+        fdatasync(journal.fd);
+        journal.unsynced = false;
+        journal.last_sync = journalNow();
+    }
+}
+
+// Removes the journal, once the edits are saved or thrown away.
+void journalDiscard() {
+    if (journal.fd != -1) {
+        close(journal.fd);
+        journal.fd = -1;
+    }
+    if (journal.path)
+        unlink(journal.path);
+    journal.len = 0;
+    journal.unsynced = false;
+}
+
+// Path of the hidden file next to file_name ending in suffix
+// (.name.suffix).
+char* hiddenFilePath(const char* file_name, const char* suffix) {
+    const char* base = strrchr(file_name, '/');
+    int dir_len = base ? base - file_name + 1 : 0;
+    base = base ? base + 1 : file_name;
+    size_t size = strlen(file_name) + strlen(suffix) + 3;
+    char* path = malloc(size);
+    if (!path) die("Failed to allocate path");
+    snprintf(path, size, "%.*s.%s.%s", dir_len, file_name, base, suffix);
+    return path;
+}
+
+static void journalFileIdentity(const char* file_name, off_t* size, struct timespec* mtime) {
+    struct stat st;
+    if (stat(file_name, &st) == 0) {
+        *size = st.st_size;
+        *mtime = st.st_mtim;
+    } else {
+        *size = 0;
+        mtime->tv_sec = 0;
+        mtime->tv_nsec = 0;
+    }
+}
+
+// Journals the edits of file_name from now on, as it is on disk now.
+void journalSetFile(const char* file_name) {
+    journalDiscard();
+    free(journal.path);
+    journal.path = file_name && !journal.disabled ? hiddenFilePath(file_name, "mel-journal") : NULL;
+    if (file_name)
+        journalFileIdentity(file_name, &journal.file_size, &journal.file_mtime);
+}
+
+static void journalReplayEntry(int kind, const unsigned char* record, size_t len) {
+    Action action;
+    undoDecodeRecord(record, record + len, &action);
+    switch (kind) {
+        case JOURNAL_EDIT:
+            if (action.t == Transaction && undoAddEncoded(record, len)) {
+                // Recorded as the live edit was, straight from the journal.
+                undoDecode(ec.undo.last, &action);
+                execute(&action);
+            } else if (action.t == Transaction) {
+                execute(&action);
+            } else {
+                ec.cursor_x = action.cpos_x;
+                ec.cursor_y = action.cpos_y;
+                makeAction(action.t, action.string ? strdup(action.string) : NULL);
+            }
+            break;
+        case JOURNAL_UNDO:
+            if (ec.undo.current > 0)
+                undo();
+            else
+                revert(&action);
+            break;
+        case JOURNAL_REDO:
+            if (ec.undo.current < ec.undo.len)
+                redo();
+            else
+                execute(&action);
+            break;
+    }
+}
+
+static unsigned char* journalReadFile(const char* path, size_t* len) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+    struct stat st;
+    unsigned char* buf = NULL;
+    if (fstat(fd, &st) == 0 && (buf = malloc(st.st_size + 1))) {
+        size_t done = 0;
+        ssize_t n;
+        while (done < (size_t) st.st_size &&
+               ((n = read(fd, buf + done, st.st_size - done)) > 0 || (n < 0 && errno == EINTR)))
+            done += n > 0 ? n : 0;
+        *len = done;
+    }
+    close(fd);
+    return buf;
+}
+
+// Offers to replay the journal left by a session that didn't end, if it
+// applies to the file as it is on disk. Replay goes through the same
+// paths as the edits did, without drawing, so it rebuilds the undo
+// history too. Returns whether edits were replayed.
+bool journalRecover() {
+    if (!journal.path || access(journal.path, F_OK) != 0)
+        return false;
+
+    size_t len = 0;
+    unsigned char* buf = journalReadFile(journal.path, &len);
+    if (!buf) {
+        editorSetStatusMessage("Can't read journal %s: %s", journal.path, strerror(errno));
+        return false;
+    }
+    const unsigned char* end = buf + len;
+    const unsigned char* p = buf + strlen(JOURNAL_MAGIC);
+    size_t size, sec, nsec;
+    if (len < strlen(JOURNAL_MAGIC) || memcmp(buf, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC)) ||
+        !(p = varintGetBounded(p, end, &size)) ||
+        !(p = varintGetBounded(p, end, &sec)) ||
+        !(p = varintGetBounded(p, end, &nsec))) {
+        editorSetStatusMessage("Ignoring unreadable journal %s", journal.path);
+        free(buf);
+        return false;
+    }
+    if ((off_t) size != journal.file_size || (time_t) sec != journal.file_mtime.tv_sec ||
+        (long) nsec != journal.file_mtime.tv_nsec) {
+        editorSetStatusMessage("Ignoring journal %s, the file changed since it was written", journal.path);
+        free(buf);
+        return false;
+    }
+
+    int entries = 0;
+    for (const unsigned char* q = p; q < end; entries++) {
+        Action action;
+        const unsigned char* next = undoDecodeRecord(q + 1, end, &action);
+        if (!next || (*q != JOURNAL_EDIT && *q != JOURNAL_UNDO && *q != JOURNAL_REDO))
+            break;
+        q = next;
+    }
+    if (entries == 0) {
+        free(buf);
+        journalDiscard();
+        return false;
+    }
+
+    editorSetStatusMessage("Found %d unsaved edits of this file in its journal. Recover them? (y/n)", entries);
+    editorRefreshScreen();
+    int c;
+    do {
+        c = tolower(editorReadKey());
+    } while (c != 'y' && c != 'n' && c != '\x1b');
+    if (serverDetaching()) {
+        // No answer, the server asks the next terminal.
+        free(buf);
+        return false;
+    }
+    if (c != 'y') {
+        free(buf);
+        journalDiscard();
+        editorSetStatusMessage("Journal discarded");
+        return false;
+    }
+
+    double start = journalNow();
+    journal.replaying = true;
+    for (int i = 0; i < entries; i++) {
+        Action action;
+        const unsigned char* next = undoDecodeRecord(p + 1, end, &action);
+        int kind = *p;
+        journalReplayEntry(kind, p + 1, next - (p + 1));
+        p = next;
+    }
+    journal.replaying = false;
+
+    // New edits go after the last complete entry.
+    journal.fd = open(journal.path, O_WRONLY | O_CLOEXEC);
+    if (journal.fd == -1 || ftruncate(journal.fd, p - buf) == -1 ||
+        lseek(journal.fd, 0, SEEK_END) == -1)
+        journalDisable("can't reopen it");
+    journal.last_write = journal.last_sync = journalNow();
+    free(buf);
+
+    if (ec.cursor_y > ec.num_rows)
+        ec.cursor_y = ec.num_rows;
+    if (ec.cursor_y < ec.num_rows && ec.cursor_x > ec.row[ec.cursor_y].size)
+        ec.cursor_x = ec.row[ec.cursor_y].size;
+    if (!ec.dirty)
+        ec.dirty = 1;
+    editorSetStatusMessage("Recovered %d edits in %.0f ms", entries, (journalNow() - start) * 1e3);
+    return true;
+}
+
+/*** Undo history section ***/
+
+// The undo log of a file is kept across sessions: saving writes it to
+// $XDG_CACHE_HOME/mel/undo (~/.cache/mel/undo), in a file named after a
+// hash of the file's path. It starts with the path, the size and
+// modification time of the file as saved and a hash of its contents,
+// followed by the records of the log up to the saved state. Nothing is
+// read at startup: the first undo reaching past the start of the session
+// (or the next save) loads it, if the file is still the one it was
+// written for, and puts its records before those of the session.
+
+#define UNDO_HISTORY_MAGIC "mel undo 1\n"
+
+struct undo_history {
+    char* path;                 // NULL if the file has no history
+    char* file_path;            // Absolute path of the file
+    off_t file_size;            // The file as it was opened or saved
+    struct timespec file_mtime;
+    bool tried;                 // The history was looked for already
+    bool disabled;              // No history is kept (--batch)
+} undo_history;
+
+uint64_t fnvHash(uint64_t h, const void* data, size_t len) {
+    const unsigned char* p = data;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ p[i]) * FNV_PRIME;
+    return h;
+}
+
+// Directory the histories go in, created if needed. NULL if there is no
+// cache directory.
+static char* undoHistoryDir() {
+    const char* cache = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    char dir[PATH_MAX];
+    if (cache && *cache)
+        snprintf(dir, sizeof(dir), "%s/mel/undo", cache);
+    else if (home && *home)
+        snprintf(dir, sizeof(dir), "%s/.cache/mel/undo", home);
+    else
+        return NULL;
+
+    // Like mkdir -p, the cache directory itself may not exist yet.
+    for (char* p = strchr(dir + 1, '/'); ; p = strchr(p + 1, '/')) {
+        if (p) *p = '\0';
+        if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+            return NULL;
+        if (!p) break;
+        *p = '/';
+    }
+    return strdup(dir);
+}
+
+// Keeps the history of file_name from now on, as it is on disk now.
+void undoHistorySetFile(const char* file_name) {
+    free(undo_history.path);
+    free(undo_history.file_path);
+    undo_history.path = undo_history.file_path = NULL;
+    undo_history.tried = false;
+    if (!file_name || undo_history.disabled)
+        return;
+
+    char* dir = NULL;
+    char* file_path = realpath(file_name, NULL);
+    if (!file_path || !(dir = undoHistoryDir())) {
+        free(file_path);
+        return;
+    }
+    size_t len = strlen(dir) + 32;
+    undo_history.path = malloc(len);
+    if (!undo_history.path) die("Failed to allocate undo history path");
+    snprintf(undo_history.path, len, "%s/%016llx.undo", dir,
+             (unsigned long long) fnvHash(FNV_BASIS, file_path, strlen(file_path)));
+    free(dir);
+    undo_history.file_path = file_path;
+    journalFileIdentity(file_name, &undo_history.file_size, &undo_history.file_mtime);
+}
+
+static bool undoHistoryHashFile(const char* file_name, uint64_t* hash) {
+    int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    bool ok = hashFd(fd, hash);
+    close(fd);
+    return ok;
+}
+
+// Loads the history of earlier sessions before the records of this one,
+// the first time it's needed. Returns whether records were added.
+bool undoHistoryLoad() {
+    // Once the first records of the session are dropped, the history
+    // can't be joined to those left.
+    if (undo_history.tried || !undo_history.path || ec.undo.budget == 0 || ec.undo.trimmed)
+        return false;
+    undo_history.tried = true;
+
+    // The records end at the file as it was opened, which must still be
+    // on disk to be checked against the history.
+    off_t size;
+    struct timespec mtime;
+    journalFileIdentity(ec.file_name, &size, &mtime);
+    if (size != undo_history.file_size || mtime.tv_sec != undo_history.file_mtime.tv_sec ||
+        mtime.tv_nsec != undo_history.file_mtime.tv_nsec)
+        return false;
+
+    size_t len = 0;
+    unsigned char* buf = journalReadFile(undo_history.path, &len);
+    if (!buf)
+        return false;
+    const unsigned char* end = buf + len;
+    const unsigned char* p = buf + strlen(UNDO_HISTORY_MAGIC);
+    size_t path_len = 0, saved_size, sec, nsec, hash, log_len;
+    uint64_t file_hash;
+    if (len < strlen(UNDO_HISTORY_MAGIC) || memcmp(buf, UNDO_HISTORY_MAGIC, strlen(UNDO_HISTORY_MAGIC)) ||
+        !(p = varintGetBounded(p, end, &path_len)) || (size_t) (end - p) < path_len ||
+        path_len != strlen(undo_history.file_path) || memcmp(p, undo_history.file_path, path_len) ||
+        !(p = varintGetBounded(p + path_len, end, &saved_size)) ||
+        !(p = varintGetBounded(p, end, &sec)) ||
+        !(p = varintGetBounded(p, end, &nsec)) ||
+        !(p = varintGetBounded(p, end, &hash)) ||
+        !(p = varintGetBounded(p, end, &log_len)) || (size_t) (end - p) != log_len ||
+        (off_t) saved_size != size || (time_t) sec != mtime.tv_sec || (long) nsec != mtime.tv_nsec ||
+        !undoHistoryHashFile(ec.file_name, &file_hash) || file_hash != hash) {
+        free(buf);
+        return false;
+    }
+
+    // Only whole records are kept, a log cut short loses its tail.
+    const unsigned char* log_end = p;
+    for (const unsigned char* q; log_end < end && (q = undoDecodeRecord(log_end, end, &(Action) {0})); )
+        log_end = q;
+    log_len = log_end - p;
+    if (log_len == 0) {
+        free(buf);
+        return false;
+    }
+
+    undoReserve(log_len);
+    memmove(ec.undo.buf + log_len, ec.undo.buf, ec.undo.len);
+    memcpy(ec.undo.buf, p, log_len);
+    free(buf);
+    ec.undo.len += log_len;
+    ec.undo.current += log_len;
+    if (ec.undo.len > log_len)
+        ec.undo.last += log_len;
+    else
+        ec.undo.last = undoRecordStart(log_len);
+    if (ec.undo.clean != UNDO_NOT_CLEAN)
+        ec.undo.clean += log_len;
+    if (ec.undo.saving != UNDO_NOT_CLEAN)
+        ec.undo.saving += log_len;
+    undoTrim(0);
+    return ec.undo.current > 0;
+}
+
+// Writes the history up to offset end of the log, the state just saved,
+// whose contents hash to hash.
+void undoHistorySave(uint64_t hash, size_t end) {
+    undoHistorySetFile(ec.file_name);
+    undo_history.tried = true;
+    if (!undo_history.path || ec.undo.budget == 0)
+        return;
+
+    unsigned char header[sizeof(UNDO_HISTORY_MAGIC) + 60];
+    unsigned char* p = header + strlen(UNDO_HISTORY_MAGIC);
+    size_t path_len = strlen(undo_history.file_path);
+    memcpy(header, UNDO_HISTORY_MAGIC, strlen(UNDO_HISTORY_MAGIC));
+    p = varintPut(p, path_len);
+    size_t path_at = p - header;
+    unsigned char tail[60];
+    unsigned char* t = tail;
+    t = varintPut(t, undo_history.file_size);
+    t = varintPut(t, undo_history.file_mtime.tv_sec);
+    t = varintPut(t, undo_history.file_mtime.tv_nsec);
+    t = varintPut(t, hash);
+    t = varintPut(t, end);
+
+    // Written next to it and renamed over it, never left half written.
+    size_t tmp_len = strlen(undo_history.path) + 8;
+    char* tmp = malloc(tmp_len);
+    if (!tmp) die("Failed to allocate undo history path");
+    snprintf(tmp, tmp_len, "%s.XXXXXX", undo_history.path);
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        free(tmp);
+        return;
+    }
+    struct iovec iov[] = {
+        {header, path_at},
+        {undo_history.file_path, path_len},
+        {tail, t - tail},
+        {ec.undo.buf, end},
+    };
+    size_t total = path_at + path_len + (t - tail) + end;
+    ssize_t n;
+    do {
+        n = writev(fd, iov, sizeof(iov) / sizeof(iov[0]));
+    } while (n < 0 && errno == EINTR);
+    if (close(fd) == -1 || n != (ssize_t) total || rename(tmp, undo_history.path) == -1) {
+        unlink(tmp);
+        editorSetStatusMessage("Can't save undo history: %s", strerror(errno));
+    }
+    free(tmp);
+}
+
+/*** Background save section ***/
+
+// Files are written by a thread, while editing goes on. Starting a save
+// copies the array of rows and marks every row frozen: the save writes
+// their content as it is, and the editor copies a frozen row before
+// changing it (editorRowThaw()), keeping the old content for the save to
+// free once it's done. The same machinery writes the periodic autosave
+// (-a), to .name.mel-swap next to the file.
+
+struct saver {
+    pthread_t thread;
+    bool threaded;              // Written by thread, not by the editor
+    bool running;               // Started and not finished yet
+    bool autosave;              // Writing the swap file, not the file
+    bool backup;                // Make a backup first
+    bool backup_failed;
+    int compression;
+    int compression_level;
+    char* path;
+    editor_row* rows;           // Rows as they were when the save started
+    int num_rows;
+    size_t total;               // Bytes to write
+    volatile size_t written;
+    volatile int done;          // Set by the thread when it's done
+    const char* failed;         // What failed, NULL if nothing did
+    int error;
+    uint64_t hash;
+    int dirty;                  // ec.dirty when the save started
+    char** kept;                // Content of frozen rows changed since
+    int num_kept;
+    int max_kept;
+    int autosaved_dirty;        // ec.dirty at the last autosave
+    double last_autosave;
+} saver;
+
+// Keeps the former content of a frozen row until the save is done.
+void saveKeepChars(char* chars) {
+    if (saver.num_kept == saver.max_kept) {
+        saver.max_kept = saver.max_kept ? saver.max_kept * 2 : 64;
+        saver.kept = realloc(saver.kept, sizeof(char*) * saver.max_kept);
+        if (!saver.kept) die("Failed to allocate save");
+    }
+    saver.kept[saver.num_kept++] = chars;
+}
+
+static void* saveThread(void* arg) {
+    (void) arg;
+    if (saver.backup && !createBackupFile(saver.path))
+        saver.backup_failed = true;
+    saver.failed = editorWriteFile(saver.path, saver.rows, saver.num_rows, saver.compression,
+                                   saver.compression_level, &saver.written, &saver.hash);
+    saver.error = errno;
+    saver.done = 1;
+    return NULL;
+}
+
+// Journals what was edited while the file was being saved, once the
+// journal applies to the saved file: the records between the saved state
+// and the current one, as edits or as undos.
+static void saveJournalSince(size_t saved) {
+    size_t at = saved;
+    while (at < ec.undo.current) {
+        Action action;
+        size_t end = undoDecode(at, &action);
+        journalRecord(JOURNAL_EDIT, ec.undo.buf + at, end - at);
+        at = end;
+    }
+    while (at > ec.undo.current) {
+        size_t start = undoRecordStart(at);
+        journalRecord(JOURNAL_UNDO, ec.undo.buf + start, at - start);
+        at = start;
+    }
+}
+
+static void saveFinish() {
+    if (saver.threaded)
+        pthread_join(saver.thread, NULL);
+    saver.running = false;
+    for (int i = 0; i < ec.num_rows; i++)
+        ec.row[i].frozen = 0;
+    for (int i = 0; i < saver.num_kept; i++)
+        free(saver.kept[i]);
+    saver.num_kept = 0;
+    free(saver.rows);
+    saver.rows = NULL;
+
+    size_t saved = ec.undo.saving;
+    ec.undo.saving = UNDO_NOT_CLEAN;
+    if (saver.failed) {
+        editorSetStatusMessage("Can't %s, %s: %s", saver.autosave ? "autosave" : "save file",
+                               saver.failed, strerror(saver.error));
+    } else if (saver.autosave) {
+        saver.autosaved_dirty = saver.dirty;
+    } else {
+        // Edits made during the save are still unsaved. Without the undo
+        // log to tell which, the file stays modified and its journal
+        // stays as it was, until the next save.
+        bool edited = saved != UNDO_NOT_CLEAN ? ec.undo.current != saved : ec.dirty != saver.dirty;
+        if (saved != UNDO_NOT_CLEAN || !edited) {
+            journalSetFile(saver.path);
+            if (saved != UNDO_NOT_CLEAN) {
+                saveJournalSince(saved);
+                undoHistorySave(saver.hash, saved);
+            } else {
+                undoHistorySetFile(saver.path);
+            }
+        }
+        ec.undo.clean = saved;
+        saver.autosaved_dirty = 0;
+        ec.dirty = edited ? (ec.dirty ? ec.dirty : 1) : 0;
+
+        char* swap = hiddenFilePath(saver.path, "mel-swap");
+        unlink(swap);
+        free(swap);
+        editorSetStatusMessage("%s%zu bytes written to disk", saver.backup_failed ?
+                               "Warning: Failed to create backup file. " : "", saver.total);
+    }
+    free(saver.path);
+    saver.path = NULL;
+}
+
+// Waits for the save in progress to finish.
+void saveWait() {
+    if (!saver.running)
+        return;
+    editorSetStatusMessage("Waiting for the save to finish...");
+    editorRefreshScreen();
+    saveFinish();
+}
+
+// Starts writing the rows to path, the file (or its swap file if
+// autosave) in the background.
+void saveStart(const char* path, bool autosave) {
+    if (saver.running && saver.autosave && !autosave)
+        saveWait();
+    if (saver.running) {
+        if (!autosave)
+            editorSetStatusMessage("Already saving, wait for it to finish");
+        return;
+    }
+
+    saver.rows = malloc(sizeof(editor_row) * (ec.num_rows ? ec.num_rows : 1));
+    saver.path = strdup(path);
+    if (!saver.rows || !saver.path) die("Failed to allocate save");
+    memcpy(saver.rows, ec.row, sizeof(editor_row) * ec.num_rows);
+    saver.num_rows = ec.num_rows;
+    saver.total = 0;
+    for (int i = 0; i < ec.num_rows; i++) {
+        ec.row[i].frozen = 1;
+        saver.total += ec.row[i].size + 1;
+    }
+    saver.autosave = autosave;
+    // The swap file is never compressed.
+    saver.compression = autosave ? COMPRESS_NONE : ec.compression;
+    saver.compression_level = ec.compression_level;
+    saver.backup = !autosave && ec.create_backup && access(path, F_OK) == 0;
+    saver.backup_failed = false;
+    saver.written = 0;
+    saver.done = 0;
+    saver.dirty = ec.dirty;
+    if (!autosave)
+        ec.undo.saving = ec.undo.budget ? ec.undo.current : UNDO_NOT_CLEAN;
+    saver.running = true;
+
+    // Without a thread the save is done before going on.
+    saver.threaded = pthread_create(&saver.thread, NULL, saveThread, NULL) == 0;
+    if (!saver.threaded) {
+        saveThread(NULL);
+        saveFinish();
+    }
+}
+
+// Progress of the save shown in the status bar, "" if there is none.
+const char* saveProgress() {
+    static char progress[32];
+    if (!saver.running || saver.autosave)
+        return "";
+    snprintf(progress, sizeof(progress), " [saving %d%%]",
+             saver.total ? (int) (saver.written * 100 / saver.total) : 100);
+    return progress;
+}
+
+// Finishes the save when it's done, redrawing its progress until then,
+// and starts autosaves when they are due.
+void saveIdle() {
+    if (saver.running && saver.done) {
+        saveFinish();
+        editorRefreshScreen();
+    } else if (saver.running && !saver.autosave) {
+        editorRefreshScreen();
+    } else if (!saver.running && ec.autosave && ec.file_name && ec.dirty &&
+               ec.dirty != saver.autosaved_dirty &&
+               journalNow() - saver.last_autosave >= ec.autosave) {
+        saver.last_autosave = journalNow();
+        char* swap = hiddenFilePath(ec.file_name, "mel-swap");
+        saveStart(swap, true);
+        free(swap);
+    }
+}
+
+// Removes the swap file, when quitting.
+void saveDiscard() {
+    saveWait();
+    if (ec.file_name) {
+        char* swap = hiddenFilePath(ec.file_name, "mel-swap");
+        unlink(swap);
+        free(swap);
+    }
+}
+
+/*** Stdin section ***/
+
+// Piped input is read while the editor runs, from editorIdle(), so the
+// rows show up as they arrive and a producer that never ends (a log
+// follower) doesn't block it. Files opened with --follow are read the
+// same way past their end, when inotify tells they grew, like tail -f:
+// a rotated file is read to its end before the new one at its path, a
+// truncated one from its start again. With a cap (-m), the oldest rows
+// are dropped to keep only about the most recent bytes of the input.
+
+// Bytes read from the input on each call of streamIdle(), leaving time
+// to the keyboard.
+#define STREAM_CHUNK (4 << 20)
+
+struct stream {
+    int fd;                 // -1 if there is no input to read
+    char* buf;              // Start of a line not complete yet
+    size_t len;
+    size_t cap;
+    size_t bytes;           // Bytes of the rows read, about
+    size_t max;             // Bytes kept, 0 for all
+    bool follow;            // fd is a file followed with --follow
+    char* path;             // Of the followed file, the buffer may be saved as another
+    bool pending;           // The last read stopped at its limit
+    int inotify_fd;         // -1 if the file is checked on every call
+    int watch;
+    bool moved;             // The file left its path, look for a new one
+    dev_t dev;              // The file followed
+    ino_t ino;
+} stream = {.fd = -1, .inotify_fd = -1, .watch = -1};
+
+// Reads fd from now on in the background: stdin being a pipe the
+// terminal was swapped in for, or a followed file.
+void streamOpen(int fd) {
+    stream.fd = fd;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    stream.cap = LOAD_CHUNK;
+    stream.buf = malloc(stream.cap);
+    if (!stream.buf) die("Failed to allocate input buffer");
+}
+
+// Drops the oldest rows until the rows fit in the cap, with some room
+// left so it doesn't happen again on the next line.
+static void streamDropRows() {
+    size_t target = stream.max - stream.max / 8;
+    int count = 0;
+    while (count < ec.num_rows - 1 && stream.bytes > target) {
+        size_t size = ec.row[count].size + 1;
+        stream.bytes -= size < stream.bytes ? size : stream.bytes;
+        editorFreeRow(&ec.row[count]);
+        count++;
+    }
+    if (count == 0)
+        return;
+
+    memmove(ec.row, ec.row + count, sizeof(editor_row) * (ec.num_rows - count));
+    ec.num_rows -= count;
+    for (int i = 0; i < ec.num_rows; i++)
+        ec.row[i].idx = i;
+    if (ec.search_query)
+        searchIndexReset();
+    wrapIndexReset();
+    paneRowsMoved(0, -count);
+    ec.dropped_rows += count;
+
+    // What the cursor and the undo log point at moved up. The log has
+    // rows by number, so the edits made so far can't be undone anymore.
+    ec.cursor_y = ec.cursor_y > count ? ec.cursor_y - count : 0;
+    ec.row_offset = ec.row_offset > count ? ec.row_offset - count : 0;
+    if (ec.cursor_y < ec.num_rows && ec.cursor_x > ec.row[ec.cursor_y].size)
+        ec.cursor_x = ec.row[ec.cursor_y].size;
+    if (ec.undo.len > 0)
+        editorSetStatusMessage("Dropped the oldest %d lines (-m), undo history cleared", count);
+    undoForget();
+}
+
+// Appends the line left incomplete at the end of the input.
+static void streamFlushLine() {
+    stream.len -= editorAppendLines(stream.buf, stream.len, true);
+}
+
+static void streamClose() {
+    int rows = ec.num_rows;
+    streamFlushLine();
+    close(stream.fd);
+    stream.fd = -1;
+    free(stream.buf);
+    stream.buf = NULL;
+    if (ec.dropped_rows)
+        editorSetStatusMessage("End of input, kept the last %d lines of %ld",
+                               ec.num_rows, ec.num_rows + ec.dropped_rows);
+    else if (ec.num_rows != rows)
+        editorSetStatusMessage("End of input, %d lines", ec.num_rows);
+}
+
+// Appends up to limit bytes read from the input, fewer if there is no
+// more for now.
+static void streamRead(size_t limit) {
+    size_t total = 0;
+    while (total < limit) {
+        if (stream.cap - stream.len < LOAD_CHUNK / 2) {
+            stream.cap *= 2;
+            stream.buf = realloc(stream.buf, stream.cap);
+            if (!stream.buf) die("Failed to allocate input buffer");
+        }
+        ssize_t n = read(stream.fd, stream.buf + stream.len, stream.cap - stream.len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno != EAGAIN)
+            editorSetStatusMessage("Can't read input: %s", strerror(errno));
+        // The end of a followed file is only where it ends for now.
+        if (n <= 0) {
+            if (!stream.follow && (n == 0 || errno != EAGAIN))
+                streamClose();
+            break;
+        }
+        total += n;
+        stream.bytes += n;
+        stream.len += n;
+        size_t used = editorAppendLines(stream.buf, stream.len, false);
+        stream.len -= used;
+        memmove(stream.buf, stream.buf + used, stream.len);
+        if (stream.max && stream.bytes > stream.max)
+            streamDropRows();
+    }
+    stream.pending = total >= limit;
+}
+
+static void followWatch(const char* file_name) {
+#ifdef __linux__
+    if (stream.inotify_fd != -1)
+        stream.watch = inotify_add_watch(stream.inotify_fd, file_name,
+                                         IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+#else
+    (void) file_name;
+#endif
+}
+
+// Opens file_name and follows it as it grows, loading what it holds now
+// in one go.
+void followOpen(char* file_name) {
+    int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror("open");
+        exit(1);
+    }
+    unsigned char head[16];
+    int level;
+    ssize_t head_len = pread(fd, head, sizeof(head), 0);
+    if (compressionFromMagic(head, head_len > 0 ? head_len : 0, &level) != COMPRESS_NONE) {
+        fprintf(stderr, "Can't follow compressed file %s\n", file_name);
+        exit(1);
+    }
+
+    free(ec.file_name);
+    ec.file_name = strdup(file_name);
+    editorSelectSyntaxHighlight();
+    streamOpen(fd);
+    stream.follow = true;
+    stream.path = strdup(file_name);
+    if (!stream.path) die("Failed to allocate input buffer");
+    stream.dev = st.st_dev;
+    stream.ino = st.st_ino;
+#ifdef __linux__
+    stream.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+    followWatch(file_name);
+    streamRead(SIZE_MAX);
+    ec.dirty = 0;
+}
+
+// Reads the events of the followed file. Returns whether it may have
+// changed.
+static bool followEvents() {
+#ifdef __linux__
+    if (stream.inotify_fd == -1 || stream.watch == -1)
+        return true;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t n;
+    while ((n = read(stream.inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + n; ) {
+            struct inotify_event* event = (struct inotify_event*) p;
+            if (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF))
+                stream.moved = true;
+            changed = true;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return changed;
+#else
+    return true;
+#endif
+}
+
+// Switches to the file now at the path of the followed one, if there is
+// a new one, once the old one is read to its end.
+static bool followRotate() {
+    struct stat st;
+    if (stat(stream.path, &st) == -1 ||
+        (st.st_dev == stream.dev && st.st_ino == stream.ino))
+        return false;
+    int fd = open(stream.path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+
+    streamRead(SIZE_MAX);
+    streamFlushLine();
+    close(stream.fd);
+#ifdef __linux__
+    if (stream.watch != -1)
+        inotify_rm_watch(stream.inotify_fd, stream.watch);
+#endif
+    stream.fd = fd;
+    stream.dev = st.st_dev;
+    stream.ino = st.st_ino;
+    stream.moved = false;
+    followWatch(stream.path);
+    editorSetStatusMessage("%s was replaced, following the new file", stream.path);
+    return true;
+}
+
+// Appends what arrived since the last call. Returns whether there are
+// new rows to draw.
+bool streamIdle() {
+    if (stream.fd == -1)
+        return false;
+
+    // Following the end of the input if the cursor is on the last row.
+    bool follow = ec.cursor_y > 0 && ec.cursor_y == ec.num_rows - 1;
+    int rows = ec.num_rows;
+    long dropped = ec.dropped_rows;
+    if (stream.follow) {
+        bool changed = followEvents();
+        if ((stream.moved || stream.inotify_fd == -1) && followRotate())
+            changed = true;
+        // What a big append left unread is read without another event.
+        if (!changed && !stream.pending)
+            return false;
+
+        // Truncated in place, it's read again from the start.
+        struct stat st;
+        off_t offset = lseek(stream.fd, 0, SEEK_CUR);
+        if (fstat(stream.fd, &st) == 0 && st.st_size < offset) {
+            lseek(stream.fd, 0, SEEK_SET);
+            stream.len = 0;
+            editorSetStatusMessage("%s was truncated, reading it from the start", stream.path);
+        }
+    }
+    streamRead(STREAM_CHUNK);
+
+    if (follow && ec.num_rows != rows) {
+        ec.cursor_y = ec.num_rows - 1;
+        ec.cursor_x = 0;
+    }
+    return ec.num_rows != rows || ec.dropped_rows != dropped;
+}
+
+/*** Buffers section ***/
+
+// Every open file has a buffer. The one shown is ec, the others keep their
+// part of it (rows, cursor, undo log, syntax, wrap index...) in their slot
+// along with the journal and undo history of their file, so switching is
+// copying a few structs. Files named on the command line are only read,
+// and highlighted, when first shown. Piped or followed input goes on
+// being read into the first buffer while another one is shown.
+
+struct editor_buffer {
+    char* file_name;            // File to read when first shown
+    bool loaded;
+    bool recover;               // Journal to offer once shown on a terminal
+    struct editor_config state; // ec while another buffer is shown
+    struct journal journal;
+    struct undo_history undo_history;
+    int autosaved_dirty;        // The saver's, for the buffer's swap file
+    double last_autosave;
+};
+
+struct buffer_list {
+    struct editor_buffer* buf;
+    int num;
+    int current;                // Buffer shown in ec
+    struct editor_config fresh; // ec for a buffer not read yet
+} buffers;
+
+// Adds a buffer for file_name, read when first shown, and returns its
+// index.
+int bufferAdd(const char* file_name) {
+    struct editor_buffer* buf = realloc(buffers.buf, sizeof(struct editor_buffer) * (buffers.num + 1));
+    if (!buf) die("Failed to allocate buffer");
+    buffers.buf = buf;
+    struct editor_buffer* b = &buffers.buf[buffers.num];
+    *b = (struct editor_buffer) {.state = buffers.fresh, .journal = {.fd = -1}};
+    if (file_name && !(b->file_name = strdup(file_name)))
+        die("Failed to allocate buffer");
+    return buffers.num++;
+}
+
+// Makes ec, with the options set and nothing read yet, the first buffer
+// and the start of the others.
+void bufferInit() {
+    buffers.fresh = ec;
+    buffers.fresh.cursor_y = 0; // -l and --follow are for the first file
+    buffers.fresh.follow = 0;
+    buffers.current = bufferAdd(NULL);
+    buffers.buf[0].loaded = true;
+}
+
+static const char* bufferFileName(int i) {
+    if (i == buffers.current)
+        return ec.file_name;
+    return buffers.buf[i].loaded ? buffers.buf[i].state.file_name : buffers.buf[i].file_name;
+}
+
+// Puts the buffer shown away in its slot.
+static void bufferStore() {
+    struct editor_buffer* b = &buffers.buf[buffers.current];
+    b->state = ec;
+    b->journal = journal;
+    b->undo_history = undo_history;
+    b->autosaved_dirty = saver.autosaved_dirty;
+    b->last_autosave = saver.last_autosave;
+}
+
+// Shows buffer i, keeping the settings of the editor and the screen.
+static void bufferRestore(int i) {
+    struct editor_config shown = ec;
+    struct editor_buffer* b = &buffers.buf[i];
+    ec = b->state;
+    journal = b->journal;
+    undo_history = b->undo_history;
+    saver.autosaved_dirty = b->autosaved_dirty;
+    saver.last_autosave = b->last_autosave;
+    buffers.current = i;
+
+    ec.screen_rows = shown.screen_rows;
+    ec.screen_cols = shown.screen_cols;
+    ec.screen_top = shown.screen_top;
+    ec.screen_left = shown.screen_left;
+    ec.window_rows = shown.window_rows;
+    ec.window_cols = shown.window_cols;
+    ec.column_marker = shown.column_marker;
+    ec.show_line_numbers = shown.show_line_numbers;
+    ec.soft_wrap = shown.soft_wrap;
+    ec.create_backup = shown.create_backup;
+    ec.keep_backups = shown.keep_backups;
+    ec.autosave = shown.autosave;
+    memcpy(ec.status_msg, shown.status_msg, sizeof(ec.status_msg));
+    ec.status_msg_time = shown.status_msg_time;
+    ec.copied_char_buffer = shown.copied_char_buffer;
+    ec.search_flags = shown.search_flags;
+    ec.jobs = shown.jobs;
+    ec.orig_termios = shown.orig_termios;
+}
+
+// Reads the file of the buffer shown, the first time it is.
+static void bufferLoad(struct editor_buffer* b) {
+    b->loaded = true;
+    if (access(b->file_name, R_OK) != 0) {
+        // Saving it will create it.
+        editorSetStatusMessage("Can't open %s: %s", b->file_name, strerror(errno));
+        ec.file_name = strdup(b->file_name);
+        ec.compression = compressionFromName(b->file_name, &ec.compression_level);
+        editorSelectSyntaxHighlight();
+        editorInsertRow(0, "", 0);
+        ec.dirty = 0;
+        return;
+    }
+    editorOpen(b->file_name);
+    journalSetFile(b->file_name);
+    undoHistorySetFile(b->file_name);
+    b->recover = true;
+}
+
+// Offers the journal of the buffer shown, once there is a terminal to ask
+// on (the server reads files before one is attached).
+void bufferRecover() {
+    struct editor_buffer* b = &buffers.buf[buffers.current];
+    if (!b->recover || !isatty(STDIN_FILENO))
+        return;
+    b->recover = false;
+    journalRecover();
+    b->recover = serverDetaching();
+}
+
+// Buffer of a file, -1 if it isn't open.
+int bufferFind(const char* file_name) {
+    for (int i = 0; i < buffers.num; i++) {
+        const char* name = bufferFileName(i);
+        if (name && strcmp(name, file_name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Shows buffer i, reading its file if it wasn't yet.
+void bufferSwitch(int i) {
+    if (i == buffers.current)
+        return;
+    // A save finishes in the buffer it started in, and the journal isn't
+    // left with edits in memory while it gets no idle time. The search
+    // highlight stays behind, the query being shared.
+    saveWait();
+    journalFlush();
+    ec.search_query = NULL;
+    ec.search_match_row = -1;
+    bufferStore();
+    bufferRestore(i);
+
+    if (!buffers.buf[i].loaded)
+        bufferLoad(&buffers.buf[i]);
+    else
+        editorSetStatusMessage("[%d/%d] %s", i + 1, buffers.num,
+                               ec.file_name ? ec.file_name : "[No Name]");
+    paneShowBuffer();
+    bufferRecover();
+}
+
+// "[2/3] " for the status bar, when more than one file is open.
+const char* bufferStatus() {
+    static char status[32];
+    if (buffers.num < 2)
+        return "";
+    snprintf(status, sizeof(status), "[%d/%d] ", buffers.current + 1, buffers.num);
+    return status;
+}
+
+void bufferNext() {
+    if (buffers.num < 2) {
+        editorSetStatusMessage("No other file open (Ctrl-U opens one)");
+        return;
+    }
+    bufferSwitch((buffers.current + 1) % buffers.num);
+}
+
+// Asks for a file and shows it, in a new buffer unless it is open already.
+void bufferOpen() {
+    char* file_name = editorPrompt("Open file: %s (ESC to cancel)", NULL);
+    if (!file_name) {
+        editorSetStatusMessage("Open canceled");
+        return;
+    }
+    int i = bufferFind(file_name);
+    if (i != -1) {
+        free(file_name);
+        bufferSwitch(i);
+        return;
+    }
+    if (access(file_name, R_OK) != 0) {
+        editorSetStatusMessage("Can't open %s: %s", file_name, strerror(errno));
+        free(file_name);
+        return;
+    }
+    i = bufferAdd(file_name);
+    free(file_name);
+    bufferSwitch(i);
+}
+
+// Buffers with unsaved changes, the one shown included.
+int bufferModified() {
+    int count = 0;
+    for (int i = 0; i < buffers.num; i++) {
+        if (i == buffers.current)
+            count += ec.dirty != 0;
+        else if (buffers.buf[i].loaded)
+            count += buffers.buf[i].state.dirty != 0;
+    }
+    return count;
+}
+
+// Removes the journals and swap files of all buffers, when quitting.
+void bufferDiscard() {
+    journalDiscard();
+    saveDiscard();
+    int shown = buffers.current;
+    for (int i = 0; i < buffers.num; i++) {
+        if (i == shown || !buffers.buf[i].loaded)
+            continue;
+        bufferStore();
+        bufferRestore(i);
+        journalDiscard();
+        saveDiscard();
+    }
+}
+
+// Reads piped or followed input into its buffer, the first one, even when
+// another one is shown. True if the screen has to be drawn again.
+bool bufferStreamIdle() {
+    if (buffers.current == 0 || stream.fd == -1)
+        return streamIdle();
+    int shown = buffers.current;
+    bufferStore();
+    bufferRestore(0);
+    streamIdle();
+    bufferStore();
+    bufferRestore(shown);
+    return false;
+}
+
+/*** Panes section ***/
+
+// The screen can be split into panes showing the same buffer, all one
+// above the other or all side by side, each with its own cursor and
+// scrolling. The rows, with their render and highlight, are shared, so
+// a pane only costs its drawing. The pane with the cursor is in ec, as
+// the buffer shown is; panes side by side are given the same width so
+// soft wrap counts the screen lines of the rows once for all of them.
+
+#define PANE_MIN_ROWS 2     // Text lines of a pane one above the other
+#define PANE_MIN_COLS 16    // Columns of a pane side by side
+
+struct pane {
+    int cursor_x;
+    int cursor_y;
+    int row_offset;
+    int col_offset;
+    int wrap_offset;
+    int top;                // Where it is on the screen
+    int left;
+    int rows;
+    int cols;
+};
+
+struct pane_list {
+    struct pane* pane;
+    int num;                // 0 until the screen is first split
+    int current;            // Pane shown in ec
+    bool side_by_side;
+    int buffer;             // Buffer the panes show
+} panes;
+
+static void paneGet(struct pane* p) {
+    p->cursor_x = ec.cursor_x;
+    p->cursor_y = ec.cursor_y;
+    p->row_offset = ec.row_offset;
+    p->col_offset = ec.col_offset;
+    p->wrap_offset = ec.wrap_offset;
+}
+
+// Puts pane p in ec, its cursor brought back into the rows that are
+// left, at the start of a character.
+static void paneSet(const struct pane* p) {
+    ec.cursor_x = p->cursor_x;
+    ec.cursor_y = p->cursor_y;
+    ec.row_offset = p->row_offset;
+    ec.col_offset = p->col_offset;
+    ec.wrap_offset = p->wrap_offset;
+    ec.screen_top = p->top;
+    ec.screen_left = p->left;
+    ec.screen_rows = p->rows;
+    ec.screen_cols = p->cols;
+
+    if (ec.cursor_y > ec.num_rows)
+        ec.cursor_y = ec.num_rows;
+    if (ec.row_offset > ec.cursor_y)
+        ec.row_offset = ec.cursor_y;
+    if (ec.cursor_y < ec.num_rows) {
+        editor_row* row = &ec.row[ec.cursor_y];
+        if (ec.cursor_x > row->size)
+            ec.cursor_x = row->size;
+        ec.cursor_x = editorRowRenderXToCursorX(row, editorRowCursorXToRenderX(row, ec.cursor_x));
+    } else {
+        ec.cursor_x = 0;
+    }
+}
+
+// Gives the panes their place on the screen, closing those that don't
+// fit anymore.
+void paneLayout() {
+    if (panes.num < 2) {
+        ec.screen_top = 0;
+        ec.screen_left = 0;
+        ec.screen_rows = ec.window_rows;
+        ec.screen_cols = ec.window_cols;
+        return;
+    }
+
+    int room = panes.side_by_side ? ec.window_cols : ec.window_rows;
+    int min = panes.side_by_side ? PANE_MIN_COLS : PANE_MIN_ROWS;
+    while (panes.num > 1 && (room - (panes.num - 1)) / panes.num < min) {
+        int last = panes.num - 1 == panes.current ? panes.num - 2 : panes.num - 1;
+        memmove(&panes.pane[last], &panes.pane[last + 1], sizeof(struct pane) * (panes.num - last - 1));
+        if (panes.current > last)
+            panes.current--;
+        panes.num--;
+    }
+
+    // Panes take the same size, one line or column between them; the
+    // lines left over go to the last one, the columns are left empty.
+    int size = (room - (panes.num - 1)) / panes.num;
+    for (int i = 0; i < panes.num; i++) {
+        struct pane* p = &panes.pane[i];
+        if (panes.side_by_side) {
+            p->top = 0;
+            p->rows = ec.window_rows;
+            p->left = i * (size + 1);
+            p->cols = size;
+        } else {
+            p->left = 0;
+            p->cols = ec.window_cols;
+            p->top = i * (size + 1);
+            p->rows = i == panes.num - 1 ? ec.window_rows - p->top : size;
+        }
+    }
+    struct pane* p = &panes.pane[panes.current];
+    ec.screen_top = p->top;
+    ec.screen_left = p->left;
+    ec.screen_rows = p->rows;
+    ec.screen_cols = p->cols;
+}
+
+// Splits the pane shown in two, both showing the same place, and moves
+// to the new one. Splitting the other way lays all the panes out again.
+void paneSplit(bool side_by_side) {
+    if (panes.num == 0) {
+        panes.pane = malloc(sizeof(struct pane));
+        if (!panes.pane) die("Failed to allocate pane");
+        panes.num = 1;
+        panes.current = 0;
+        panes.buffer = buffers.current;
+    }
+    int room = side_by_side ? ec.window_cols : ec.window_rows;
+    int min = side_by_side ? PANE_MIN_COLS : PANE_MIN_ROWS;
+    if ((room - panes.num) / (panes.num + 1) < min) {
+        editorSetStatusMessage("No room for another pane");
+        return;
+    }
+
+    struct pane* pane = realloc(panes.pane, sizeof(struct pane) * (panes.num + 1));
+    if (!pane) die("Failed to allocate pane");
+    panes.pane = pane;
+    int at = panes.current + 1;
+    memmove(&panes.pane[at + 1], &panes.pane[at], sizeof(struct pane) * (panes.num - at));
+    paneGet(&panes.pane[panes.current]);
+    panes.pane[at] = panes.pane[panes.current];
+    panes.num++;
+    panes.current = at;
+    panes.side_by_side = side_by_side;
+    paneLayout();
+}
+
+void paneNext() {
+    if (panes.num < 2) {
+        editorSetStatusMessage("The screen isn't split");
+        return;
+    }
+    paneGet(&panes.pane[panes.current]);
+    panes.current = (panes.current + 1) % panes.num;
+    paneSet(&panes.pane[panes.current]);
+}
+
+// Closes the pane shown, moving to the one before it.
+void paneClose() {
+    if (panes.num < 2) {
+        editorSetStatusMessage("The screen isn't split");
+        return;
+    }
+    int at = panes.current;
+    memmove(&panes.pane[at], &panes.pane[at + 1], sizeof(struct pane) * (panes.num - at - 1));
+    panes.num--;
+    panes.current = at > 0 ? at - 1 : 0;
+    paneLayout();
+    paneSet(&panes.pane[panes.current]);
+}
+
+// The buffer shown changed: all the panes show it, where its cursor is.
+void paneShowBuffer() {
+    if (panes.num < 2)
+        return;
+    for (int i = 0; i < panes.num; i++)
+        if (i != panes.current)
+            paneGet(&panes.pane[i]);
+    panes.buffer = buffers.current;
+    paneLayout();
+}
+
+// Rows were inserted at row at (delta > 0) or deleted from it (delta < 0):
+// the other panes go on showing the same rows.
+void paneRowsMoved(int at, int delta) {
+    if (panes.num < 2 || buffers.current != panes.buffer)
+        return;
+    for (int i = 0; i < panes.num; i++) {
+        if (i == panes.current)
+            continue;
+        struct pane* p = &panes.pane[i];
+        if (delta > 0) {
+            if (p->cursor_y >= at)
+                p->cursor_y += delta;
+            if (p->row_offset > at)
+                p->row_offset += delta;
+        } else {
+            if (p->cursor_y >= at - delta)
+                p->cursor_y += delta;
+            else if (p->cursor_y > at)
+                p->cursor_y = at;
+            if (p->row_offset >= at - delta) {
+                p->row_offset += delta;
+            } else if (p->row_offset >= at) {
+                p->row_offset = at;
+                p->wrap_offset = 0;
+            }
+        }
+    }
+}
+
+// Draws the other panes and their borders, then the pane shown, which
+// ends with the cursor scrolled into view as it was.
+void paneDrawAll(struct a_buf* ab) {
+    if (panes.num < 2) {
+        editorDrawRows(ab);
         return;
     }
 
-    int replacements = 0;
-    for (int i = 0; i < ec.num_rows; i++) {
-        editor_row* row = &ec.row[i];
-        char* match = strstr(row->chars, search_pattern);
-        
-        while (match) {
-            int pos = match - row->chars;
-            editorRowDelString(row, pos, strlen(search_pattern));
-            editorRowInsertString(row, pos, replace_pattern);
-            replacements++;
-            
-            match = strstr(row->chars + pos + strlen(replace_pattern), search_pattern);
+    struct pane* shown = &panes.pane[panes.current];
+    paneGet(shown);
+    int render_x = ec.render_x;
+    int wrap_cursor = ec.wrap_cursor;
+    char buf[96];
+    for (int i = 0; i < panes.num; i++) {
+        struct pane* p = &panes.pane[i];
+        if (i != panes.current) {
+            paneSet(p);
+            editorScroll();
+            editorDrawRows(ab);
+            paneGet(p);
         }
-    }
+        if (i == panes.num - 1)
+            continue;
 
-    free(search_pattern);
-    free(replace_pattern);
-    
-    editorSetStatusMessage("Replaced %d occurrences", replacements);
+        if (panes.side_by_side) {
+            for (int y = 0; y < p->rows; y++) {
+                snprintf(buf, sizeof(buf), "\x1b[%d;%dH\x1b[7m \x1b[m", p->top + y + 1, p->left + p->cols + 1);
+                abufAppend(ab, buf, strlen(buf));
+            }
+        } else {
+            // Where the pane is, under it
+            int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H\x1b[7m", p->top + p->rows + 1);
+            abufAppend(ab, buf, len);
+            int y = i == panes.current ? shown->cursor_y : p->cursor_y;
+            len = snprintf(buf, sizeof(buf), " Line %d/%d ", y + 1, ec.num_rows);
+            if (len > ec.window_cols) len = ec.window_cols;
+            for (int x = len; x < ec.window_cols; x++)
+                abufAppend(ab, " ", 1);
+            abufAppend(ab, buf, len);
+            abufAppend(ab, "\x1b[m", 3);
+        }
+    }
+    paneSet(shown);
+    ec.render_x = render_x;
+    ec.wrap_cursor = wrap_cursor;
+    editorDrawRows(ab);
 }
 
-void editorSearchCallback(char* query, int key) {
-   static int last_match = -1;
-   static int direction = 1;
-   static int saved_cursor_x = -1;
-   static int saved_cursor_y = -1;
-   static int saved_col_offset = -1;
-   static int saved_row_offset = -1;
-   static char* saved_query = NULL;
+/*** Server section ***/
+
+// mel --server keeps its buffers in a background process, read and
+// highlighted once. mel started on a terminal while it runs attaches to
+// it instead: it passes its terminal over a Unix socket and waits while
+// the server reads keys from it and draws on it, so an open file shows up
+// at once. One terminal is attached at a time, a new one takes the server
+// over. When the terminal goes away, as when an SSH connection drops, the
+// server lets it go and keeps everything for the next one.
+
+#define SERVER_MAX_MESSAGE (1 << 20)
+
+struct server {
+    bool enabled;           // Running as the server (--server)
+    int listen_fd;
+    int client_fd;          // Connection to the other side, -1 if none
+    bool detached;          // The server is letting the terminal go
+} server = {.listen_fd = -1, .client_fd = -1};
+
+// Socket of the server of the user.
+static void serverPath(char* path, size_t size) {
+    const char* dir = getenv("XDG_RUNTIME_DIR");
+    if (!dir || !*dir)
+        dir = "/tmp";
+    snprintf(path, size, "%s/mel-%d.sock", dir, (int) getuid());
+}
 
-   if (last_match == -1 && saved_cursor_x == -1) {
-       saved_cursor_x = ec.cursor_x;
-       saved_cursor_y = ec.cursor_y;
-       saved_col_offset = ec.col_offset;
-       saved_row_offset = ec.row_offset;
-       if (query) {
-           free(saved_query);
-           saved_query = strdup(query);
-       }
-   }
+static bool serverAddress(const char* path, struct sockaddr_un* addr) {
+    *addr = (struct sockaddr_un) {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr->sun_path))
+        return false;
+    strcpy(addr->sun_path, path);
+    return true;
+}
 
-   if (key == '\x1b' || key == '\r') {
-       if (key == '\x1b' && last_match != -1) {
-           return;
-       }
-       last_match = -1;
-       direction = 1;
-       if (saved_query) {
-           free(saved_query);
-           saved_query = NULL;
-       }
-       return;
-   }
+// Connects to the server, -1 if none is running. The socket has to be
+// the user's, in case someone else made one at its path in /tmp.
+static int serverConnect(const char* path) {
+    struct stat st;
+    struct sockaddr_un addr;
+    if (lstat(path, &st) == -1 || !S_ISSOCK(st.st_mode) || st.st_uid != getuid() ||
+        !serverAddress(path, &addr))
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd != -1 && connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
 
-   if (key == CTRL_KEY('n') || key == CTRL_KEY('r')) {
-       direction = (key == CTRL_KEY('n')) ? 1 : -1;
-       query = saved_query;
-   } else if (query) {
-       free(saved_query);
-       saved_query = strdup(query);
-   }
+// Absolute path of a file, that may not exist yet, the same for the
+// server whatever directory mel was started in.
+static char* serverAbsolutePath(const char* file_name) {
+    char* path = realpath(file_name, NULL);
+    if (path)
+        return path;
+    char cwd[PATH_MAX];
+    if (file_name[0] == '/' || !getcwd(cwd, sizeof(cwd)))
+        path = strdup(file_name);
+    else if (asprintf(&path, "%s/%s", cwd, file_name) == -1)
+        path = NULL;
+    if (!path) die("Failed to allocate file name");
+    return path;
+}
 
-   if (query) {
-       int current = last_match;
-       
-       for (int i = 0; i < ec.num_rows; i++) {
-           current += direction;
-           if (current == -1) current = ec.num_rows - 1;
-           else if (current == ec.num_rows) current = 0;
-
-           editor_row* row = &ec.row[current];
-           char* match = strstr(row->render, query);
-           
-           if (match) {
-               last_match = current;
-               ec.cursor_y = current;
-               ec.cursor_x = editorRowRenderXToCursorX(row, match - row->render);
-               
-               if (current < ec.row_offset) {
-                   ec.row_offset = current;
-               } else if (current >= ec.row_offset + ec.screen_rows) {
-                   ec.row_offset = current - ec.screen_rows + 1;
-               }
-               
-               int rx = editorRowCursorXToRenderX(row, ec.cursor_x);
-               if (rx < ec.col_offset) {
-                   ec.col_offset = rx;
-               } else if (rx >= ec.col_offset + ec.screen_cols) {
-                   ec.col_offset = rx - ec.screen_cols + 1;
-               }
-               ec.render_x = rx;
-               return;
-           }
-       }
-   }
+static void serverForwardSigwinch(int sig) {
+    (void) sig;
+    if (write(server.client_fd, "W", 1) == -1) {
+        // The server is gone, the connection says so.
+    }
 }
 
+// Hands the terminal to the server with the files to show, the line
+// number given first (0 if none), all 0-terminated. Returns false if no
+// server runs, and once the server lets the terminal go otherwise.
+bool serverAttach(char** files, int num_files) {
+    char path[PATH_MAX];
+    serverPath(path, sizeof(path));
+    int fd = serverConnect(path);
+    if (fd == -1)
+        return false;
+
+    struct a_buf msg = ABUF_INIT;
+    char line[16];
+    snprintf(line, sizeof(line), "%d", ec.cursor_y > 0 ? ec.cursor_y + 1 : 0);
+    abufAppend(&msg, line, strlen(line) + 1);
+    for (int i = 0; i < num_files; i++) {
+        char* name = serverAbsolutePath(files[i]);
+        abufAppend(&msg, name, strlen(name) + 1);
+        free(name);
+    }
 
+    // The terminal goes along with the length of the message.
+    uint32_t len = msg.len;
+    int fds[2] = {STDIN_FILENO, STDOUT_FILENO};
+    struct iovec iov = {&len, sizeof(len)};
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1,
+                        .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    struct termios saved;
+    bool restore = tcgetattr(STDIN_FILENO, &saved) == 0;
+    bool sent = sendmsg(fd, &mh, MSG_NOSIGNAL) == sizeof(len);
+    for (int done = 0; sent && done < msg.len;) {
+        ssize_t n = send(fd, msg.buf + done, msg.len - done, MSG_NOSIGNAL);
+        if (n > 0)
+            done += n;
+        else if (n == -1 && errno != EINTR)
+            sent = false;
+    }
+    abufFree(&msg);
+    if (!sent) {
+        close(fd);
+        return false;
+    }
 
-void editorSearch() {
-    int saved_cursor_x = ec.cursor_x;
-    int saved_cursor_y = ec.cursor_y;
-    int saved_col_offset = ec.col_offset;
-    int saved_row_offset = ec.row_offset;
+    // The server isn't in the foreground of the terminal, it's told when
+    // the window changes. The connection closes when it lets go.
+    server.client_fd = fd;
+    signal(SIGWINCH, serverForwardSigwinch);
+    char c;
+    ssize_t n;
+    while ((n = read(fd, &c, 1)) != 0 && (n == 1 || errno == EINTR)) {}
+    close(fd);
+    server.client_fd = -1;
+    if (restore)
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved);
+    return true;
+}
 
-    char* query = editorPrompt("Search: %s (Use ESC / Enter / Arrows)", editorSearchCallback);
+// Reads what a client sends, taking its terminal. False if it isn't a
+// client that makes sense.
+static bool serverReceive(int fd) {
+    uint32_t len = 0;
+    int fds[2] = {-1, -1};
+    struct iovec iov = {&len, sizeof(len)};
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1,
+                        .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+
+    // A client that doesn't say anything isn't waited for long.
+    struct timeval timeout = {2, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ssize_t n = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(&mh); n >= 0 && cm; cm = CMSG_NXTHDR(&mh, cm))
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS &&
+            cm->cmsg_len == CMSG_LEN(sizeof(fds)))
+            memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+
+    char* msg = NULL;
+    size_t done = 0;
+    if (n == sizeof(len) && fds[0] != -1 && fds[1] != -1 && len > 0 && len <= SERVER_MAX_MESSAGE &&
+        isatty(fds[0]) && (msg = malloc(len + 1))) {
+        while (done < len && ((n = read(fd, msg + done, len - done)) > 0 || (n == -1 && errno == EINTR)))
+            done += n > 0 ? n : 0;
+    }
+    if (!msg || done < len) {
+        free(msg);
+        if (fds[0] != -1) close(fds[0]);
+        if (fds[1] != -1) close(fds[1]);
+        return false;
+    }
+    msg[len] = '\0';
+    timeout = (struct timeval) {0, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // The terminal of the client becomes the one of the server.
+    dup2(fds[0], STDIN_FILENO);
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+    server.client_fd = fd;
+    server.detached = false;
+    enableRawMode();
+    editorUpdateWindowSize();
+    editorSetStatusMessage("Attached to the mel server, Ctrl-Q detaches");
+
+    // The files asked for are opened unless they are already, the first
+    // one is shown.
+    int line = atoi(msg);
+    int first = -1;
+    for (char* p = msg + strlen(msg) + 1; p < msg + len; p += strlen(p) + 1) {
+        int i = bufferFind(p);
+        if (i == -1)
+            i = bufferAdd(p);
+        if (first == -1)
+            first = i;
+    }
+    free(msg);
+    if (first != -1)
+        bufferSwitch(first);
+    bufferRecover();
+    if (first != -1 && line > 0) {
+        ec.cursor_y = line - 1 < ec.num_rows ? line - 1 : ec.num_rows;
+        ec.cursor_x = 0;
+    }
+    return true;
+}
 
-    if (query) {
-        free(query);
-    } else {
-        editorRefreshScreen();
+// Waits for a client, doing the idle work of the buffers meanwhile.
+static void serverAccept() {
+    while (1) {
+        struct pollfd pfd = {server.listen_fd, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) <= 0) {
+            journalIdle();
+            saveIdle();
+            continue;
+        }
+        int fd = accept4(server.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd != -1 && !serverReceive(fd))
+            close(fd);
+        if (server.client_fd == fd && fd != -1)
+            return;
     }
 }
 
-/*** Action section ***/
+// Gives the terminal back as it was, if it is still there, and closes the
+// connection, which lets the client end.
+static void serverDetach() {
+    if (write(STDOUT_FILENO, "\x1b[?9l\x1b[?47l\x1b[2J\x1b[H", 19) == -1) {
+        // The terminal is gone already.
+    }
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &ec.orig_termios);
+    int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (null != -1) {
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        close(null);
+    }
+    close(server.client_fd);
+    server.client_fd = -1;
+    server.detached = false;
+    journalFlush();
+}
+
+// Runs the server, loading the files named, and never returns.
+void serverRun(char** files, int num_files) {
+    char path[PATH_MAX];
+    serverPath(path, sizeof(path));
+    int fd = serverConnect(path);
+    if (fd != -1) {
+        printf("[ERROR] A mel server already runs on %s\n", path);
+        exit(1);
+    }
+
+    // A socket left by a server that didn't end is taken over.
+    struct stat st;
+    struct sockaddr_un addr;
+    if (lstat(path, &st) == 0 && (!S_ISSOCK(st.st_mode) || st.st_uid != getuid())) {
+        printf("[ERROR] %s isn't a socket of yours\n", path);
+        exit(1);
+    }
+    unlink(path);
+    mode_t mask = umask(077);
+    server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server.listen_fd == -1 || !serverAddress(path, &addr) ||
+        bind(server.listen_fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+        listen(server.listen_fd, 8) == -1) {
+        perror(path);
+        exit(1);
+    }
+    umask(mask);
+
+    // Into the background, away from the terminal it was started on.
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid > 0) {
+        printf("mel server running on %s\n", path);
+        exit(0);
+    }
+    setsid();
+    int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (null != -1) {
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        close(null);
+    }
+
+    // The files named are read and highlighted now, not when asked for.
+    if (num_files == 0)
+        editorInsertRow(0, "", 0);
+    for (int i = 0; i < num_files; i++) {
+        char* name = serverAbsolutePath(files[i]);
+        if (i == 0) {
+            buffers.buf[0].file_name = name;
+            bufferLoad(&buffers.buf[0]);
+        } else {
+            if (bufferFind(name) == -1)
+                bufferSwitch(bufferAdd(name));
+            free(name);
+        }
+    }
+    bufferSwitch(0);
 
+    while (1) {
+        serverAccept();
+        while (!server.detached) {
+            editorRefreshScreen();
+            editorProcessKeypress();
+        }
+        serverDetach();
+    }
+}
 
+// Lets the terminal go instead of quitting or suspending, when attached to
+// the server. The buffers stay.
+bool serverLeave() {
+    if (server.client_fd == -1 || !server.enabled)
+        return false;
+    server.detached = true;
+    return true;
+}
 
-Action* createAction(char* str, ActionType t) {
-    Action* newAction = malloc(sizeof(Action));
-    newAction->t = t;
-    newAction->cpos_x = ec.cursor_x;
-    newAction->cpos_y = ec.cursor_y;
-    newAction->cursor_on_tilde = (ec.cursor_y == ec.num_rows);
-    newAction->string = str;
-    return newAction;
+// Whether keys have to stop being read, the server letting the terminal go.
+bool serverDetaching() {
+    return server.detached;
 }
 
-void freeAction(Action *action) {
-    if(action) {
-        if(action->string) free(action->string);
-        free(action);
+// While waiting for keys: the terminal or the client may be gone, the
+// window changed or another client wants the server.
+void serverIdle() {
+    if (server.client_fd == -1 || !server.enabled || server.detached)
+        return;
+    struct pollfd pfd[3] = {
+        {server.client_fd, POLLIN, 0},
+        {STDIN_FILENO, 0, 0},
+        {server.listen_fd, POLLIN, 0},
+    };
+    if (poll(pfd, 3, 0) <= 0)
+        return;
+    if ((pfd[1].revents & (POLLHUP | POLLERR | POLLNVAL)) || (pfd[2].revents & POLLIN)) {
+        server.detached = true;
+        return;
+    }
+    if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+        char buf[16];
+        ssize_t n = read(server.client_fd, buf, sizeof(buf));
+        if (n <= 0 && !(n == -1 && errno == EINTR))
+            server.detached = true;
+        else if (n > 0 && memchr(buf, 'W', n))
+            editorHandleSigwinch();
     }
 }
 
-void execute(Action* action) {
-    if(!action) return;
-    switch(action->t) {
-        case InsertChar:
-            {
-                ec.cursor_x = action->cpos_x;
-                ec.cursor_y = action->cpos_y;
-                if(ec.cursor_y < ec.num_rows) {
-                    editorRowInsertString(&ec.row[ec.cursor_y], ec.cursor_x, action->string);
-                    ec.cursor_x += strlen(action->string);
-                } else {
-                    editorInsertChar((int)(*action->string));
-                }
+/*** Batch section ***/
+
+// mel --batch SCRIPT FILE... makes the same edits to many files without a
+// terminal, going through the same paths as the keys do: a script line
+// is a command and its arguments, each one quoted if it has spaces.
+//
+//   goto N|$        Ctrl-G, $ is the last line
+//   up [N]          Cursor up or down N lines
+//   down [N]
+//   home            Start or end of the line
+//   end
+//   find PATTERN    Ctrl-F: next match from the cursor, wrapping around
+//   replace PATTERN REPLACEMENT
+//                   Ctrl-J over the whole file
+//   insert TEXT     Typed at the cursor, \n starts a new line
+//   cut [N]         Ctrl-X on N lines, delete is the same
+//   copy            Ctrl-C
+//   paste           Ctrl-V
+//
+// -i and -r apply to the patterns as they do in the editor. Every file is
+// edited by a process of its own, -j of them at a time, loaded as the
+// editor does and saved in the background as Ctrl-S does. A command that
+// fails leaves the file as it was. Threads left over when there are
+// fewer files than -j go to searching and replacing within them.
+
+enum batch_op {
+    BATCH_GOTO,
+    BATCH_UP,
+    BATCH_DOWN,
+    BATCH_HOME,
+    BATCH_END,
+    BATCH_FIND,
+    BATCH_REPLACE,
+    BATCH_INSERT,
+    BATCH_CUT,
+    BATCH_COPY,
+    BATCH_PASTE
+};
+
+// Exit status of the process editing a file.
+#define BATCH_CHANGED 0
+#define BATCH_FAILED 1
+#define BATCH_UNCHANGED 2
+
+static const struct {
+    const char* name;
+    enum batch_op op;
+    int min_args;
+    int max_args;
+} batch_commands[] = {
+    {"goto", BATCH_GOTO, 1, 1},
+    {"up", BATCH_UP, 0, 1},
+    {"down", BATCH_DOWN, 0, 1},
+    {"home", BATCH_HOME, 0, 0},
+    {"end", BATCH_END, 0, 0},
+    {"find", BATCH_FIND, 1, 1},
+    {"replace", BATCH_REPLACE, 2, 2},
+    {"insert", BATCH_INSERT, 1, 1},
+    {"cut", BATCH_CUT, 0, 1},
+    {"delete", BATCH_CUT, 0, 1},
+    {"copy", BATCH_COPY, 0, 0},
+    {"paste", BATCH_PASTE, 0, 0},
+};
+
+struct batch_command {
+    const char* name;
+    enum batch_op op;
+    int line;                   // In the script
+    int count;                  // Line or repeat count, -1 for $
+    char* args[2];
+    struct search_query query;  // Of find and replace
+};
+
+struct batch {
+    bool enabled;               // Running a script (--batch)
+    const char* script;
+    struct batch_command* commands;
+    int num_commands;
+    int match_row;              // Where the last find left the cursor,
+    int match_col;              // match_row -1 before the first one
+} batch;
+
+// Reads the next argument at *p into *word, false if there is none. An
+// argument is quoted if it has spaces; \n, \t, \" and \\ are unescaped,
+// other escapes are kept for the regular expressions.
+static bool batchWord(char** p, char** word) {
+    char* s = *p;
+    while (*s == ' ' || *s == '\t')
+        s++;
+    if (*s == '\0' || *s == '\n' || *s == '\r')
+        return false;
+
+    bool quoted = *s == '"';
+    if (quoted)
+        s++;
+    char* out = malloc(strlen(s) + 1);
+    if (!out) die("Failed to allocate batch script");
+    int len = 0;
+    while (*s && *s != '\n' && *s != '\r' &&
+           (quoted ? *s != '"' : (*s != ' ' && *s != '\t'))) {
+        if (*s == '\\' && s[1]) {
+            s++;
+            switch (*s) {
+                case 'n': out[len++] = '\n'; break;
+                case 't': out[len++] = '\t'; break;
+                case '"':
+                case '\\': out[len++] = *s; break;
+                default: out[len++] = '\\'; out[len++] = *s; break;
             }
-            break;
-        case DelChar:
-            {
-                ec.cursor_x = action->cpos_x;
-                ec.cursor_y = action->cpos_y;
-                editorDelChar();
+        } else {
+            out[len++] = *s;
+        }
+        s++;
+    }
+    if (quoted && *s == '"')
+        s++;
+    out[len] = '\0';
+    *p = s;
+    *word = out;
+    return true;
+}
+
+// Reads and checks the whole script before any file is touched.
+static bool batchLoad(const char* path) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        printf("[ERROR] Can't read %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    char* text = NULL;
+    size_t cap = 0;
+    bool ok = true;
+    for (int line = 1; ok && getline(&text, &cap, fp) != -1; line++) {
+        char* p = text;
+        char* name;
+        if (!batchWord(&p, &name))
+            continue;
+        if (name[0] == '#') {
+            free(name);
+            continue;
+        }
+
+        unsigned int c = 0;
+        while (c < sizeof(batch_commands) / sizeof(batch_commands[0]) &&
+               strcmp(batch_commands[c].name, name) != 0)
+            c++;
+        struct batch_command cmd = {.line = line, .count = 1};
+        int num_args = 0;
+        char* extra = NULL;
+        if (c == sizeof(batch_commands) / sizeof(batch_commands[0])) {
+            printf("[ERROR] %s:%d: Unknown command %s\n", path, line, name);
+            ok = false;
+        } else {
+            cmd.name = batch_commands[c].name;
+            cmd.op = batch_commands[c].op;
+            while (num_args < 2 && batchWord(&p, &cmd.args[num_args]))
+                num_args++;
+            if (batchWord(&p, &extra) || num_args < batch_commands[c].min_args ||
+                num_args > batch_commands[c].max_args) {
+                printf("[ERROR] %s:%d: Wrong number of arguments to %s\n", path, line, name);
+                ok = false;
             }
-            break;
-        case PasteLine:
-            {
-                ec.cursor_x = action->cpos_x;
-                ec.cursor_y = action->cpos_y;
-                // store current copied char buffer
-                char* curr_copy_buffer = ec.copied_char_buffer;
-                // set editor copy buffer to action string
-                ec.copied_char_buffer = action->string;
-                editorPaste();
-                // reset editor copy buffer
-                ec.copied_char_buffer = curr_copy_buffer;
+        }
+
+        if (ok && cmd.op == BATCH_GOTO && strcmp(cmd.args[0], "$") == 0) {
+            cmd.count = -1;
+        } else if (ok && num_args == 1 && cmd.op != BATCH_FIND && cmd.op != BATCH_INSERT) {
+            cmd.count = atoi(cmd.args[0]);
+            if (cmd.count < 1) {
+                printf("[ERROR] %s:%d: %s isn't a positive number\n", path, line, cmd.args[0]);
+                ok = false;
             }
+        }
+        if (ok && (cmd.op == BATCH_FIND || cmd.op == BATCH_REPLACE) &&
+            !searchCompile(&cmd.query, cmd.args[0], ec.search_flags)) {
+            printf("[ERROR] %s:%d: Invalid regular expression: %s\n", path, line, cmd.query.error);
+            ok = false;
+        }
+        if (ok && (cmd.op == BATCH_FIND || cmd.op == BATCH_REPLACE) && cmd.query.len == 0) {
+            printf("[ERROR] %s:%d: Empty pattern\n", path, line);
+            ok = false;
+        }
+        free(name);
+        free(extra);
+        if (!ok) {
+            free(cmd.args[0]);
+            free(cmd.args[1]);
+            searchFree(&cmd.query);
             break;
-        case CutLine:
-            {
-                ec.cursor_x = action->cpos_x;
-                ec.cursor_y = action->cpos_y;
-                editorCut();
-            }
+        }
+
+        struct batch_command* commands = realloc(batch.commands,
+            sizeof(struct batch_command) * (batch.num_commands + 1));
+        if (!commands) die("Failed to allocate batch script");
+        batch.commands = commands;
+        batch.commands[batch.num_commands++] = cmd;
+    }
+    free(text);
+    fclose(fp);
+    return ok;
+}
+
+static void batchClampCursor() {
+    if (ec.cursor_y > ec.num_rows)
+        ec.cursor_y = ec.num_rows;
+    if (ec.cursor_y < 0)
+        ec.cursor_y = 0;
+    if (ec.cursor_y < ec.num_rows && ec.cursor_x > ec.row[ec.cursor_y].size)
+        ec.cursor_x = ec.row[ec.cursor_y].size;
+    if (ec.cursor_y == ec.num_rows)
+        ec.cursor_x = 0;
+}
+
+// Runs a command on the file in ec, false if it can't be done.
+static bool batchExecute(struct batch_command* cmd) {
+    switch (cmd->op) {
+        case BATCH_GOTO:
+            if (cmd->count > ec.num_rows)
+                return false;
+            ec.cursor_y = cmd->count == -1 ? (ec.num_rows > 0 ? ec.num_rows - 1 : 0) : cmd->count - 1;
+            ec.cursor_x = 0;
             break;
-        case FlipDown:
-            {
-                ec.cursor_x = action->cpos_x;
-                ec.cursor_y = action->cpos_y;
-                editorFlipRow(-1);
-            }
+        case BATCH_UP:
+        case BATCH_DOWN:
+            ec.cursor_y += cmd->op == BATCH_UP ? -cmd->count : cmd->count;
+            batchClampCursor();
             break;
-        case FlipUp:
-            {
-                ec.cursor_x = action->cpos_x;
-                ec.cursor_y = action->cpos_y;
-                editorFlipRow(1);
-            }
+        case BATCH_HOME:
+            ec.cursor_x = 0;
             break;
-        case NewLine:
-            {
-                ec.cursor_x = action->cpos_x;
-                ec.cursor_y = action->cpos_y;
-                editorInsertNewline();
-            }
+        case BATCH_END:
+            ec.cursor_x = ec.cursor_y < ec.num_rows ? ec.row[ec.cursor_y].size : 0;
             break;
-        default: break;
-    }
-}
-
-void revert(Action *action) {
-    if(!action) return;
-    switch(action->t) {
-        case InsertChar:
-            {
-                ec.cursor_x = action->cpos_x;
-                ec.cursor_y = action->cpos_y;
-                editorRowDelString(&ec.row[ec.cursor_y], ec.cursor_x, strlen(action->string));
-                if(action->cursor_on_tilde)
-                    editorDelRow(ec.cursor_y);
-            }
+        case BATCH_FIND: {
+            int col = ec.cursor_y < ec.num_rows ?
+                rowMapX(&ec.row[ec.cursor_y], ROW_CHARS, ROW_RENDER, ec.cursor_x) : 0;
+            // Still on the match found last, the next one is looked for
+            // past it, as Ctrl-N does.
+            bool inclusive = ec.cursor_y != batch.match_row || col != batch.match_col;
+            int row, match_col;
+            if (searchRows(&cmd->query, 1, ec.cursor_y, col, inclusive, &row, &match_col) <= 0)
+                return false;
+            ec.cursor_y = row;
+            ec.cursor_x = rowMapX(&ec.row[row], ROW_RENDER, ROW_CHARS, match_col);
+            batchClampCursor();
+            batch.match_row = ec.cursor_y;
+            batch.match_col = rowMapX(&ec.row[row], ROW_CHARS, ROW_RENDER, ec.cursor_x);
             break;
-        case DelChar:
-            {
-                if(action->string) {
-                    ec.cursor_x = action->cpos_x - 1;
-                    ec.cursor_y = action->cpos_y;
-                    int c = *(action->string);
-                    editorInsertChar(c);
-                } else {
-                    editorInsertNewline();
-                }
-            }
+        }
+        case BATCH_REPLACE:
+            transactionBegin();
+            editorReplaceAll(&cmd->query, cmd->args[1]);
+            batchClampCursor();
+            transactionCommit();
             break;
-        case PasteLine:
-            {
-                ec.cursor_x = action->cpos_x;
-                ec.cursor_y = action->cpos_y;
-                editor_row* row = &ec.row[ec.cursor_y];
-                if(action->string) {
-                    editorRowDelString(row, ec.cursor_x, strlen(action->string));
-                    if(action->cursor_on_tilde) editorDelRow(ec.cursor_y);
-                }
+        case BATCH_INSERT:
+            for (const char* s = cmd->args[0]; *s;) {
+                const char* nl = strchr(s, '\n');
+                size_t len = nl ? (size_t) (nl - s) : strlen(s);
+                if (len > 0)
+                    makeAction(InsertChar, strndup(s, len));
+                if (!nl)
+                    break;
+                makeAction(NewLine, NULL);
+                s = nl + 1;
             }
             break;
-        case CutLine:
-            {
-                ec.cursor_x = 0;
-                ec.cursor_y = action->cpos_y;
-                editorInsertRow(ec.cursor_y, "", 0);
-                // store current copied char buffer
-                char* curr_copy_buffer = ec.copied_char_buffer;
-                // set editor copy buffer to action string
-                ec.copied_char_buffer = action->string;
-                editorPaste();
-                // reset editor copy buffer
-                ec.copied_char_buffer = curr_copy_buffer;
+        case BATCH_CUT:
+            for (int i = 0; i < cmd->count && ec.cursor_y < ec.num_rows; i++) {
+                editorCopy(NO_STATUS);
+                makeAction(CutLine, strdup(ec.copied_char_buffer));
             }
             break;
-        case FlipDown:
-            {
-                ec.cursor_x = action->cpos_x;
-                ec.cursor_y = action->cpos_y + 1;
-                editorFlipRow(1);
-            }
+        case BATCH_COPY:
+            if (ec.cursor_y < ec.num_rows)
+                editorCopy(NO_STATUS);
             break;
-        case FlipUp:
-            {
-                ec.cursor_x = action->cpos_x;
-                ec.cursor_y = action->cpos_y - 1;
-                editorFlipRow(-1);
-            }
+        case BATCH_PASTE:
+            if (ec.copied_char_buffer)
+                makeAction(PasteLine, strdup(ec.copied_char_buffer));
             break;
-        case NewLine:
-            {
-                ec.cursor_x = 0;
-                ec.cursor_y = action->cpos_y + 1;
-                editorDelChar();
+    }
+    return true;
+}
+
+// Edits a file, in the process forked for it. Returns a BATCH_* status.
+static int batchFile(char* file_name) {
+    if (access(file_name, R_OK | W_OK) != 0) {
+        fprintf(stderr, "%s: %s\n", file_name, strerror(errno));
+        return BATCH_FAILED;
+    }
+    // Nothing is undone, and nothing is left next to the file or in the
+    // cache but the file itself.
+    ec.undo.budget = 0;
+    journal.disabled = true;
+    undo_history.disabled = true;
+    batch.match_row = -1;
+    editorOpen(file_name);
+
+    for (int i = 0; i < batch.num_commands; i++) {
+        struct batch_command* cmd = &batch.commands[i];
+        if (!batchExecute(cmd)) {
+            fprintf(stderr, "%s: %s:%d: %s failed\n", file_name, batch.script, cmd->line,
+                    cmd->name);
+            return BATCH_FAILED;
+        }
+    }
+    if (!ec.dirty)
+        return BATCH_UNCHANGED;
+
+    // Waited for here, saveWait() would draw the screen.
+    editorSave();
+    saveFinish();
+    if (ec.dirty) {
+        fprintf(stderr, "%s: %s\n", file_name, ec.status_msg);
+        return BATCH_FAILED;
+    }
+    return BATCH_CHANGED;
+}
+
+// Runs the script on the files, -j processes at a time, and tells how it
+// went. Returns the exit status of mel.
+int batchRun(char** files, int num_files) {
+    if (num_files == 0) {
+        printf("[ERROR] Files to edit must be specified\n");
+        return 1;
+    }
+    if (!batchLoad(batch.script))
+        return 1;
+
+    // The files are edited side by side, sharing the threads out.
+    int jobs = ec.jobs > 0 ? ec.jobs : 1;
+    if (jobs > num_files)
+        jobs = num_files;
+    ec.jobs = ec.jobs > jobs ? ec.jobs / jobs : 1;
+    int next = 0, running = 0;
+    int changed = 0, unchanged = 0, failed = 0;
+    while (next < num_files || running > 0) {
+        if (next < num_files && running < jobs) {
+            fflush(NULL);
+            pid_t pid = fork();
+            if (pid == 0)
+                exit(batchFile(files[next]));
+            if (pid == -1) {
+                fprintf(stderr, "%s: %s\n", files[next], strerror(errno));
+                failed++;
+            } else {
+                running++;
             }
+            next++;
+            continue;
+        }
+
+        int status;
+        if (wait(&status) == -1)
             break;
-        default: break;
+        running--;
+        int result = WIFEXITED(status) ? WEXITSTATUS(status) : BATCH_FAILED;
+        if (result == BATCH_CHANGED)
+            changed++;
+        else if (result == BATCH_UNCHANGED)
+            unchanged++;
+        else
+            failed++;
     }
+
+    fprintf(stderr, "%d file%s changed, %d unchanged, %d failed\n",
+            changed, changed == 1 ? "" : "s", unchanged, failed);
+    return failed ? 1 : 0;
 }
 
+/*** Soft wrap section ***/
 
-ActionList* actionListInit() {
-    ActionList* list = malloc(sizeof(ActionList));
-    list->head = NULL;
-    list->tail = NULL;
-    list->current = NULL;
-    list->size = 0;
-    return list;
+// With soft wrap, rows longer than the screen go on over the next screen
+// lines. Every row keeps its number of screen lines (editor_row.wrap_lines)
+// and the wrap index their prefix sums, so mapping a screen line to a row
+// and back is O(log n). An edited row only updates its own count; rows
+// inserted or deleted, or a new screen width, rebuild the sums in one pass
+// over the counts, and only rows that aren't counted yet (or all of them
+// when the width changed) are measured again.
+
+static int wrapWidth() {
+    int width = ec.screen_cols - (ec.show_line_numbers ? 8 : 0);
+    return width > 0 ? width : 1;
 }
 
-// Frees AListNodes in actions list starting from AListNode ptr begin
-// returns number of AListNodes freed.
-int clearAlistFrom(AListNode* begin) {
-    int nodes_freed = 0;
-    if(begin && begin->prev )
-        begin->prev->next = NULL;
-    AListNode* curr_ptr = begin;
-    while( curr_ptr ) {
-        AListNode* temp = curr_ptr;
-        curr_ptr = curr_ptr->next;
-        freeAction(temp->action);
-        free(temp);
-        nodes_freed += 1;
+// True if rows can be cut at any column: nothing in it is two columns wide
+// but tabs, which are cut like spaces.
+static bool rowWrapsAnywhere(const editor_row* row) {
+    for (int i = 0; i < row->num_wide; i++) {
+        if (row->wide[i].bytes > 1 && row->wide[i].width > 1)
+            return false;
     }
+    return true;
+}
+
+// Column the screen line after the one starting at col starts at, or past
+// the end of the row if it's the last one. A wide char that doesn't fit
+// goes to the next line.
+static int rowWrapNext(const editor_row* row, int col, int width) {
+    int next = col + width;
+    if (next >= rowMapX(row, ROW_RENDER, ROW_COLUMNS, row->render_size))
+        return next;
+    int start = rowMapX(row, ROW_RENDER, ROW_COLUMNS, rowMapX(row, ROW_COLUMNS, ROW_RENDER, next));
+    return start > col ? start : next;
+}
 
-    return nodes_freed;
+static int rowWrapLines(const editor_row* row, int width) {
+    int cols = rowMapX(row, ROW_RENDER, ROW_COLUMNS, row->render_size);
+    if (cols <= width)
+        return 1;
+    if (rowWrapsAnywhere(row))
+        return (cols + width - 1) / width;
+    int lines = 1;
+    for (int col = rowWrapNext(row, 0, width); col < cols; col = rowWrapNext(row, col, width))
+        lines++;
+    return lines;
 }
 
-void freeAlist() {
-    ActionList* list = ec.actions;
-    if(list){
-        clearAlistFrom(list->head);
-        free(list);
+// Screen line of the row column col is on, and the column it starts at
+// into *start. Past the end of the row is on the last line.
+static int rowWrapLineOf(const editor_row* row, int col, int* start) {
+    int width = ec.wrap.width;
+    int line = 0;
+    *start = 0;
+    if (rowWrapsAnywhere(row)) {
+        line = col / width;
+        if (line >= row->wrap_lines)
+            line = row->wrap_lines - 1;
+        *start = line * width;
+        return line;
     }
+    int cols = rowMapX(row, ROW_RENDER, ROW_COLUMNS, row->render_size);
+    for (int next = rowWrapNext(row, 0, width); next < cols && next <= col;
+         next = rowWrapNext(row, next, width)) {
+        *start = next;
+        line++;
+    }
+    return line;
 }
 
-void addAction(Action* action) {
-    if(ACTIONS_LIST_MAX_SIZE == 0) return;
-    ActionList* list = ec.actions;
-    AListNode* node = malloc(sizeof(AListNode));
-    node->action = action;
-    node->prev = NULL;
-    node->next = NULL;
+static int rowWrapLineStart(const editor_row* row, int line) {
+    if (rowWrapsAnywhere(row))
+        return line * ec.wrap.width;
+    int col = 0;
+    while (line-- > 0)
+        col = rowWrapNext(row, col, ec.wrap.width);
+    return col;
+}
 
-    if(list->head == NULL) {
-        list->head = node;
-        list->tail = node;
-        list->current = node;
-    } else if (list->tail == list->current) {
-        list->tail->next = node;
-        node->prev = list->tail;
-        list->tail = node;
-        list->current = node;
-    } else {
-        AListNode* clear_from = list->current == NULL ? list->head : list->current->next;
-        int nodes_freed = clearAlistFrom(clear_from);
-        list->size -= nodes_freed;
-        if(list->current) {
-            list->current->next = node;
-            node->prev = list->current;
-            list->tail = node;
-            list->current = node;
-        } else {
-            list->current = list->head = list->tail = node;
+// Screen lines of the rows before row i.
+static int wrapIndexLines(int i) {
+    if (i > ec.wrap.num)
+        i = ec.wrap.num;
+    int lines = 0;
+    for (; i > 0; i -= i & -i)
+        lines += ec.wrap.tree[i];
+    return lines;
+}
+
+static void wrapIndexAdd(int i, int delta) {
+    for (i++; i <= ec.wrap.num; i += i & -i)
+        ec.wrap.tree[i] += delta;
+}
+
+// Returns the row screen line `line` is on and the screen line of the row
+// it is into *row_line, or ec.num_rows past the last one.
+static int wrapIndexFind(int line, int* row_line) {
+    int i = 0;
+    int step = 1;
+    while (step * 2 <= ec.wrap.num)
+        step *= 2;
+    for (; step > 0; step /= 2) {
+        if (i + step <= ec.wrap.num && ec.wrap.tree[i + step] <= line) {
+            i += step;
+            line -= ec.wrap.tree[i];
         }
     }
-    list->size += 1;
+    *row_line = i < ec.num_rows ? line : 0;
+    return i;
+}
 
-    // Truncate list to fit at max `ACTIONS_LIST_MAX_SIZE` actions
-    if((list->size > ACTIONS_LIST_MAX_SIZE) && (ACTIONS_LIST_MAX_SIZE != -1)) {
-        AListNode* tmp = list->head;
-        list->head = list->head->next;
-        list->size -= 1;
-        if(list->size == 0)
-            list->current = list->tail = NULL;
-        freeAction(tmp->action);
-        free(tmp);
-        if(list->head)
-            list->head->prev = NULL;
-    }
+// Rows changed out of sight: the sums are built again on the next
+// update.
+void wrapIndexReset() {
+    ec.wrap.num = -1;
 }
 
-// If last action is InsertChar operation and the current action is also InsertChar
-// Instead of creating new action, this function concats the char to the
-// stored string in last action provided the current action does append at the end of the row
-bool concatWithLastAction(ActionType t, char* str) {
-    if(t == InsertChar &&
-       ACTIONS_LIST_MAX_SIZE &&
-       ec.actions->current &&
-       ec.actions->current == ec.actions->tail &&
-       ec.actions->current->action->t == t &&
-       ec.actions->current->action->cpos_y == ec.cursor_y &&
-       (int)(ec.actions->current->action->cpos_x + strlen(ec.actions->current->action->string)) == ec.cursor_x
-    ) {
-        int c = *(str);
-        editorInsertChar(c);
-        char* string = ec.actions->current->action->string;
-        string = realloc(string, strlen(string) + 2);
-        strcat(string, str);
-        ec.actions->current->action->string = string;
-        free(str);
-        return true;
+// Rows from at on moved, as a row was inserted or deleted there. The
+// sums of the rows before it stay, the next update adds the others
+// again, as it does rows appended at the end, with the screen lines
+// they have counted.
+void wrapIndexRowsMoved(int at) {
+    if (ec.wrap.num > at)
+        ec.wrap.num = at;
+}
+
+// Counts the screen lines of a row again after it changed. A row past
+// the sums is counted when the next update adds it.
+void wrapIndexInvalidateRow(editor_row* row) {
+    int i = row - ec.row;
+    if (ec.soft_wrap && ec.wrap.num != -1 && i >= ec.wrap.num) {
+        row->wrap_lines = 0;
+        return;
     }
-    return false;
+    if (!ec.soft_wrap || ec.wrap.num == -1 || i < 0) {
+        row->wrap_lines = 0;
+        ec.wrap.num = -1;
+        return;
+    }
+    int lines = rowWrapLines(row, ec.wrap.width);
+    wrapIndexAdd(i, lines - row->wrap_lines);
+    row->wrap_lines = lines;
 }
 
-// Creates Action, adds it to ActionList and executes it.
-// Takes ActionType and char* as paramaters for use in undo/redo operation
-void makeAction(ActionType t, char* str) {
-    if(!concatWithLastAction(t, str)) {
-        Action* newAction = createAction(str, t);
-        if(ACTIONS_LIST_MAX_SIZE) addAction(newAction);
-        execute(newAction);
+// Two rows next to each other swapped places.
+void wrapIndexSwapRows(int i) {
+    if (i + 1 >= ec.wrap.num) {
+        wrapIndexRowsMoved(i);
+        return;
     }
+    int delta = ec.row[i].wrap_lines - ec.row[i + 1].wrap_lines;
+    wrapIndexAdd(i, delta);
+    wrapIndexAdd(i + 1, -delta);
 }
 
-void undo() {
-    if(ACTIONS_LIST_MAX_SIZE == 0) return;
-    ActionList* list = ec.actions;
-    if(list && list->current) {
-        revert(list->current->action);
-        // may set current to NULL
-        list->current = list->current->prev;
+static void wrapIndexUpdate() {
+    int width = wrapWidth();
+    if (ec.wrap.num == ec.num_rows && ec.wrap.width == width)
+        return;
+    if (ec.num_rows + 1 > ec.wrap.cap) {
+        int cap = ec.wrap.cap ? ec.wrap.cap : 64;
+        while (cap < ec.num_rows + 1)
+            cap *= 2;
+        int* tree = realloc(ec.wrap.tree, sizeof(int) * cap);
+        if (!tree) die("Failed to allocate wrap index");
+        ec.wrap.tree = tree;
+        ec.wrap.cap = cap;
     }
-    if((list->current == NULL) && (ACTIONS_LIST_MAX_SIZE)) {
-        ec.dirty = 0;
+
+    // Rows appended at the end, as piped input and followed files add
+    // them, go in one by one.
+    if (ec.wrap.num != -1 && ec.wrap.num < ec.num_rows && ec.wrap.width == width) {
+        while (ec.wrap.num < ec.num_rows) {
+            int i = ++ec.wrap.num;
+            editor_row* row = &ec.row[i - 1];
+            if (row->wrap_lines == 0)
+                row->wrap_lines = rowWrapLines(row, width);
+            ec.wrap.tree[i] = row->wrap_lines + wrapIndexLines(i - 1) - wrapIndexLines(i - (i & -i));
+        }
+        return;
+    }
+
+    bool recount = ec.wrap.width != width;
+    ec.wrap.width = width;
+    ec.wrap.num = ec.num_rows;
+    ec.wrap.tree[0] = 0;
+    for (int i = 0; i < ec.num_rows; i++) {
+        editor_row* row = &ec.row[i];
+        if (recount || row->wrap_lines == 0)
+            row->wrap_lines = rowWrapLines(row, width);
+        ec.wrap.tree[i + 1] = row->wrap_lines;
+    }
+    // Each node adds itself to its parent, in O(n).
+    for (int i = 1; i <= ec.num_rows; i++) {
+        int parent = i + (i & -i);
+        if (parent <= ec.num_rows)
+            ec.wrap.tree[parent] += ec.wrap.tree[i];
     }
 }
 
-void redo() {
-    if(ACTIONS_LIST_MAX_SIZE == 0) return;
-    ActionList* list = ec.actions;
-    if(list && list->current && list->current->next) {
-        execute(list->current->next->action);
-        list->current = list->current->next;
+// Keeps the cursor on screen by screen lines. col_offset becomes the
+// start of the cursor's screen line, so that render_x - col_offset is
+// still its screen column.
+void wrapScroll() {
+    wrapIndexUpdate();
+    if (ec.row_offset > ec.num_rows)
+        ec.row_offset = ec.num_rows;
+    int top = wrapIndexLines(ec.row_offset);
+    if (ec.row_offset < ec.num_rows && ec.wrap_offset < ec.row[ec.row_offset].wrap_lines)
+        top += ec.wrap_offset;
+
+    int start = 0;
+    int cursor = wrapIndexLines(ec.cursor_y);
+    if (ec.cursor_y < ec.num_rows)
+        cursor += rowWrapLineOf(&ec.row[ec.cursor_y], ec.render_x, &start);
+
+    if (cursor < top)
+        top = cursor;
+    if (cursor >= top + ec.screen_rows)
+        top = cursor - ec.screen_rows + 1;
+    ec.row_offset = wrapIndexFind(top, &ec.wrap_offset);
+    ec.wrap_cursor = cursor - top;
+    ec.col_offset = start;
+}
+
+// Page up and down by screen lines: the cursor goes a screen past the top
+// or the bottom line, at the same place in its screen line.
+void wrapPage(int key) {
+    wrapIndexUpdate();
+    int total = wrapIndexLines(ec.num_rows);
+    int top = wrapIndexLines(ec.row_offset) + ec.wrap_offset;
+    int x = 0;
+    int start;
+    if (ec.cursor_y < ec.num_rows) {
+        editor_row* row = &ec.row[ec.cursor_y];
+        int rx = editorRowCursorXToRenderX(row, ec.cursor_x);
+        rowWrapLineOf(row, rx, &start);
+        x = rx - start;
     }
-    // when current points to NULL but head is not NULL, do head
-    if(list && list->head && !list->current) {
-        list->current = list->head;
-        execute(list->current->action);
+
+    int line = key == PAGE_UP ? top - ec.screen_rows : top + 2 * ec.screen_rows - 1;
+    if (line >= total)
+        line = total - 1;
+    if (line < 0)
+        line = 0;
+    int row_line;
+    ec.cursor_y = wrapIndexFind(line, &row_line);
+    if (ec.cursor_y >= ec.num_rows) {
+        ec.cursor_x = 0;
+        return;
     }
+
+    editor_row* row = &ec.row[ec.cursor_y];
+    start = rowWrapLineStart(row, row_line);
+    int next = rowWrapNext(row, start, ec.wrap.width);
+    if (row_line < row->wrap_lines - 1 && start + x >= next)
+        x = next - start - 1;
+    ec.cursor_x = editorRowRenderXToCursorX(row, start + x);
 }
 
 /*** Append buffer section **/
@@ -1992,6 +8071,10 @@ void editorScroll() {
     if (ec.cursor_y < ec.num_rows) {
         ec.render_x = editorRowCursorXToRenderX(&ec.row[ec.cursor_y], ec.cursor_x);
     }
+    if (ec.soft_wrap) {
+        wrapScroll();
+        return;
+    }
 
     // Vertical scrolling
     if (ec.cursor_y < ec.row_offset) {
@@ -2103,12 +8186,119 @@ void editorSetStatusMessage(const char* msg, ...) {
     ec.status_msg_time = time(NULL);
 }
 
+// Draws the columns from start_col to end_col of a row, returns how many
+// columns it took.
+static int editorDrawRowPart(struct a_buf* ab, editor_row* row, int start_col, int end_col) {
+    int max_len = end_col - start_col;
+
+    // Drawing starts at the cluster the first column is in, from
+    // the run it is in or the next one.
+    int r = rowMapX(row, ROW_COLUMNS, ROW_RENDER, start_col);
+    if (r > row->render_size) r = row->render_size;
+    int col = rowMapX(row, ROW_RENDER, ROW_COLUMNS, r);
+    int run = rowWideFind(row, r, ROW_RENDER);
+    editorRowLex(row, rowMapX(row, ROW_COLUMNS, ROW_RENDER, end_col));
+    int current_pos = 0;
+
+    // Matches of the active search are drawn over the syntax
+    // colors, the row's own highlight is left untouched.
+    // On long rows, only from a chunk before the screen.
+    struct search_match m;
+    int match_start = -1;
+    int match_end = -1;
+    if (ec.search_query && r < row->render_size) {
+        int from = row->chunks && r > LONG_ROW_CHUNK ? r - LONG_ROW_CHUNK : 0;
+        match_start = searchForward(ec.search_query, row->render, row->render_size, from, &m);
+        match_end = (match_start != -1) ? m.caps[1] : -1;
+    }
+
+    while (r < row->render_size && col < end_col) {
+        while (match_start != -1 && match_end <= r) {
+            int next = (match_end > match_start) ? match_end : match_start + 1;
+            match_start = searchForward(ec.search_query, row->render, row->render_size, next, &m);
+            match_end = (match_start != -1) ? m.caps[1] : -1;
+        }
+
+        // A UTF-8 cluster, or a byte (the spaces of a tab, one by one)
+        int n = 1, width = 1;
+        while (run < row->num_wide && wideRunEnd(&row->wide[run], ROW_RENDER) <= r)
+            run++;
+        if (run < row->num_wide && row->wide[run].render <= r && row->wide[run].bytes > 1) {
+            n = row->wide[run].bytes;
+            width = row->wide[run].width;
+        }
+        unsigned char* c = (unsigned char*) &row->render[r];
+
+        if (col < start_col || col + width > end_col) {
+            // A wide char cut by the edge of the screen
+            int visible = (col + width < end_col ? col + width : end_col) -
+                          (col > start_col ? col : start_col);
+            for (int i = 0; i < visible; i++)
+                abufAppend(ab, " ", 1);
+            current_pos += visible;
+        } else if (ec.column_marker > 0 && width == 1 &&
+                   col == ec.column_marker - 1) {
+            // Handle column marker if enabled
+            abufAppend(ab, "\x1b[38;5;242m|\x1b[m", 13);
+            current_pos++;
+        } else if (n == 1 ? (*c < 0x20 || *c >= 0x7f) : !utf8Drawable((char*) c, n)) {
+            // Control chars, bytes that aren't UTF-8, lone marks
+            char sym = (n == 1 && *c <= 26) ? '@' + *c : '?';
+            abufAppend(ab, "\x1b[7m", 4);
+            abufAppend(ab, &sym, 1);
+            abufAppend(ab, "\x1b[m", 3);
+            current_pos += width;
+        } else {
+            // Draw regular character
+            bool in_match = match_start != -1 && r >= match_start;
+            int color = editorSyntaxToColor(in_match ? HL_MATCH : row->highlight[r]);
+            char colbuf[16];
+            snprintf(colbuf, sizeof(colbuf), "\x1b[%dm", color);
+            abufAppend(ab, colbuf, strlen(colbuf));
+            abufAppend(ab, (char*) c, n);
+            current_pos += width;
+        }
+        col += width;
+        r += n;
+    }
+
+    // Draw column marker after content if needed
+    if (ec.column_marker > 0 && 
+        ec.column_marker > start_col + current_pos &&
+        ec.column_marker - start_col < max_len) {
+        while (current_pos < ec.column_marker - start_col - 1) {
+            abufAppend(ab, " ", 1);
+            current_pos++;
+        }
+        abufAppend(ab, "\x1b[38;5;242m|\x1b[m", 13);
+        current_pos++;
+    }
+    return current_pos;
+}
+
 void editorDrawRows(struct a_buf* ab) {
+    // With soft wrap, rows go on over as many screen lines as they need.
+    int width = ec.screen_cols - (ec.show_line_numbers ? 8 : 0);
+    int file_row = ec.row_offset;
+    int line = ec.soft_wrap ? ec.wrap_offset : 0;
+    int start = 0;
+    if (ec.soft_wrap && file_row < ec.num_rows)
+        start = rowWrapLineStart(&ec.row[file_row], line);
+
+    // Lines end clearing the rest of the screen line, but in a pane with
+    // another one at its right, where they are filled with spaces.
+    bool to_edge = ec.screen_left + 2 * ec.screen_cols + 1 > ec.window_cols;
+
     for (int y = 0; y < ec.screen_rows; y++) {
-        int file_row = y + ec.row_offset;
-        
+        char pos[32];
+        snprintf(pos, sizeof(pos), "\x1b[%d;%dH", ec.screen_top + y + 1, ec.screen_left + 1);
+        abufAppend(ab, pos, strlen(pos));
+        int used = ec.show_line_numbers ? 8 : 0;
+
         // Line numbers if enabled
-        if (ec.show_line_numbers) {
+        if (ec.show_line_numbers && line > 0) {
+            abufAppend(ab, "        ", 8);
+        } else if (ec.show_line_numbers) {
             char line_num[16];
             snprintf(line_num, sizeof(line_num), "%7d ", file_row + 1);
             abufAppend(ab, "\x1b[34m", 5);  // Blue color
@@ -2118,61 +8308,33 @@ void editorDrawRows(struct a_buf* ab) {
 
         if (file_row >= ec.num_rows) {
             abufAppend(ab, "~", 1);
+            used++;
+            file_row++;
+        } else if (!ec.soft_wrap) {
+            used += editorDrawRowPart(ab, &ec.row[file_row], ec.col_offset, ec.col_offset + width);
+            file_row++;
         } else {
             editor_row* row = &ec.row[file_row];
-            int len = row->render_size - ec.col_offset;
-            if (len < 0) len = 0;
-            
-            int max_len = ec.screen_cols - (ec.show_line_numbers ? 8 : 0);
-            if (len > max_len) len = max_len;
-
-            char* c = &row->render[ec.col_offset];
-            unsigned char* hl = &row->highlight[ec.col_offset];
-            int current_pos = 0;
-
-            for (int j = 0; j < len; j++) {
-                // Handle column marker if enabled
-                if (ec.column_marker > 0 && 
-                    (j + ec.col_offset) == ec.column_marker - 1) {
-                    abufAppend(ab, "\x1b[38;5;242m|\x1b[m", 13);
-                    current_pos++;
-                    continue;
-                }
-
-                // Draw regular character
-                if (iscntrl(c[j])) {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    abufAppend(ab, "\x1b[7m", 4);
-                    abufAppend(ab, &sym, 1);
-                    abufAppend(ab, "\x1b[m", 3);
-                } else {
-                    int color = editorSyntaxToColor(hl[j]);
-                    char colbuf[16];
-                    snprintf(colbuf, sizeof(colbuf), "\x1b[%dm", color);
-                    abufAppend(ab, colbuf, strlen(colbuf));
-                    abufAppend(ab, &c[j], 1);
-                }
-                current_pos++;
-            }
-
-            // Draw column marker after content if needed
-            if (ec.column_marker > 0 && 
-                ec.column_marker > ec.col_offset + current_pos &&
-                ec.column_marker - ec.col_offset < max_len) {
-                while (current_pos < ec.column_marker - ec.col_offset - 1) {
-                    abufAppend(ab, " ", 1);
-                    current_pos++;
-                }
-                abufAppend(ab, "\x1b[38;5;242m|\x1b[m", 13);
+            int next = rowWrapNext(row, start, ec.wrap.width);
+            used += editorDrawRowPart(ab, row, start, ++line < row->wrap_lines ? next : start + ec.wrap.width);
+            start = next;
+            if (line >= row->wrap_lines) {
+                file_row++;
+                line = 0;
+                start = 0;
             }
         }
 
-        abufAppend(ab, "\x1b[K", 3);  // Clear to end of line
-        abufAppend(ab, "\r\n", 2);
+        if (to_edge) {
+            abufAppend(ab, "\x1b[m\x1b[K", 6);  // Clear to end of line
+        } else {
+            abufAppend(ab, "\x1b[m", 3);
+            for (; used < ec.screen_cols; used++)
+                abufAppend(ab, " ", 1);
+        }
     }
 }
 
-
 void editorClearScreen() {
     // Writing 4 bytes out to the terminal:
     // - (1 byte) \x1b : escape character
@@ -2202,8 +8364,10 @@ char* editorPrompt(char* prompt, void (*callback)(char*, int)) {
 
         int c = editorReadKey();
         if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-            if (buf_len != 0)
-                buf[--buf_len] = '\0';
+            // A whole UTF-8 sequence
+            while (buf_len != 0 && (buf[--buf_len] & 0xc0) == 0x80)
+                ;
+            buf[buf_len] = '\0';
         } else if (c == '\x1b') {
             editorSetStatusMessage("");
             if (callback)
@@ -2217,7 +8381,7 @@ char* editorPrompt(char* prompt, void (*callback)(char*, int)) {
                     callback(buf, c);
                 return buf;
             }
-        } else if (!iscntrl(c) && isprint(c)) {
+        } else if ((c >= 0x80 && c < 0x100) || (!iscntrl(c) && isprint(c))) {
             if (buf_len == buf_size - 1) {
                 buf_size *= 2;
                 buf = realloc(buf, buf_size);
@@ -2233,11 +8397,14 @@ char* editorPrompt(char* prompt, void (*callback)(char*, int)) {
 
 void editorMoveCursor(int key) {
     editor_row* row = (ec.cursor_y >= ec.num_rows) ? NULL : &ec.row[ec.cursor_y];
+    int len;
 
+    // Left and right go a whole cluster, up and down keep the screen
+    // column.
     switch (key) {
         case ARROW_LEFT:
             if (ec.cursor_x > 0) {
-                ec.cursor_x--;
+                ec.cursor_x = row ? rowCluster(row, ec.cursor_x - 1, &len) : ec.cursor_x - 1;
             } else if (ec.cursor_y > 0) {
                 ec.cursor_y--;
                 ec.cursor_x = ec.row[ec.cursor_y].size;
@@ -2245,7 +8412,7 @@ void editorMoveCursor(int key) {
             break;
         case ARROW_RIGHT:
             if (row && ec.cursor_x < row->size) {
-                ec.cursor_x++;
+                ec.cursor_x = rowCluster(row, ec.cursor_x, &len) + len;
             } else if (row && ec.cursor_x == row->size && ec.cursor_y < ec.num_rows - 1) {
                 ec.cursor_y++;
                 ec.cursor_x = 0;
@@ -2253,12 +8420,16 @@ void editorMoveCursor(int key) {
             break;
         case ARROW_UP:
             if (ec.cursor_y > 0) {
+                int rx = row ? editorRowCursorXToRenderX(row, ec.cursor_x) : 0;
                 ec.cursor_y--;
+                ec.cursor_x = editorRowRenderXToCursorX(&ec.row[ec.cursor_y], rx);
             }
             break;
         case ARROW_DOWN:
             if (ec.cursor_y < ec.num_rows - 1) {
+                int rx = editorRowCursorXToRenderX(row, ec.cursor_x);
                 ec.cursor_y++;
+                ec.cursor_x = editorRowRenderXToCursorX(&ec.row[ec.cursor_y], rx);
             }
             break;
         case HOME_KEY:
@@ -2268,14 +8439,15 @@ void editorMoveCursor(int key) {
         case END_KEY:
             if (row) {
                 ec.cursor_x = row->size;
+                int rx = editorRowCursorXToRenderX(row, ec.cursor_x);
                 if (ec.show_line_numbers) {
                     int width = ec.screen_cols - 8;  // Account for line numbers
-                    if (ec.cursor_x > width) {
-                        ec.col_offset = ec.cursor_x - width + 1;
+                    if (rx > width) {
+                        ec.col_offset = rx - width + 1;
                     }
                 } else {
-                    if (ec.cursor_x > ec.screen_cols) {
-                        ec.col_offset = ec.cursor_x - ec.screen_cols + 1;
+                    if (rx > ec.screen_cols) {
+                        ec.col_offset = rx - ec.screen_cols + 1;
                     }
                 }
             }
@@ -2301,6 +8473,8 @@ void editorMoveCursor(int key) {
     int row_len = row ? row->size : 0;
     if (ec.cursor_x > row_len) {
         ec.cursor_x = row_len;
+    } else if (row && ec.cursor_x < row_len) {
+        ec.cursor_x = rowCluster(row, ec.cursor_x, &len);
     }
 }
 
@@ -2325,13 +8499,21 @@ void editorProcessKeypress() {
             makeAction(NewLine, NULL);
             break;
         case CTRL_KEY('q'):
-            if (ec.dirty && quit_times > 0) {
-                editorSetStatusMessage("Warning! File has unsaved changes. Press Ctrl-Q %d more time%s to quit", quit_times, quit_times > 1 ? "s" : "");
+            if (serverLeave())
+                break;
+            saveWait();
+            int modified = bufferModified();
+            if (modified && quit_times > 0) {
+                if (modified == 1 && ec.dirty)
+                    editorSetStatusMessage("Warning! File has unsaved changes. Press Ctrl-Q %d more time%s to quit", quit_times, quit_times > 1 ? "s" : "");
+                else
+                    editorSetStatusMessage("Warning! %d file%s unsaved changes. Press Ctrl-Q %d more time%s to quit", modified, modified > 1 ? "s have" : " has", quit_times, quit_times > 1 ? "s" : "");
                 quit_times--;
                 return;
             }
             editorClearScreen();
-            freeAlist();
+            bufferDiscard();
+            undoFree();
             consoleBufferClose();
             exit(0);
             break;
@@ -2373,6 +8555,9 @@ void editorProcessKeypress() {
             }
             break;
         case CTRL_KEY('p'):
+            if (serverLeave())
+                break;
+            journalFlush();
             consoleBufferClose();
             kill(0, SIGTSTP);
             break;
@@ -2388,6 +8573,10 @@ void editorProcessKeypress() {
         case PAGE_UP:
         case PAGE_DOWN:
             { // You can't declare variables directly inside a switch statement.
+                if (ec.soft_wrap) {
+                    wrapPage(c);
+                    break;
+                }
                 if (c == PAGE_UP)
                     ec.cursor_y = ec.row_offset;
                 else if (c == PAGE_DOWN)
@@ -2421,20 +8610,19 @@ void editorProcessKeypress() {
             break;
 
         case BACKSPACE:
-            if(ec.cursor_x == 0 && ec.cursor_y == 0) break;
-            if (c == DEL_KEY)
-                editorMoveCursor(ARROW_RIGHT);
-            editor_row* row = &ec.row[ec.cursor_y];
-            char* string = ec.cursor_x > 0 ? strndup(&row->chars[ec.cursor_x-1], 1) : NULL;
-            makeAction(DelChar, string);
-            break;
         case DEL_KEY:
             {
                 if(ec.cursor_x == 0 && ec.cursor_y == 0) break;
                 if (c == DEL_KEY)
                     editorMoveCursor(ARROW_RIGHT);
+                // The cluster before the cursor goes whole.
                 editor_row* row = &ec.row[ec.cursor_y];
-                char* string = ec.cursor_x > 0 ? strndup(&row->chars[ec.cursor_x-1], 1) : NULL;
+                char* string = NULL;
+                if (ec.cursor_x > 0) {
+                    int len;
+                    int start = rowCluster(row, ec.cursor_x - 1, &len);
+                    string = strndup(&row->chars[start], ec.cursor_x - start);
+                }
                 makeAction(DelChar, string);
             }
             break;
@@ -2446,19 +8634,67 @@ void editorProcessKeypress() {
 		case CTRL_KEY('b'): // Ctrl+L to toggle line numbers
     ec.show_line_numbers = !ec.show_line_numbers;
     editorSetStatusMessage("Line numbers %s", ec.show_line_numbers ? "enabled" : "disabled");
+    break;
+
+		case CTRL_KEY('o'): // Ctrl+O to toggle soft wrap
+    ec.soft_wrap = !ec.soft_wrap;
+    ec.wrap_offset = 0;
+    editorSetStatusMessage("Soft wrap %s", ec.soft_wrap ? "enabled" : "disabled");
+    break;
+
+		case CTRL_KEY('a'): // Ctrl+A to show the next file
+    bufferNext();
+    break;
+
+		case CTRL_KEY('u'): // Ctrl+U to open another file
+    bufferOpen();
+    break;
+
+		case CTRL_KEY('_'): // Ctrl+_ (Ctrl+/) to split, one pane above the other
+    paneSplit(false);
+    break;
+
+		case CTRL_KEY('\\'): // Ctrl+\ to split, panes side by side
+    paneSplit(true);
+    break;
+
+		case CTRL_KEY(']'): // Ctrl+] to move to the next pane
+    paneNext();
+    break;
+
+		case CTRL_KEY('^'): // Ctrl+^ (Ctrl+6) to close the pane
+    paneClose();
     break;
 
         case CTRL_KEY('l'):
+            break;
         case '\x1b': // Escape key
+            ollamaCancel();
+            break;
+        case CTRL_KEY('k'):
+            ec.search_flags ^= SEARCH_IGNORE_CASE;
+            editorSetStatusMessage("Case-insensitive search %s",
+                (ec.search_flags & SEARCH_IGNORE_CASE) ? "enabled" : "disabled");
+            break;
+        case CTRL_KEY('t'):
+            ec.search_flags ^= SEARCH_REGEX;
+            editorSetStatusMessage("Regular expression search %s",
+                (ec.search_flags & SEARCH_REGEX) ? "enabled" : "disabled");
             break;
         case CTRL_KEY('z'):
-            undo();
+            while (undo() && ec.undo.current > 0)
+                ;
             break;
         case CTRL_KEY('y'):
-            redo();
+            while (redo())
+                ;
             break;
         default:
-            makeAction(InsertChar, strndup((char*) &c, 1));
+            {
+                char seq[4];
+                int len = editorReadUtf8(c, seq);
+                makeAction(InsertChar, strndup(seq, len));
+            }
             break;
     }
 
@@ -2482,8 +8718,17 @@ void editorDisplayHelpPage() {
 	printf("Ctrl-N        Forward Search by pattern after Ctrl-F. Esc - exit from Search, works after Ctrl-F only\r\n");
 	printf("Ctrl-R        Backward Search by pattern after Ctrl-F. Esc - exit from Search, Enter and Arrows to interact\r\n");
 	printf("Ctrl-J        Global replacement of сharacter combinations, Input Search and Replace patterns, Esc to cancel, Enter to input\r\n");
+	printf("Ctrl-K        Toggle case-insensitive search for Ctrl-F, Ctrl-N, Ctrl-R and Ctrl-J\r\n");
+	printf("Ctrl-T        Toggle regular expression search and replace (\\1..\\9 insert groups in Ctrl-J replacements)\r\n");
 	printf("Ctrl-G        Go to line Number, requires input the line number\r\n");
 	printf("Ctrl-B        Hide/Show line numbering\r\n");
+	printf("Ctrl-O        Soft wrap long lines on/off\r\n");
+	printf("Ctrl-A        Show the next open file\r\n");
+	printf("Ctrl-U        Open another file, requires input of file name\r\n");
+	printf("Ctrl-_        Split the screen, one pane above the other (Ctrl-/ on most terminals)\r\n");
+	printf("Ctrl-\\        Split the screen, panes side by side\r\n");
+	printf("Ctrl-]        Move to the next pane\r\n");
+	printf("Ctrl-^        Close the pane (Ctrl-6 on most terminals)\r\n");
     printf("Ctrl-E        Flip line upwards\r\n");
     printf("Ctrl-D        Flip line downwards\r\n");
     printf("Ctrl-C        Copy line\r\n");
@@ -2510,8 +8755,19 @@ void editorDisplayHelpPage() {
     printf("-h | --help                                     Prints the help\r\n");
     printf("-v | --version                                  Prints the version of mel\r\n");
 	printf("-b | --backup                                   Create backup (.bak) file before saving\r\n");
+	printf("-k | --keep-backups <count>                     Backups to keep, older ones as .bak.1 and up (implies -b)\r\n");
+	printf("-a | --autosave <seconds>                       Save to a swap file (.name.mel-swap) this often while modified\r\n");
+	printf("-m | --max-input <bytes>                        Keep only the last bytes of piped input, K/M/G suffixes\r\n");
+	printf("-f | --follow                                   Follow the file as it grows, like tail -f\r\n");
+	printf("-i | --ignore-case                              Case-insensitive search and replace\r\n");
+	printf("-r | --regex                                    Regular expression search and replace\r\n");
 	printf("-l | --line  <number> <file_name>               Open file with cursor on specified line number\r\n");
 	printf("-w | --width <columns>                          Set visual column width marker\r\n");
+	printf("-s | --soft-wrap                                Wrap long lines at the screen edge\r\n");
+	printf("-j | --jobs <threads>                           Threads used to search large files (default: CPU count)\r\n");
+	printf("-u | --undo-budget <bytes>                      Memory kept for undo history, K/M/G suffixes (default: 8M)\r\n");
+	printf("--server [file_name ...]                        Keep files open in the background, mel on a terminal attaches to it\r\n");
+	printf("--batch <script> <file_name ...>                Edit the files with the commands in script, without a terminal\r\n");
     printf("-----------------------------------------\r\n");
     printf("Supports highlighting for C,C++,Java,Bash,Mshell,Python,PHP,Javascript,JSON,XML,SQL,Ruby,Go.\r\n");
 	printf("License: Public domain libre software GPL3,v.0.2.0, 2025\r\n");
@@ -2573,53 +8829,213 @@ int readOllamaConfig(const char *config_path) {
     return (ollama_config.api_url[0] != '\0' && ollama_config.model[0] != '\0');
 }
 
-char* callOllamaAPI(const char* prompt) {
-    CURL *curl;
-    CURLcode res;
-    struct a_buf response = ABUF_INIT;
-    char* output = NULL;
+// A request to Ollama in flight. The response streams back as lines of
+// JSON, one per few tokens, added to the end of the buffer it was asked
+// in as they arrive, from editorIdle(), while editing goes on.
+struct ollama_stream {
+    CURLM* multi;               // NULL if there is no request
+    CURL* curl;
+    struct curl_slist* headers;
+    json_object* request;
+    int buffer;                 // Buffer the response goes to
+    struct a_buf pending;       // Bytes received, not yet a whole line
+    bool started;               // Text was inserted
+    size_t undo_end;            // End of the undo log after the text inserted
+    bool done;                  // The last line came
+    char* error;                // Error sent back instead of a response
+} ollama;
+
+// Adds text to the end of the buffer, the first of it on a new line.
+// Each piece is an undo record of its own, joined to the one before
+// when nothing was edited in between, so Ctrl-Z undoes the response at
+// once. A cursor at the end follows the text, elsewhere it stays.
+static void ollamaInsert(const char* text) {
+    if (*text == '\0')
+        return;
+    int cursor_x = ec.cursor_x;
+    int cursor_y = ec.cursor_y;
+    bool follow = cursor_y >= ec.num_rows ||
+        (cursor_y == ec.num_rows - 1 && cursor_x == ec.row[cursor_y].size);
+
+    transactionBegin();
+    if (ollama.started && ec.num_rows > 0) {
+        if (ec.undo.len == ollama.undo_end && ec.undo.current == ec.undo.len)
+            transactionJoin();
+        ec.cursor_y = ec.num_rows - 1;
+        ec.cursor_x = ec.row[ec.cursor_y].size;
+        transactionSaveRows(ec.cursor_y, 1);
+    } else {
+        ec.cursor_y = ec.num_rows;
+        ec.cursor_x = 0;
+        transactionSaveRows(ec.cursor_y, 0);
+        makeAction(NewLine, NULL);
+        ollama.started = true;
+    }
+    while (*text) {
+        size_t len = strcspn(text, "\n");
+        if (len > 0)
+            makeAction(InsertChar, strndup(text, len));
+        if (text[len] == '\0')
+            break;
+        makeAction(NewLine, NULL);
+        text += len + 1;
+    }
+    transactionCommit();
+    ollama.undo_end = ec.undo.len;
 
-    curl = curl_easy_init();
-    if(curl) {
-        json_object *request_json = json_object_new_object();
-        json_object_object_add(request_json, "model", json_object_new_string(ollama_config.model));
-        json_object_object_add(request_json, "prompt", json_object_new_string(prompt));
-        json_object_object_add(request_json, "stream", json_object_new_boolean(0));
+    if (!follow) {
+        ec.cursor_x = cursor_x;
+        ec.cursor_y = cursor_y;
+    }
+}
 
-        const char* json_str = json_object_to_json_string(request_json);
+// Inserts the text of the whole lines received, and of the last one
+// too when the transfer is over. Returns true if any text came.
+static bool ollamaStreamLines(bool last) {
+    struct a_buf* pending = &ollama.pending;
+    bool inserted = false;
+    int start = 0;
+    while (start < pending->len && !ollama.done) {
+        char* line = pending->buf + start;
+        char* nl = memchr(line, '\n', pending->len - start);
+        if (!nl && !last)
+            break;
+        int len = nl ? nl - line : pending->len - start;
+        line[len] = '\0';
+        start += len + (nl ? 1 : 0);
+
+        json_object* parsed = json_tokener_parse(line);
+        json_object* field;
+        if (!parsed)
+            continue;
+        if (json_object_object_get_ex(parsed, "response", &field)) {
+            const char* text = json_object_get_string(field);
+            if (text && *text) {
+                ollamaInsert(text);
+                inserted = true;
+            }
+        }
+        if (json_object_object_get_ex(parsed, "error", &field) && !ollama.error)
+            ollama.error = strdup(json_object_get_string(field));
+        if (json_object_object_get_ex(parsed, "done", &field))
+            ollama.done = json_object_get_boolean(field);
+        json_object_put(parsed);
+    }
+    memmove(pending->buf, pending->buf + start, pending->len - start);
+    pending->len -= start;
+    return inserted;
+}
 
-        struct curl_slist *headers = NULL;
-        headers = curl_slist_append(headers, "Content-Type: application/json");
+// Ends the request, telling how it went. A response that came to its
+// end gets the line after it, as typed text would.
+static void ollamaFinish(CURLcode result, bool cancelled) {
+    if (!cancelled && ollama.started && ec.num_rows > 0 && ec.row[ec.num_rows - 1].size > 0)
+        ollamaInsert("\n");
+    if (cancelled)
+        editorSetStatusMessage("Ollama response stopped");
+    else if (result != CURLE_OK)
+        editorSetStatusMessage("Ollama API call failed: %s", curl_easy_strerror(result));
+    else if (ollama.error)
+        editorSetStatusMessage("Ollama API call failed: %s", ollama.error);
+    else if (ollama.started)
+        editorSetStatusMessage("Ollama response inserted");
+    else
+        editorSetStatusMessage("Ollama sent no response");
+
+    curl_multi_remove_handle(ollama.multi, ollama.curl);
+    curl_easy_cleanup(ollama.curl);
+    curl_multi_cleanup(ollama.multi);
+    curl_slist_free_all(ollama.headers);
+    json_object_put(ollama.request);
+    abufFree(&ollama.pending);
+    free(ollama.error);
+    ollama = (struct ollama_stream) {.multi = NULL, .pending = ABUF_INIT};
+}
 
-        curl_easy_setopt(curl, CURLOPT_URL, ollama_config.api_url);
-        curl_easy_setopt(curl, CURLOPT_POST, 1L);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_str);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+// Sends the prompt, the response is read from editorIdle().
+static void ollamaStart(const char* prompt) {
+    CURLM* multi = curl_multi_init();
+    CURL* curl = curl_easy_init();
+    if (!multi || !curl) {
+        editorSetStatusMessage("Ollama API call failed: can't start the request");
+        if (curl) curl_easy_cleanup(curl);
+        if (multi) curl_multi_cleanup(multi);
+        return;
+    }
 
-        res = curl_easy_perform(curl);
-        if(res != CURLE_OK) {
-            editorSetStatusMessage("Ollama API call failed: %s", curl_easy_strerror(res));
-        } else {
-            json_object *parsed_json = json_tokener_parse(response.buf);
-            json_object *response_obj;
-            if (json_object_object_get_ex(parsed_json, "response", &response_obj)) {
-                output = strdup(json_object_get_string(response_obj));
-            }
-            json_object_put(parsed_json);
-        }
+    ollama = (struct ollama_stream) {.multi = multi, .curl = curl, .pending = ABUF_INIT};
+    ollama.buffer = buffers.current;
+    ollama.request = json_object_new_object();
+    json_object_object_add(ollama.request, "model", json_object_new_string(ollama_config.model));
+    json_object_object_add(ollama.request, "prompt", json_object_new_string(prompt));
+    json_object_object_add(ollama.request, "stream", json_object_new_boolean(1));
+    ollama.headers = curl_slist_append(NULL, "Content-Type: application/json");
+
+    curl_easy_setopt(curl, CURLOPT_URL, ollama_config.api_url);
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_object_to_json_string(ollama.request));
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, ollama.headers);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &ollama.pending);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_multi_add_handle(multi, curl);
+
+    // The response shows up at the end of the buffer.
+    ec.cursor_y = ec.num_rows;
+    ec.cursor_x = 0;
+    editorSetStatusMessage("Waiting for Ollama... (ESC to stop)");
+}
 
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
-        json_object_put(request_json);
-        abufFree(&response);
+// Goes on with the transfer and inserts what came, into the buffer the
+// response goes to even if another one is shown. Returns whether the
+// screen has to be drawn again.
+bool ollamaIdle() {
+    if (!ollama.multi)
+        return false;
+
+    int running = 0;
+    curl_multi_perform(ollama.multi, &running);
+    CURLcode result = CURLE_OK;
+    CURLMsg* msg;
+    int queued;
+    while ((msg = curl_multi_info_read(ollama.multi, &queued)))
+        if (msg->msg == CURLMSG_DONE)
+            result = msg->data.result;
+
+    // ollamaFinish() clears ollama, buffer with it.
+    int shown = buffers.current;
+    int target = ollama.buffer;
+    if (shown != target) {
+        bufferStore();
+        bufferRestore(target);
+    }
+    bool redraw = ollamaStreamLines(!running);
+    if (!running || ollama.done) {
+        ollamaFinish(result, false);
+        redraw = true;
     }
+    if (shown != target) {
+        bufferStore();
+        bufferRestore(shown);
+        return !ollama.multi;   // Only the status bar is shown
+    }
+    return redraw;
+}
 
-    return output;
+// Stops the response coming, keeping what came. Returns false if none is.
+bool ollamaCancel() {
+    if (!ollama.multi)
+        return false;
+    ollamaFinish(CURLE_OK, true);
+    return true;
 }
 
 void editorInsertOllamaResponse() {
+    if (ollama.multi) {
+        editorSetStatusMessage("Ollama is still answering, ESC to stop it");
+        return;
+    }
+
     static char* config_path = NULL;
     if (!config_path) {
         config_path = malloc(PATH_MAX);
@@ -2634,25 +9050,8 @@ void editorInsertOllamaResponse() {
     char* prompt = editorPrompt("Ollama Prompt: %s (ESC to cancel)", NULL);
     if (!prompt) return;
 
-    ec.cursor_y = ec.num_rows;
-    ec.cursor_x = 0;
-
-    char* response = callOllamaAPI(prompt);
+    ollamaStart(prompt);
     free(prompt);
-
-    if (response) {
-        makeAction(NewLine, NULL);
-        
-        char *line, *saveptr;
-        for (line = strtok_r(response, "\n", &saveptr); line != NULL; 
-             line = strtok_r(NULL, "\n", &saveptr)) {
-            makeAction(InsertChar, strndup(line, strlen(line)));
-            makeAction(NewLine, NULL);
-        }
-        
-        free(response);
-        editorSetStatusMessage("Ollama response inserted");
-    }
 }
 
 /*** Init section ***/
@@ -2664,28 +9063,57 @@ void initEditor() {
     ec.row_offset = 0;
     ec.col_offset = 0; // Ensure line number padding
     ec.num_rows = 0;
+    ec.row_cap = 0;
     ec.row = NULL;
     ec.dirty = 0;
 	ec.show_line_numbers = 1; // Show line numbers by default
+    ec.soft_wrap = 0;
+    ec.wrap_offset = 0;
+    ec.wrap = (struct wrap_index) {NULL, -1, 0, 0};
 	ec.create_backup = 0;  // Initialize backup flag
+    ec.keep_backups = 1;
+    ec.autosave = 0;
+    ec.follow = 0;
+    ec.dropped_rows = 0;
+    ec.compression = COMPRESS_NONE;
+    ec.compression_level = 0;
 	ec.line_number_offset = 0;  // Initialize the line number offset
 	ec.column_marker = 0;  // No column marker by default
     ec.file_name = NULL;
     ec.status_msg[0] = '\0';
     ec.status_msg_time = 0;
     ec.copied_char_buffer = NULL;
+    ec.search_flags = 0;
+    ec.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    ec.search_query = NULL;
+    ec.search_total = 0;
+    ec.search_stale = 0;
+    ec.search_current = 0;
+    ec.search_sums = (struct match_sums) {NULL, -1, 0};
+    ec.search_match_row = -1;
+    ec.search_match_col = 0;
     ec.syntax = NULL;
-    ec.actions = actionListInit();
-    if (!ec.actions) {
-        die("Failed to initialize actions list");
-    }
-
-    // Get the window size first
-    if (getWindowSize(&ec.screen_rows, &ec.screen_cols) == -1) {
-        die("Failed to get window size");
+    ec.undo = (struct undo_log) {0};
+    ec.undo.budget = UNDO_BUDGET_DEFAULT;
+    ec.undo.clean = 0;
+    ec.undo.saving = UNDO_NOT_CLEAN;
+    ec.transaction = NULL;
+    ec.transaction_depth = 0;
+
+    // Get the window size first, the server gets it when a terminal
+    // attaches and batch edits need none
+    if (getWindowSize(&ec.window_rows, &ec.window_cols) == -1) {
+        if (!server.enabled && !batch.enabled)
+            die("Failed to get window size");
+        ec.window_rows = 24;
+        ec.window_cols = 80;
     }
     // Make room for status bar and message bar
-    ec.screen_rows -= 2;
+    ec.window_rows -= 2;
+    ec.screen_rows = ec.window_rows;
+    ec.screen_cols = ec.window_cols;
+    ec.screen_top = 0;
+    ec.screen_left = 0;
 
     // Create initial empty row - this is crucial for empty documents
     // editorInsertRow(0, "", 0);
@@ -2695,6 +9123,8 @@ void initEditor() {
 
     // Set up signal handlers
     signal(SIGWINCH, editorHandleSigwinch);
+    // A compressor that dies makes writes to it fail instead.
+    signal(SIGPIPE, SIG_IGN);
     signal(SIGCONT, editorHandleSigcont);
 }
 
@@ -2708,8 +9138,17 @@ void printHelp() {
 	printf("Ctrl-N        Forward Search by pattern after Ctrl-F. Esc - exit from Search, works after Ctrl-F only\n");
 	printf("Ctrl-R        Backward Search by pattern after Ctrl-F. Esc - exit from Search, works after Ctrl-F only\n");
     printf("Ctrl-J        Global replacement of сharacter combinations, Input Search and Replace patterns, Esc to cancel, Enter to input\n");
+    printf("Ctrl-K        Toggle case-insensitive search for Ctrl-F, Ctrl-N, Ctrl-R and Ctrl-J\n");
+    printf("Ctrl-T        Toggle regular expression search and replace (\\1..\\9 insert groups in Ctrl-J replacements)\n");
 	printf("Ctrl-G        Go to line Number, requires input the line number\r\n");
 	printf("Ctrl-B        Hide/Show line numbering\n");
+	printf("Ctrl-O        Soft wrap long lines on/off\n");
+	printf("Ctrl-A        Show the next open file\n");
+	printf("Ctrl-U        Open another file, requires input of file name\n");
+	printf("Ctrl-_        Split the screen, one pane above the other (Ctrl-/ on most terminals)\n");
+	printf("Ctrl-\\        Split the screen, panes side by side\n");
+	printf("Ctrl-]        Move to the next pane\n");
+	printf("Ctrl-^        Close the pane (Ctrl-6 on most terminals)\n");
 	printf("Ctrl-E        Flip line upwards\n");
     printf("Ctrl-D        Flip line downwards\n");
     printf("Ctrl-C        Copy line\n");
@@ -2734,8 +9173,19 @@ void printHelp() {
     printf("-h | --help                                     Prints the help\n");
     printf("-v | --version                                  Prints the version of mel\n");
 	printf("-b | --backup                                   Create backup (.bak) file before saving\n");
+	printf("-k | --keep-backups <count>                     Backups to keep, older ones as .bak.1 and up (implies -b)\n");
+	printf("-a | --autosave <seconds>                       Save to a swap file (.name.mel-swap) this often while modified\n");
+	printf("-m | --max-input <bytes>                        Keep only the last bytes of piped input, K/M/G suffixes\n");
+	printf("-f | --follow                                   Follow the file as it grows, like tail -f\n");
+	printf("-i | --ignore-case                              Case-insensitive search and replace\n");
+	printf("-r | --regex                                    Regular expression search and replace\n");
 	printf("-l | --line  <number> <file_name>               Open file with cursor on specified line number\n");
 	printf("-w | --width <columns>                          Set visual column width marker\n");
+	printf("-s | --soft-wrap                                Wrap long lines at the screen edge\n");
+	printf("-j | --jobs <threads>                           Threads used to search large files (default: CPU count)\n");
+	printf("-u | --undo-budget <bytes>                      Memory kept for undo history, K/M/G suffixes (default: 8M)\n");
+	printf("--server [file_name ...]                        Keep files open in the background, mel on a terminal attaches to it\n");
+	printf("--batch <script> <file_name ...>                Edit the files with the commands in script, without a terminal\n");
 	printf("-------------------------------------\n");
 	printf("Supports highlighting for C,C++,Java,Bash,Mshell,Python,PHP,Javascript,JSON,XML,SQL,Ruby,Go\n");
 	printf("License: Public domain libre software GPL3,v.0.2.0, 2025\n");
@@ -2745,6 +9195,26 @@ void printHelp() {
 
 // > 0 if editor should load a file, 0 otherwise and -1 if the program should exit
 // Modify handleArgs to separate option processing from file handling
+// Parses a size in bytes with an optional K, M or G suffix.
+static bool parseSize(const char* s, size_t* size) {
+    char* end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno || end == s || *s == '-')
+        return false;
+    switch (toupper((unsigned char) *end)) {
+        case 'G': v <<= 10; // fall through
+        case 'M': v <<= 10; // fall through
+        case 'K': v <<= 10; end++; break;
+        case '\0': break;
+        default: return false;
+    }
+    if (*end != '\0')
+        return false;
+    *size = v;
+    return true;
+}
+
 int handleArgs(int argc, char* argv[]) {
     if (argc == 1) {
         return 0;
@@ -2760,6 +9230,49 @@ int handleArgs(int argc, char* argv[]) {
             return -1;
         } else if (strncmp("-b", argv[i], 2) == 0 || strncmp("--backup", argv[i], 8) == 0) {
             ec.create_backup = 1;
+        } else if (strncmp("-k", argv[i], 2) == 0 || strncmp("--keep-backups", argv[i], 14) == 0) {
+            if (i + 1 >= argc) {
+                printf("[ERROR] Number of backups must be specified\n");
+                return -1;
+            }
+            int keep = atoi(argv[i + 1]);
+            if (keep < 1) {
+                printf("[ERROR] Number of backups must be positive\n");
+                return -1;
+            }
+            ec.create_backup = 1;
+            ec.keep_backups = keep;
+            i++; // Skip the number of backups
+        } else if (strncmp("-a", argv[i], 2) == 0 || strncmp("--autosave", argv[i], 10) == 0) {
+            if (i + 1 >= argc) {
+                printf("[ERROR] Autosave interval must be specified\n");
+                return -1;
+            }
+            int seconds = atoi(argv[i + 1]);
+            if (seconds < 1) {
+                printf("[ERROR] Autosave interval must be positive\n");
+                return -1;
+            }
+            ec.autosave = seconds;
+            i++; // Skip the autosave interval
+        } else if (strncmp("-m", argv[i], 2) == 0 || strncmp("--max-input", argv[i], 11) == 0) {
+            if (i + 1 >= argc) {
+                printf("[ERROR] Input size must be specified\n");
+                return -1;
+            }
+            if (!parseSize(argv[i + 1], &stream.max)) {
+                printf("[ERROR] Input size must be a size in bytes, like 512K or 64M\n");
+                return -1;
+            }
+            i++; // Skip the input size
+        } else if (strncmp("-f", argv[i], 2) == 0 || strncmp("--follow", argv[i], 8) == 0) {
+            ec.follow = 1;
+        } else if (strncmp("-s", argv[i], 2) == 0 || strncmp("--soft-wrap", argv[i], 11) == 0) {
+            ec.soft_wrap = 1;
+        } else if (strncmp("-i", argv[i], 2) == 0 || strncmp("--ignore-case", argv[i], 13) == 0) {
+            ec.search_flags |= SEARCH_IGNORE_CASE;
+        } else if (strncmp("-r", argv[i], 2) == 0 || strncmp("--regex", argv[i], 7) == 0) {
+            ec.search_flags |= SEARCH_REGEX;
         } else if (strncmp("-w", argv[i], 2) == 0 || strncmp("--width", argv[i], 7) == 0) {
             if (i + 1 >= argc) {
                 printf("[ERROR] Column width value must be specified\n");
@@ -2772,6 +9285,28 @@ int handleArgs(int argc, char* argv[]) {
             }
             ec.column_marker = width;
             i++; // Skip the width value
+        } else if (strncmp("-j", argv[i], 2) == 0 || strncmp("--jobs", argv[i], 6) == 0) {
+            if (i + 1 >= argc) {
+                printf("[ERROR] Number of jobs must be specified\n");
+                return -1;
+            }
+            int jobs = atoi(argv[i + 1]);
+            if (jobs < 1) {
+                printf("[ERROR] Number of jobs must be positive\n");
+                return -1;
+            }
+            ec.jobs = jobs;
+            i++; // Skip the number of jobs
+        } else if (strncmp("-u", argv[i], 2) == 0 || strncmp("--undo-budget", argv[i], 13) == 0) {
+            if (i + 1 >= argc) {
+                printf("[ERROR] Undo budget must be specified\n");
+                return -1;
+            }
+            if (!parseSize(argv[i + 1], &ec.undo.budget)) {
+                printf("[ERROR] Undo budget must be a size in bytes, like 512K or 64M\n");
+                return -1;
+            }
+            i++; // Skip the undo budget
         } else if (strncmp("-l", argv[i], 2) == 0 || strncmp("--line", argv[i], 6) == 0) {
             if (i + 1 >= argc) {
                 printf("[ERROR] Line number must be specified\n");
@@ -2784,12 +9319,249 @@ int handleArgs(int argc, char* argv[]) {
             }
             ec.cursor_y = start_line - 1;
             i++; // Skip the line number
+        } else if (strcmp("--batch", argv[i]) == 0) {
+            if (i + 1 >= argc) {
+                printf("[ERROR] Batch script must be specified\n");
+                return -1;
+            }
+            batch.script = argv[i + 1];
+            i++; // Skip the script
         }
     }
 
     return 1;
 }
 
+#ifdef MEL_BENCH
+/*** Benchmark section ***/
+
+// Syntax highlighting microbenchmark, built with `make bench`. For every
+// HL_DB entry it generates a typical source corpus, a log-like corpus and
+// two pathological ones (a single huge line and an unterminated multiline
+// comment at the top), then reports highlight throughput, the cost of
+// re-highlighting one row (what a keystroke pays) and memory per language.
+
+struct bench_buf {
+    char* buf;
+    size_t len;
+    size_t cap;
+};
+
+static void benchAppend(struct bench_buf* b, const char* s, size_t len) {
+    if (b->len + len + 1 > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (b->len + len + 1 > cap) cap *= 2;
+        char* new_buf = realloc(b->buf, cap);
+        if (!new_buf) die("Failed to allocate benchmark corpus");
+        b->buf = new_buf;
+        b->cap = cap;
+    }
+    memcpy(&b->buf[b->len], s, len);
+    b->len += len;
+    b->buf[b->len] = '\0';
+}
+
+static void benchAppendStr(struct bench_buf* b, const char* s) {
+    benchAppend(b, s, strlen(s));
+}
+
+static double benchNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Resident set size in KB, taken from /proc (0 where it isn't available).
+static long benchRssKb() {
+    long pages = 0, resident = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (!fp) return 0;
+    if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) resident = 0;
+    fclose(fp);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Returns the n-th keyword of the syntax (without the type marker) into
+// word, falling back to a plain identifier for keyword-less languages.
+static void benchKeyword(struct editor_syntax* syntax, int n, char* word, size_t size) {
+    int count = 0;
+    while (syntax->keywords[count]) count++;
+    if (count == 0) {
+        snprintf(word, size, "ident%d", n % 97);
+        return;
+    }
+    const char* kw = syntax->keywords[n % count];
+    int klen = strlen(kw);
+    if (klen > 0 && kw[klen - 1] == '|') klen--;
+    snprintf(word, size, "%.*s", klen, kw);
+}
+
+// One line of "typical" code: indentation, keywords, identifiers, numbers,
+// strings and now and then a comment. Comments are left out when the
+// line is part of a single huge row, as they would swallow the rest of it.
+static void benchTypicalLine(struct bench_buf* b, struct editor_syntax* syntax, int n,
+                             bool single_row) {
+    char word[64];
+    char tmp[128];
+
+    benchAppend(b, "\t", n % 3 ? 1 : 0);
+    benchKeyword(syntax, n, word, sizeof(word));
+    benchAppendStr(b, word);
+    snprintf(tmp, sizeof(tmp), " value_%d = (%d + 0x%x) * 3.14;", n % 1000, n, n & 0xff);
+    benchAppendStr(b, tmp);
+    benchKeyword(syntax, n * 7 + 3, word, sizeof(word));
+    snprintf(tmp, sizeof(tmp), " %s(\"item %d \\\"quoted\\\"\", 'c');", word, n);
+    benchAppendStr(b, tmp);
+
+    if (single_row) return;
+
+    if (n % 4 == 0 && syntax->singleline_comment_start) {
+        snprintf(tmp, sizeof(tmp), " %s note about line %d", syntax->singleline_comment_start, n);
+        benchAppendStr(b, tmp);
+    }
+    if (n % 50 == 0 && syntax->multiline_comment_start) {
+        snprintf(tmp, sizeof(tmp), " %s block comment\n spanning two rows %s",
+            syntax->multiline_comment_start, syntax->multiline_comment_end);
+        benchAppendStr(b, tmp);
+    }
+}
+
+static void benchLogLine(struct bench_buf* b, int n) {
+    static const char* levels[] = {"INFO", "DEBUG", "WARN", "ERROR"};
+    char tmp[256];
+    snprintf(tmp, sizeof(tmp),
+        "2025-02-01 %02d:%02d:%02d.%03d %s [worker-%d] request id=%08x took %dms "
+        "path=\"/api/v1/items/%d\" ip=10.%d.%d.%d",
+        (n / 3600) % 24, (n / 60) % 60, n % 60, n % 1000, levels[n % 4], n % 16,
+        n * 2654435761u, n % 977, n, n % 256, (n / 7) % 256, (n / 13) % 256);
+    benchAppendStr(b, tmp);
+}
+
+enum bench_corpus {
+    BENCH_TYPICAL,
+    BENCH_LOG,
+    BENCH_LONG_LINE,
+    BENCH_OPEN_COMMENT,
+    BENCH_CORPORA
+};
+
+static const char* bench_corpus_names[] = {"typical", "log", "long-line", "open-comment"};
+
+static void benchGenerate(struct bench_buf* b, struct editor_syntax* syntax,
+                          enum bench_corpus corpus, size_t target) {
+    b->len = 0;
+    if (corpus == BENCH_OPEN_COMMENT) {
+        benchAppendStr(b, syntax->multiline_comment_start);
+        benchAppendStr(b, " never closed\n");
+    }
+    for (int n = 0; b->len < target; n++) {
+        if (corpus == BENCH_LOG)
+            benchLogLine(b, n);
+        else
+            benchTypicalLine(b, syntax, n, corpus == BENCH_LONG_LINE);
+        // The long line corpus is a single row, everything else is split.
+        if (corpus == BENCH_LONG_LINE)
+            benchAppend(b, " ", 1);
+        else
+            benchAppend(b, "\n", 1);
+    }
+}
+
+static void benchLoadRows(struct bench_buf* b) {
+    char* p = b->buf;
+    char* end = b->buf + b->len;
+    while (p < end) {
+        char* nl = memchr(p, '\n', end - p);
+        size_t len = nl ? (size_t)(nl - p) : (size_t)(end - p);
+        editorInsertRow(ec.num_rows, p, len);
+        p += len + 1;
+    }
+}
+
+static void benchFreeRows() {
+    for (int i = 0; i < ec.num_rows; i++)
+        editorFreeRow(&ec.row[i]);
+    free(ec.row);
+    ec.row = NULL;
+    ec.num_rows = 0;
+    ec.row_cap = 0;
+}
+
+// Finishes the highlighting long rows leave to editorIdle(), so that it
+// is timed with the pass that deferred it.
+static void benchLexPending() {
+    while (ec.lex_pending) {
+        ec.lex_pending = false;
+        for (int i = 0; i < ec.num_rows; i++) {
+            editor_row* row = &ec.row[i];
+            if (row->chunks && editorRowLexTo(row, INT_MAX) && i + 1 < ec.num_rows)
+                editorUpdateSyntax(&ec.row[i + 1]);
+        }
+    }
+}
+
+int benchSyntax(int argc, char* argv[]) {
+    size_t mb = 10;
+    if (argc > 2 && atoi(argv[2]) > 0)
+        mb = atoi(argv[2]);
+    size_t target = mb * 1024 * 1024;
+
+    printf("mel %s syntax highlighting benchmark, %zu MB per corpus\n\n", MEL_VERSION, mb);
+    printf("%-8s %-13s %10s %9s %10s %9s %12s %10s %10s\n",
+        "lang", "corpus", "bytes", "rows", "full ms", "MB/s", "per-key us", "hl KB", "rss KB");
+
+    struct bench_buf corpus = {NULL, 0, 0};
+    for (unsigned int i = 0; i < HL_DB_ENTRIES; i++) {
+        struct editor_syntax* syntax = &HL_DB[i];
+        for (int c = 0; c < BENCH_CORPORA; c++) {
+            if (c == BENCH_OPEN_COMMENT && !syntax->multiline_comment_start) {
+                printf("%-8s %-13s %10s\n", syntax->file_type, bench_corpus_names[c], "n/a");
+                continue;
+            }
+            benchGenerate(&corpus, syntax, c, target);
+
+            // Rows are loaded without a syntax so that only the
+            // highlighting pass below is measured.
+            long rss_before = benchRssKb();
+            ec.syntax = NULL;
+            benchLoadRows(&corpus);
+            ec.syntax = syntax;
+
+            double start = benchNow();
+            editorApplySyntaxHighlight();
+            benchLexPending();
+            double full = benchNow() - start;
+
+            // Re-highlighting one row is what every keystroke pays.
+            editor_row* row = &ec.row[ec.num_rows / 2];
+            int iterations = row->render_size > (1 << 20) ? 5 : 200;
+            start = benchNow();
+            for (int k = 0; k < iterations; k++) {
+                editorUpdateRow(row);
+                benchLexPending();
+            }
+            double per_key = (benchNow() - start) / iterations;
+
+            size_t hl_bytes = 0;
+            for (int r = 0; r < ec.num_rows; r++)
+                hl_bytes += ec.row[r].render_size;
+            long rss = benchRssKb() - rss_before;
+
+            printf("%-8s %-13s %10zu %9d %10.1f %9.1f %12.1f %10zu %10ld\n",
+                syntax->file_type, bench_corpus_names[c], corpus.len, ec.num_rows,
+                full * 1e3, full > 0 ? corpus.len / full / (1024 * 1024) : 0.0,
+                per_key * 1e6, hl_bytes / 1024, rss > 0 ? rss : 0);
+            fflush(stdout);
+
+            benchFreeRows();
+        }
+    }
+    free(corpus.buf);
+    ec.syntax = NULL;
+    return 0;
+}
+#endif
+
 //int main(int argc, char* argv[]) {
   //  initEditor();
     //int arg_response = handleArgs(argc, argv);
@@ -2814,6 +9586,19 @@ int handleArgs(int argc, char* argv[]) {
 
 
 int main(int argc, char* argv[]) {
+#ifdef MEL_BENCH
+    // The benchmark runs without a terminal, so it has to go before initEditor().
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+        return benchSyntax(argc, argv);
+#endif
+    // The server and batch edits may start without a terminal,
+    // initEditor() has to know.
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--server") == 0)
+            server.enabled = true;
+        else if (strcmp(argv[i], "--batch") == 0)
+            batch.enabled = true;
+    }
     initEditor();
     
     // Process options first
@@ -2822,6 +9607,43 @@ int main(int argc, char* argv[]) {
         return 0;
     }
 
+    // Files named, in order, skipping option values
+    int num_files = 0;
+    char** files = malloc(sizeof(char*) * argc);
+    if (!files) die("Failed to allocate file list");
+    for (int i = 1; arg_response > 0 && i < argc; i++) {
+        if (argv[i][0] != '-') {
+            // Skip option values
+            if (i > 1 && (strncmp(argv[i-1], "-w", 2) == 0 || 
+                         strncmp(argv[i-1], "-l", 2) == 0 ||
+                         strncmp(argv[i-1], "-j", 2) == 0 ||
+                         strncmp(argv[i-1], "-u", 2) == 0 ||
+                         strncmp(argv[i-1], "-k", 2) == 0 ||
+                         strncmp(argv[i-1], "-a", 2) == 0 ||
+                         strncmp(argv[i-1], "-m", 2) == 0 ||
+                         strcmp(argv[i-1], "--width") == 0 ||
+                         strcmp(argv[i-1], "--line") == 0 ||
+                         strcmp(argv[i-1], "--jobs") == 0 ||
+                         strcmp(argv[i-1], "--undo-budget") == 0 ||
+                         strcmp(argv[i-1], "--keep-backups") == 0 ||
+                         strcmp(argv[i-1], "--autosave") == 0 ||
+                         strcmp(argv[i-1], "--max-input") == 0 ||
+                         strcmp(argv[i-1], "--batch") == 0)) {
+                continue;
+            }
+            files[num_files++] = argv[i];
+        }
+    }
+    if (batch.enabled)
+        return batchRun(files, num_files);
+    bufferInit();
+
+    if (server.enabled)
+        serverRun(files, num_files);
+    if (isatty(STDIN_FILENO) && isatty(STDOUT_FILENO) && !ec.follow &&
+        serverAttach(files, num_files))
+        return 0;
+
     // Check if input is being redirected
     if (!isatty(STDIN_FILENO)) {
         // Open terminal device for later use
@@ -2832,37 +9654,32 @@ int main(int argc, char* argv[]) {
         if (tcgetattr(tty, &ec.orig_termios) == -1)
             die("tcgetattr");
 
-        // Read from stdin
-        editorOpenFromStdin();
-        
-        // Switch stdin to the terminal
+        // Keep reading the pipe once the editor is up, with the
+        // terminal as stdin. Files named go in the buffers after it.
+        streamOpen(fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3));
         dup2(tty, STDIN_FILENO);
         close(tty);
-    } else if (arg_response > 0) {
-        // Find the filename (last non-option argument)
-        char* filename = NULL;
-        for (int i = argc - 1; i > 0; i--) {
-            if (argv[i][0] != '-') {
-                // Skip option values
-                if (i > 1 && (strncmp(argv[i-1], "-w", 2) == 0 || 
-                             strncmp(argv[i-1], "-l", 2) == 0)) {
-                    continue;
-                }
-                filename = argv[i];
-                break;
-            }
-        }
-        if (filename) {
-            editorOpen(filename);
+        for (int i = 0; i < num_files; i++)
+            bufferAdd(files[i]);
+    } else if (num_files > 0) {
+        if (ec.follow) {
+            followOpen(files[0]);
         } else {
-            editorInsertRow(0, "", 0);
+            editorOpen(files[0]);
+            journalSetFile(files[0]);
+            undoHistorySetFile(files[0]);
         }
+        // The others are read when first shown.
+        for (int i = 1; i < num_files; i++)
+            bufferAdd(files[i]);
     } else {
         editorInsertRow(0, "", 0);
     }
+    free(files);
     
     enableRawMode();
     editorSetStatusMessage(" Ctrl-Q to quit | Ctrl-S to save | (mel -h | --help for more info)");
+    journalRecover();
     
     while (1) {
         editorRefreshScreen();